@@ -1,20 +1,207 @@
-/*
+#pragma once
+#include "Object.h"
+#include "Light.h"
+#include "Geometry.h"
+#include "Bvh.h"
+#include <vector>
+#include <optional>
+#include <limits>
+#include <array>
 
-// Fulfills the Scene concept while using spatial partitioning
+// Fulfills the Scene concept while using a bounding volume hierarchy
 //  to accelerate intersection finding (unlike BasicScene).
 class AcceleratedScene
 {
 public:
-	explicit AcceleratedScene(std::vector<Object> objects);
+	AcceleratedScene() = default;
+	explicit AcceleratedScene(std::vector<Object> objects, MaterialTable materials = {}, std::vector<Light> lights = {});
 
-	Hit findFirstHit(const Ray& ray) const;
+	// Adopts a hierarchy built earlier (see SceneCache.h); objects have to be in its leaf order
+	AcceleratedScene(std::vector<Object> objects, MaterialTable materials, std::vector<Light> lights, Bvh bvh);
 
-	template<typename ObjectType>
-	void addObject(ObjectType&& object);
+	std::optional<Hit> findFirstHit(const Ray& ray) const;
+
+	// Whether anything lies on the ray closer than tmax
+	// Cheaper than findFirstHit(), as it stops at the first hit found.
+	bool isOccluded(const Ray& ray, float tmax) const;
+
+	// Finds the first hit of each active lane of the packet
+	// Incoherent packets (mixed direction signs) fall back to single rays.
+	template<int N>
+	std::array<std::optional<Hit>, N> findFirstHits(const RayPacket<N>& packet, LaneMask activeMask) const;
+
+	// Objects are reordered to match the leaves of the hierarchy
+	const auto& getObjects() const { return objects; }
+	const auto& getMaterials() const { return materials; }
+	const auto& getLights() const { return lights; }
+	const auto& getBvh() const { return bvh; }
+
+	// Modifies the objects through fn(std::vector<Object>&) and rebuilds the hierarchy
+	template<typename Fn>
+	void updateObjects(Fn&& fn);
 
 private:
 	std::vector<Object> objects;
-	Octree<Object> objectTree;
+	MaterialTable materials;
+	std::vector<Light> lights;
+	Bvh bvh;
+
+	void rebuild();
 };
 
-*/
+AcceleratedScene::AcceleratedScene(std::vector<Object> objects, MaterialTable materials, std::vector<Light> lights) :
+	objects(std::move(objects)),
+	materials(std::move(materials)),
+	lights(std::move(lights))
+{
+	rebuild();
+}
+
+AcceleratedScene::AcceleratedScene(std::vector<Object> objects, MaterialTable materials, std::vector<Light> lights, Bvh bvh) :
+	objects(std::move(objects)),
+	materials(std::move(materials)),
+	lights(std::move(lights)),
+	bvh(std::move(bvh))
+{}
+
+template<typename Fn>
+void AcceleratedScene::updateObjects(Fn&& fn)
+{
+	fn(objects);
+	rebuild();
+}
+
+void AcceleratedScene::rebuild()
+{
+	std::vector<Aabb> bounds;
+	bounds.reserve(objects.size());
+	for (const auto& obj : objects)
+		bounds.push_back(std::visit([](const auto& shape) { return getBounds(shape); }, obj.shape));
+
+	bvh = Bvh{bounds};
+
+	// Store objects in leaf order, so that leaves reference them directly
+	std::vector<Object> orderedObjects;
+	orderedObjects.reserve(objects.size());
+	for (auto index : bvh.getPrimOrder())
+		orderedObjects.push_back(std::move(objects[index]));
+	objects = std::move(orderedObjects);
+}
+
+std::optional<Hit> AcceleratedScene::findFirstHit(const Ray& ray) const
+{
+	std::optional<Hit> minHit;
+	if (objects.empty())
+		return minHit;
+
+	traverseBvh(bvh.getNodes().data(), ray, std::numeric_limits<float>::infinity(),
+		[this, &ray, &minHit](uint32_t objIndex, float& tmax) {
+			const auto& obj = objects[objIndex];
+			auto intersection = findIntersection(ray, obj, tmax);
+			if (intersection) {
+				auto& [hitpos, t, primIndex] = *intersection;
+				if (t < tmax) {
+					tmax = t;
+					minHit = Hit{hitpos, &obj, primIndex};
+				}
+			}
+		}
+	);
+
+	return minHit;
+}
+
+bool AcceleratedScene::isOccluded(const Ray& ray, float tmax) const
+{
+	bool isHit = false;
+	if (objects.empty())
+		return isHit;
+
+	traverseBvh(bvh.getNodes().data(), ray, tmax,
+		[this, &ray, &isHit](uint32_t objIndex, float& tmax) {
+			if (hasIntersection(ray, objects[objIndex], tmax)) {
+				isHit = true;
+				tmax = -1.f; // any hit will do, end the traversal
+			}
+		}
+	);
+
+	return isHit;
+}
+
+template<int N>
+std::array<std::optional<Hit>, N> AcceleratedScene::findFirstHits(const RayPacket<N>& packet, LaneMask activeMask) const
+{
+	std::array<std::optional<Hit>, N> hits;
+	if (objects.empty())
+		return hits;
+
+	if (getLaneCount(activeMask) < 2 || !isCoherent(packet, activeMask))
+	{
+		for (int lane = 0; lane < N; ++lane)
+		{
+			if ((activeMask >> lane) & 1)
+				hits[lane] = findFirstHit(packet.getRay(lane));
+		}
+		return hits;
+	}
+
+	float invDirX[N], invDirY[N], invDirZ[N];
+	float tnear[N];
+	const Object* hitObjs[N] = {};
+	uint32_t primIndices[N] = {};
+	for (int lane = 0; lane < N; ++lane)
+	{
+		invDirX[lane] = 1.f/packet.dirX[lane];
+		invDirY[lane] = 1.f/packet.dirY[lane];
+		invDirZ[lane] = 1.f/packet.dirZ[lane];
+		tnear[lane] = (activeMask >> lane) & 1 ? std::numeric_limits<float>::infinity() : 0.f;
+	}
+
+	// All active lanes share direction signs, so children are visited in a common order
+	const int firstLane = __builtin_ctz(activeMask);
+	const bool dirNegative[3] = {packet.dirX[firstLane] < 0.f, packet.dirY[firstLane] < 0.f, packet.dirZ[firstLane] < 0.f};
+
+	// Traverse the hierarchy once for the whole packet, tracking which lanes enter each node
+	const auto& nodes = bvh.getNodes();
+	uint32_t stack[64];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+	while (stackSize > 0)
+	{
+		const uint32_t nodeIndex = stack[--stackSize];
+		const BvhNode& node = nodes[nodeIndex];
+		const LaneMask nodeMask = intersectPacket(packet, invDirX, invDirY, invDirZ, node.bounds, tnear, activeMask);
+		if (!nodeMask)
+			continue;
+
+		if (node.primCount > 0)
+		{
+			for (uint32_t i = 0; i < node.primCount; ++i)
+			{
+				const auto& obj = objects[node.offset + i];
+				const LaneMask hitMask = intersectPacket(packet, obj, tnear, primIndices, nodeMask);
+				for (int lane = 0; lane < N; ++lane)
+					hitObjs[lane] = (hitMask >> lane) & 1 ? &obj : hitObjs[lane];
+			}
+		}
+		else
+		{
+			uint32_t nearChild = nodeIndex + 1;
+			uint32_t farChild = node.offset;
+			if (dirNegative[node.axis])
+				std::swap(nearChild, farChild);
+
+			assert(stackSize + 2 <= 64);
+			stack[stackSize++] = farChild;
+			stack[stackSize++] = nearChild;
+		}
+	}
+
+	for (int lane = 0; lane < N; ++lane)
+	{
+		if (hitObjs[lane])
+			hits[lane] = Hit{packet.origin + tnear[lane]*packet.getDir(lane), hitObjs[lane], primIndices[lane]};
+	}
+	return hits;
+}
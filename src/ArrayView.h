@@ -0,0 +1,26 @@
+#pragma once
+#include <vector>
+#include <cstddef>
+#include <cassert>
+
+// Read-only view of a contiguous array owned elsewhere (a vector, a mapped file, ...)
+template <typename T>
+class ArrayView
+{
+public:
+	ArrayView() = default;
+	ArrayView(const T* ptr, size_t count) : ptr(ptr), count(count) {}
+	ArrayView(const std::vector<T>& v) : ptr(v.data()), count(v.size()) {}
+
+	const T* data() const { return ptr; }
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	const T& operator[](size_t i) const { assert(i < count); return ptr[i]; }
+
+	const T* begin() const { return ptr; }
+	const T* end() const { return ptr + count; }
+
+private:
+	const T* ptr = nullptr;
+	size_t count = 0;
+};
@@ -1,34 +1,157 @@
 #pragma once
 #include "Object.h"
+#include "Light.h"
 #include "Geometry.h"
+#include "SimdIntersection.h"
 #include <vector>
 #include <optional>
+#include <limits>
+#include <array>
+#include <cmath>
+#include <cstdint>
 
 // Basic (non-accelerated) implementation of a scene
 // Finding the first ray-object intersection is implemented
 //  by performing an intersection check with each object.
-struct BasicScene
+// Spheres and triangles are mirrored into structure-of-arrays buffers
+//  and tested several at a time with SIMD kernels.
+class BasicScene
 {
-	std::vector<Object> objects;
+public:
+	BasicScene() = default;
+	explicit BasicScene(std::vector<Object> objects, MaterialTable materials = {}, std::vector<Light> lights = {});
 
 	std::optional<Hit> findFirstHit(const Ray& ray) const;
+
+	// Whether anything lies on the ray closer than tmax
+	// Cheaper than findFirstHit(), as it stops at the first hit found.
+	bool isOccluded(const Ray& ray, float tmax) const;
+
+	// Finds the first hit of each active lane of the packet, as findFirstHit() does
+	template<int N>
+	std::array<std::optional<Hit>, N> findFirstHits(const RayPacket<N>& packet, LaneMask activeMask) const;
+
+	const auto& getObjects() const { return objects; }
+	const auto& getMaterials() const { return materials; }
+	const auto& getLights() const { return lights; }
+
+	// Modifies the objects through fn(std::vector<Object>&) and updates the shape buffers
+	template<typename Fn>
+	void updateObjects(Fn&& fn);
+
+private:
+	std::vector<Object> objects;
+	MaterialTable materials;
+	std::vector<Light> lights;
+
+	SphereBuffer spheres;
+	TriangleBuffer triangles;
+	std::vector<uint32_t> sphereObjects;   // buffer index -> object index
+	std::vector<uint32_t> triangleObjects; // buffer index -> object index
+	std::vector<uint32_t> otherObjects;    // shapes without a SIMD kernel (meshes)
+
+	void rebuild();
 };
 
-std::optional<Hit> BasicScene::findFirstHit(const Ray& ray) const
+BasicScene::BasicScene(std::vector<Object> objects, MaterialTable materials, std::vector<Light> lights) :
+	objects(std::move(objects)),
+	materials(std::move(materials)),
+	lights(std::move(lights))
 {
-	std::optional<Hit> minHit;
-	float minT = 0;
-	for (const auto& obj : objects)
+	rebuild();
+}
+
+template<typename Fn>
+void BasicScene::updateObjects(Fn&& fn)
+{
+	fn(objects);
+	rebuild();
+}
+
+void BasicScene::rebuild()
+{
+	spheres.clear();
+	triangles.clear();
+	sphereObjects.clear();
+	triangleObjects.clear();
+	otherObjects.clear();
+
+	for (uint32_t i = 0; i < objects.size(); ++i)
 	{
-		auto intersection = std::visit([&ray](const auto& shape) { return findIntersection(ray, shape); }, obj.shape);
-		if (intersection) {
-			auto& [hitpos, t] = *intersection;
-			if (!minHit || t < minT) {
-				minT = t;
-				minHit = Hit{hitpos, &obj};
-			}
+		if (auto* sphere = std::get_if<Sphere>(&objects[i].shape)) {
+			spheres.push(*sphere);
+			sphereObjects.push_back(i);
+		}
+		else if (auto* tri = std::get_if<Triangle>(&objects[i].shape)) {
+			triangles.push(*tri);
+			triangleObjects.push_back(i);
+		}
+		else
+			otherObjects.push_back(i);
+	}
+
+	spheres.pad();
+	triangles.pad();
+}
+
+std::optional<Hit> BasicScene::findFirstHit(const Ray& ray) const
+{
+	// Candidates are compared by (t, object index), so that ties resolve
+	//  to the first object like a plain loop over all objects would
+	float minT = std::numeric_limits<float>::infinity();
+	uint32_t minObject = UINT32_MAX;
+	uint32_t minPrimIndex = 0;
+	auto consider = [&](float t, uint32_t objIndex, uint32_t primIndex) {
+		if (t < minT || (t == minT && objIndex < minObject)) {
+			minT = t;
+			minObject = objIndex;
+			minPrimIndex = primIndex;
 		}
+	};
+
+	const BufferHit sphereHit = findNearestHit(ray, spheres, minT);
+	if (sphereHit.index != UINT32_MAX)
+		consider(sphereHit.t, sphereObjects[sphereHit.index], 0);
+
+	const BufferHit triangleHit = findNearestHit(ray, triangles, minT);
+	if (triangleHit.index != UINT32_MAX)
+		consider(triangleHit.t, triangleObjects[triangleHit.index], 0);
+
+	for (auto objIndex : otherObjects)
+	{
+		auto intersection = findIntersection(ray, objects[objIndex],
+			std::nextafter(minT, std::numeric_limits<float>::infinity()));
+		if (intersection)
+			consider(intersection->t, objIndex, intersection->primIndex);
+	}
+
+	if (minObject == UINT32_MAX)
+		return std::nullopt;
+	return Hit{ray.origin + minT*ray.dir, &objects[minObject], minPrimIndex};
+}
+
+bool BasicScene::isOccluded(const Ray& ray, float tmax) const
+{
+	if (hasHit(ray, spheres, tmax) || hasHit(ray, triangles, tmax))
+		return true;
+
+	for (auto objIndex : otherObjects)
+	{
+		if (hasIntersection(ray, objects[objIndex], tmax))
+			return true;
 	}
+	return false;
+}
 
-	return minHit;
+template<int N>
+std::array<std::optional<Hit>, N> BasicScene::findFirstHits(const RayPacket<N>& packet, LaneMask activeMask) const
+{
+	// Lane by lane: the SIMD kernels already test several shapes at once
+	std::array<std::optional<Hit>, N> hits;
+	for (int lane = 0; lane < N; ++lane)
+	{
+		if ((activeMask >> lane) & 1)
+			hits[lane] = findFirstHit(packet.getRay(lane));
+	}
+	return hits;
 }
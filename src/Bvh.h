@@ -0,0 +1,284 @@
+#pragma once
+#include "Geometry.h"
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <cstdint>
+#include <cassert>
+
+// Node of a flattened bounding volume hierarchy (32 bytes, two per cache line)
+// Nodes are stored in depth-first order: the first child of an inner node
+//  directly follows it, the second one is stored at `offset`.
+struct BvhNode
+{
+	Aabb bounds;
+	uint32_t offset;    // leaf: index of the first primitive, inner node: index of the second child
+	uint16_t primCount; // 0 for inner nodes
+	uint8_t axis;       // split axis of inner nodes, used for front-to-back traversal
+	uint8_t padding = 0;
+};
+
+static_assert(sizeof(BvhNode) == 32);
+
+// Bounding volume hierarchy built using the surface area heuristic
+// The hierarchy only references primitives by index; the owner is expected
+//  to reorder its primitives by getPrimOrder() so that leaves refer
+//  to contiguous ranges of primitives.
+class Bvh
+{
+public:
+	Bvh() = default;
+	explicit Bvh(const std::vector<Aabb>& primBounds, int maxLeafSize = 4);
+
+	// Adopts the nodes of a hierarchy built earlier, whose primitives are already
+	//  in leaf order; getPrimOrder() is then empty
+	explicit Bvh(std::vector<BvhNode> nodes) : nodes(std::move(nodes)) {}
+
+	const auto& getNodes() const { return nodes; }
+	const auto& getPrimOrder() const { return primOrder; }
+	Aabb getBounds() const { return nodes.empty() ? Aabb{} : nodes[0].bounds; }
+
+private:
+	static constexpr int binCount = 16;
+	static constexpr int maxSahDepth = 32; // deeper nodes use median splits, which bounds traversal stack size
+
+	std::vector<BvhNode> nodes;
+	std::vector<uint32_t> primOrder; // new position -> original primitive index
+
+	void buildNode(uint32_t nodeIndex, uint32_t begin, uint32_t end, int depth,
+		const std::vector<Aabb>& primBounds, const std::vector<vec3f>& centroids, int maxLeafSize);
+};
+
+// Deepest level of a hierarchy; traversal stacks hold 64 entries
+constexpr int maxBvhDepth = 62;
+
+// Whether nodes form a hierarchy over primCount primitives that traversal can walk safely:
+//  children stored after their parent, leaves within the primitives and no more than
+//  maxBvhDepth levels. For hierarchies read from files.
+bool isValidBvh(const BvhNode* nodes, size_t nodeCount, size_t primCount);
+
+// Finds the nearest primitive hit along the ray
+// intersectPrim(primIndex, tmax) tests a single primitive and lowers tmax
+//  when it finds a closer hit; subtrees farther than tmax are culled.
+// Setting tmax negative culls everything left, which ends an any-hit search.
+template<typename IntersectPrim>
+void traverseBvh(const BvhNode* nodes, const Ray& ray, float tmax, IntersectPrim&& intersectPrim);
+
+// .cpp
+Bvh::Bvh(const std::vector<Aabb>& primBounds, int maxLeafSize)
+{
+	assert(maxLeafSize > 0 && maxLeafSize <= UINT16_MAX);
+	if (primBounds.empty())
+		return;
+
+	std::vector<vec3f> centroids;
+	centroids.reserve(primBounds.size());
+	for (const auto& box : primBounds)
+		centroids.push_back(getCenter(box));
+
+	primOrder.resize(primBounds.size());
+	std::iota(begin(primOrder), end(primOrder), 0);
+
+	nodes.reserve(2*primBounds.size());
+	nodes.emplace_back();
+	buildNode(0, 0, uint32_t(primBounds.size()), 0, primBounds, centroids, maxLeafSize);
+	nodes.shrink_to_fit();
+}
+
+bool isValidBvh(const BvhNode* nodes, size_t nodeCount, size_t primCount)
+{
+	if (nodeCount == 0)
+		return primCount == 0;
+	if (nodeCount > UINT32_MAX)
+		return false;
+
+	// Children follow their parent, so a node's depth is known once the loop reaches it
+	std::vector<uint8_t> depths(nodeCount, 0);
+	for (size_t i = 0; i < nodeCount; ++i)
+	{
+		const BvhNode& node = nodes[i];
+		if (node.primCount > 0)
+		{
+			if (node.offset + size_t(node.primCount) > primCount)
+				return false;
+			continue;
+		}
+
+		if (node.axis > 2 || depths[i] >= maxBvhDepth || i + 1 >= nodeCount
+			|| node.offset <= i + 1 || node.offset >= nodeCount)
+			return false;
+		const uint8_t childDepth = uint8_t(depths[i] + 1);
+		depths[i + 1] = std::max(depths[i + 1], childDepth);
+		depths[node.offset] = std::max(depths[node.offset], childDepth);
+	}
+	return true;
+}
+
+void Bvh::buildNode(uint32_t nodeIndex, uint32_t begin, uint32_t end, int depth,
+	const std::vector<Aabb>& primBounds, const std::vector<vec3f>& centroids, int maxLeafSize)
+{
+	Aabb bounds;
+	Aabb centroidBounds;
+	for (uint32_t i = begin; i < end; ++i)
+	{
+		bounds = merge(bounds, primBounds[primOrder[i]]);
+		centroidBounds = merge(centroidBounds, centroids[primOrder[i]]);
+	}
+
+	const uint32_t count = end - begin;
+	const int axis = getLongestAxis(centroidBounds);
+	const float axisMin = centroidBounds.min[axis];
+	const float axisExtent = centroidBounds.max[axis] - axisMin;
+
+	auto makeLeaf = [&] {
+		nodes[nodeIndex] = BvhNode{bounds, begin, uint16_t(count), 0};
+	};
+
+	if (count == 1 || (count <= uint32_t(maxLeafSize) && axisExtent <= 0.f))
+		return makeLeaf();
+
+	// Binned SAH split search along the longest centroid axis
+	uint32_t mid = begin;
+	if (axisExtent > 0.f && depth < maxSahDepth)
+	{
+		auto getBin = [&](uint32_t prim) {
+			int bin = int(binCount * (centroids[prim][axis] - axisMin) / axisExtent);
+			return std::clamp(bin, 0, binCount-1);
+		};
+
+		Aabb binBounds[binCount];
+		uint32_t binPrimCounts[binCount] = {};
+		for (uint32_t i = begin; i < end; ++i)
+		{
+			const int bin = getBin(primOrder[i]);
+			binBounds[bin] = merge(binBounds[bin], primBounds[primOrder[i]]);
+			++binPrimCounts[bin];
+		}
+
+		// Sweep from the right to get the cost of the right-hand side of each split
+		float rightAreas[binCount];
+		uint32_t rightCounts[binCount];
+		Aabb accum;
+		uint32_t accumCount = 0;
+		for (int bin = binCount-1; bin > 0; --bin)
+		{
+			accum = merge(accum, binBounds[bin]);
+			accumCount += binPrimCounts[bin];
+			rightAreas[bin] = getSurfaceArea(accum);
+			rightCounts[bin] = accumCount;
+		}
+
+		// Split cost relative to intersecting a single primitive
+		constexpr float traversalCost = 0.5f;
+		float bestCost = std::numeric_limits<float>::infinity();
+		int bestSplit = -1;
+		accum = Aabb{};
+		accumCount = 0;
+		for (int split = 1; split < binCount; ++split)
+		{
+			accum = merge(accum, binBounds[split-1]);
+			accumCount += binPrimCounts[split-1];
+			if (accumCount == 0 || rightCounts[split] == 0)
+				continue;
+			const float cost = getSurfaceArea(accum)*accumCount + rightAreas[split]*rightCounts[split];
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestSplit = split;
+			}
+		}
+
+		const float leafCost = float(count);
+		bestCost = traversalCost + bestCost / getSurfaceArea(bounds);
+		if (count <= uint32_t(maxLeafSize) && (bestSplit < 0 || bestCost >= leafCost))
+			return makeLeaf();
+
+		if (bestSplit >= 0)
+		{
+			auto it = std::partition(primOrder.begin() + begin, primOrder.begin() + end,
+				[&](uint32_t prim) { return getBin(prim) < bestSplit; });
+			mid = uint32_t(it - primOrder.begin());
+		}
+	}
+
+	// Degenerate split (coincident centroids, too deep) -> median split
+	if (mid == begin || mid == end)
+	{
+		mid = begin + count/2;
+		std::nth_element(primOrder.begin() + begin, primOrder.begin() + mid, primOrder.begin() + end,
+			[&](uint32_t a, uint32_t b) { return centroids[a][axis] < centroids[b][axis]; });
+	}
+
+	const auto firstChild = uint32_t(nodes.size());
+	nodes.emplace_back();
+	buildNode(firstChild, begin, mid, depth+1, primBounds, centroids, maxLeafSize);
+
+	const auto secondChild = uint32_t(nodes.size());
+	nodes.emplace_back();
+	buildNode(secondChild, mid, end, depth+1, primBounds, centroids, maxLeafSize);
+
+	nodes[nodeIndex] = BvhNode{bounds, secondChild, 0, uint8_t(axis)};
+}
+
+template<typename IntersectPrim>
+void traverseBvh(const BvhNode* nodes, const Ray& ray, float tmax, IntersectPrim&& intersectPrim)
+{
+	const vec3f invDir = {1.f/ray.dir.x, 1.f/ray.dir.y, 1.f/ray.dir.z};
+	const bool dirNegative[3] = {invDir.x < 0.f, invDir.y < 0.f, invDir.z < 0.f};
+
+	struct StackEntry
+	{
+		uint32_t nodeIndex;
+		float tnear;
+	};
+	StackEntry stack[64];
+	int stackSize = 0;
+	uint32_t nodeIndex = 0;
+
+	if (!findIntersection(ray, invDir, nodes[0].bounds, tmax))
+		return;
+
+	while (true)
+	{
+		const BvhNode& node = nodes[nodeIndex];
+		if (node.primCount > 0)
+		{
+			for (uint32_t i = 0; i < node.primCount; ++i)
+				intersectPrim(node.offset + i, tmax);
+		}
+		else
+		{
+			// Visit the nearer child first, the farther one may get culled by then
+			uint32_t nearChild = nodeIndex + 1;
+			uint32_t farChild = node.offset;
+			if (dirNegative[node.axis])
+				std::swap(nearChild, farChild);
+
+			auto nearHit = findIntersection(ray, invDir, nodes[nearChild].bounds, tmax);
+			auto farHit = findIntersection(ray, invDir, nodes[farChild].bounds, tmax);
+			if (nearHit && farHit)
+			{
+				if (*farHit < *nearHit) {
+					std::swap(nearChild, farChild);
+					std::swap(nearHit, farHit);
+				}
+				assert(stackSize < 64);
+				stack[stackSize++] = {farChild, *farHit};
+				nodeIndex = nearChild;
+				continue;
+			}
+			if (nearHit || farHit)
+			{
+				nodeIndex = nearHit ? nearChild : farChild;
+				continue;
+			}
+		}
+
+		// Pop the next subtree that is still closer than the nearest hit
+		do {
+			if (stackSize == 0)
+				return;
+			--stackSize;
+		} while (stack[stackSize].tnear > tmax);
+		nodeIndex = stack[stackSize].nodeIndex;
+	}
+}
@@ -0,0 +1,834 @@
+#pragma once
+#include "ParallelRendering.h"
+#include "AcceleratedScene.h"
+#include "SceneCache.h"
+#include "SWScreen.h"
+#include "ThreadPool.h"
+#include "TileScheduling.h"
+#include <string>
+#include <vector>
+#include <deque>
+#include <optional>
+#include <fstream>
+#include <chrono>
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+#include <type_traits>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+// Rendering a frame across worker processes
+// A coordinator connects to the workers, sends them the scene once (in the scene cache
+//  format, see SceneCache.h) and then, per frame, the camera and settings. Tiles are
+//  handed out in batches sized by each worker's measured throughput, and the rendered
+//  pixels are written into the coordinator's screen as they come back. The tiles of a
+//  worker that fails or stops answering go to the others; with no worker left, the
+//  coordinator renders the rest itself.
+// Workers serve one coordinator at a time (see serveCoordinator()). Addresses are
+//  "unix:PATH" for Unix domain sockets and "HOST:PORT" for TCP. Messages are sent in
+//  the native layout, so coordinator and workers need the same build and byte order,
+//  which the handshake checks.
+
+// Thrown when a connection fails or the other side breaks the protocol
+struct ConnectionException : std::runtime_error
+{
+	explicit ConnectionException(const std::string& msg) :
+		std::runtime_error(msg)
+	{}
+};
+
+// Connected or listening stream socket, closed on destruction
+class Socket
+{
+public:
+	Socket() = default;
+	explicit Socket(int fd) : fd(fd) {}
+	Socket(Socket&& other) noexcept : fd(other.fd) { other.fd = -1; }
+	Socket& operator=(Socket&& other) noexcept { std::swap(fd, other.fd); return *this; }
+	~Socket() { close(); }
+
+	int getFd() const { return fd; }
+	bool isOpen() const { return fd >= 0; }
+	void close();
+
+	// Makes a send or receive that makes no progress for this long fail
+	void setTimeout(double seconds);
+
+	// Throw ConnectionException on failure; receiveAll() also when the peer closes the connection
+	void sendAll(const void* data, size_t size);
+	void receiveAll(void* data, size_t size);
+
+	// Like receiveAll(), but returns false if the peer closed the connection before sending anything
+	bool tryReceiveAll(void* data, size_t size);
+
+private:
+	int fd = -1;
+};
+
+Socket connectSocket(const std::string& address);
+Socket listenSocket(const std::string& address);
+Socket acceptSocket(const Socket& listener);
+
+// Coordinator side
+class DistributedRenderer
+{
+public:
+	// Connects to the workers; throws ConnectionException if one can't be reached
+	DistributedRenderer(const std::vector<std::string>& workerAddresses, ThreadPool& threadPool);
+
+	// Sends the scene to all workers, which keep it for the following frames
+	// The renderer keeps a copy to render tiles itself when all workers are lost.
+	void setScene(AcceleratedScene scene);
+
+	// Renders the whole screen; settings.tileSize is the tile edge length handed out (0 = 64)
+	void render(SWScreen& screen, const Camera& camera, const RenderSettings& settings = {},
+		std::optional<CameraSpan> span = std::nullopt);
+
+	struct WorkerStats
+	{
+		std::string address;
+		bool isConnected;
+		uint64_t tilesRendered;
+		double pixelsPerSecond; // measured by the worker, 0 until its first tile
+	};
+	std::vector<WorkerStats> getWorkerStats() const;
+
+	uint64_t getLocalTileCount() const { return localTileCount; } // tiles rendered without a worker
+
+private:
+	struct Worker
+	{
+		std::string address;
+		Socket socket;
+		std::vector<uint32_t> assignedTiles;
+		std::chrono::steady_clock::time_point lastMessage;
+		uint64_t tilesRendered = 0;
+		double pixelsPerSecond = 0;
+	};
+
+	std::vector<Worker> workers;
+	ThreadPool& threadPool;
+	std::optional<AcceleratedScene> scene;
+	uint32_t frameIndex = 0;
+	uint64_t localTileCount = 0;
+
+	// A worker with tiles assigned is given up after this long without a message
+	static constexpr double workerTimeoutSeconds = 60;
+
+	// Closes the connection and returns the worker's tiles to pending
+	void dropWorker(Worker& worker, std::deque<uint32_t>& pending);
+
+	// Tiles to send the worker at once, proportional to its share of the total throughput
+	size_t getBatchSize(const Worker& worker, size_t pendingCount) const;
+};
+
+// Worker side: serves one coordinator connection until the coordinator closes it
+// Throws ConnectionException if the connection fails.
+void serveCoordinator(Socket& connection, ThreadPool& threadPool);
+
+// .cpp
+namespace detail
+{
+	enum class MessageType : uint32_t
+	{
+		Hello,  // HelloMessage, sent by both sides first
+		Scene,  // uint64_t source hash followed by a scene cache file
+		Frame,  // FrameMessage
+		Tiles,  // PixelRect array, to render for the current frame
+		Pixels  // PixelsMessage followed by the rect's pixels, row by row
+	};
+
+	struct MessageHeader
+	{
+		MessageType type;
+		uint32_t padding = 0;
+		uint64_t size; // of the payload
+	};
+
+	struct HelloMessage
+	{
+		char magic[8] = {'R', 'T', 'D', 'I', 'S', 'T', 'R', 'B'};
+		uint32_t version = 1;
+		uint32_t byteOrder = 0x01020304;
+		uint64_t layoutSize; // size of the messages below, catches builds of different layout
+	};
+
+	struct FrameMessage
+	{
+		uint32_t frameIndex;
+		int32_t width;
+		int32_t height;
+		// Copied as is: rebuilding the camera would normalize its direction again, which
+		//  can change it by an ulp and the image with it
+		alignas(Camera) unsigned char camera[sizeof(Camera)];
+		uint32_t hasSpan;
+		CameraSpan span;
+		RenderSettings settings;
+	};
+
+	struct PixelsMessage
+	{
+		uint32_t frameIndex;
+		PixelRect rect;
+		float seconds; // render time on the worker
+	};
+
+	static_assert(std::is_trivially_copyable_v<Camera>);
+	static_assert(std::is_trivially_copyable_v<FrameMessage> && std::is_trivially_copyable_v<PixelsMessage>);
+	static_assert(std::is_trivially_copyable_v<RgbColor> && sizeof(RgbColor) == 12);
+
+	HelloMessage makeHello()
+	{
+		HelloMessage hello;
+		hello.layoutSize = sizeof(FrameMessage) + sizeof(PixelsMessage) + sizeof(RenderSettings);
+		return hello;
+	}
+
+	bool isCompatible(const HelloMessage& a, const HelloMessage& b)
+	{
+		return std::memcmp(a.magic, b.magic, sizeof(a.magic)) == 0 && a.version == b.version
+			&& a.byteOrder == b.byteOrder && a.layoutSize == b.layoutSize;
+	}
+
+	// Largest payload of each message type, checked before anything is allocated for it
+	// Pixels are bounded by the tiles handed out; scenes are only bounded loosely as they
+	//  are streamed to a file by receiveScene() rather than held in memory.
+	uint64_t getMaxPayloadSize(MessageType type, int tileSize)
+	{
+		switch (type)
+		{
+		case MessageType::Hello: return sizeof(HelloMessage);
+		case MessageType::Scene: return uint64_t(1) << 40;
+		case MessageType::Frame: return sizeof(FrameMessage);
+		case MessageType::Tiles: return 1024*sizeof(PixelRect);
+		case MessageType::Pixels: return sizeof(PixelsMessage) + uint64_t(tileSize)*uint64_t(tileSize)*sizeof(RgbColor);
+		}
+		return 0;
+	}
+
+	void sendMessage(Socket& socket, MessageType type, const void* data, size_t size,
+		const void* extraData = nullptr, size_t extraSize = 0)
+	{
+		const MessageHeader header{type, 0, uint64_t(size + extraSize)};
+		socket.sendAll(&header, sizeof(header));
+		socket.sendAll(data, size);
+		if (extraSize > 0)
+			socket.sendAll(extraData, extraSize);
+	}
+
+	// Returns false if the peer closed the connection between messages
+	// Pixels messages are accepted for tiles of up to tileSize pixels square.
+	bool receiveHeader(Socket& socket, MessageHeader& header, int tileSize = 0)
+	{
+		if (!socket.tryReceiveAll(&header, sizeof(header)))
+			return false;
+		if (header.size > getMaxPayloadSize(header.type, tileSize))
+			throw ConnectionException("Received a message of unexpected size");
+		return true;
+	}
+
+	// Receives the payload following header into memory; not for scenes
+	void receivePayload(Socket& socket, const MessageHeader& header, std::vector<char>& payload)
+	{
+		if (header.type == MessageType::Scene)
+			throw ConnectionException("Received an unexpected scene");
+		payload.resize(size_t(header.size));
+		socket.receiveAll(payload.data(), payload.size());
+	}
+
+	// Receives the payload of a Scene message into the file at path, block by block;
+	//  returns the source hash it starts with
+	uint64_t receiveScene(Socket& socket, const MessageHeader& header, const char* path)
+	{
+		uint64_t sourceHash;
+		if (header.size < sizeof(sourceHash))
+			throw ConnectionException("Truncated message");
+		socket.receiveAll(&sourceHash, sizeof(sourceHash));
+
+		std::ofstream file{path, std::ios::binary};
+		std::vector<char> block(size_t(1) << 20);
+		for (uint64_t left = header.size - sizeof(sourceHash); left > 0;)
+		{
+			const size_t size = size_t(std::min<uint64_t>(left, block.size()));
+			socket.receiveAll(block.data(), size);
+			if (!file.write(block.data(), std::streamsize(size)))
+				throw ConnectionException(std::string{"Can't write the received scene to "} + path);
+			left -= size;
+		}
+		return sourceHash;
+	}
+
+	// Header and payload of a message other than a scene; false as receiveHeader()
+	bool receiveMessage(Socket& socket, MessageType& type, std::vector<char>& payload, int tileSize = 0)
+	{
+		MessageHeader header;
+		if (!receiveHeader(socket, header, tileSize))
+			return false;
+		receivePayload(socket, header, payload);
+		type = header.type;
+		return true;
+	}
+
+	template <typename T>
+	T readMessage(const std::vector<char>& payload, size_t offset = 0)
+	{
+		if (payload.size() < offset + sizeof(T))
+			throw ConnectionException("Truncated message");
+		T message;
+		std::memcpy(&message, payload.data() + offset, sizeof(T));
+		return message;
+	}
+
+	void exchangeHello(Socket& socket)
+	{
+		const HelloMessage hello = makeHello();
+		sendMessage(socket, MessageType::Hello, &hello, sizeof(hello));
+
+		// Checked before the payload is read: anything else can send any header
+		MessageHeader header;
+		HelloMessage peerHello;
+		if (!socket.tryReceiveAll(&header, sizeof(header)) || header.type != MessageType::Hello
+			|| header.size != sizeof(peerHello))
+			throw ConnectionException("Peer isn't a compatible raytracer build");
+		socket.receiveAll(&peerHello, sizeof(peerHello));
+		if (!isCompatible(hello, peerHello))
+			throw ConnectionException("Peer isn't a compatible raytracer build");
+	}
+
+	// "unix:PATH" -> PATH, otherwise empty
+	std::string getUnixPath(const std::string& address)
+	{
+		return address.compare(0, 5, "unix:") == 0 ? address.substr(5) : std::string{};
+	}
+
+	sockaddr_un makeUnixAddress(const std::string& path)
+	{
+		sockaddr_un addr = {};
+		addr.sun_family = AF_UNIX;
+		if (path.size() >= sizeof(addr.sun_path))
+			throw ConnectionException("Socket path too long: " + path);
+		std::strcpy(addr.sun_path, path.c_str());
+		return addr;
+	}
+
+	// Resolves "HOST:PORT" and calls fn(socket fd, addrinfo) for each candidate
+	//  until it returns true; returns that socket
+	template <typename Fn>
+	Socket openTcpSocket(const std::string& address, bool passive, Fn&& fn)
+	{
+		const auto colon = address.find_last_of(':');
+		if (colon == std::string::npos)
+			throw ConnectionException("Expected unix:PATH or HOST:PORT but got " + address);
+		const std::string host = address.substr(0, colon);
+		const std::string port = address.substr(colon + 1);
+
+		addrinfo hints = {};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = passive ? AI_PASSIVE : 0;
+		addrinfo* results = nullptr;
+		if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &results) != 0)
+			throw ConnectionException("Can't resolve " + address);
+
+		Socket socket;
+		for (addrinfo* info = results; info && !socket.isOpen(); info = info->ai_next)
+		{
+			Socket candidate{::socket(info->ai_family, info->ai_socktype, info->ai_protocol)};
+			if (candidate.isOpen() && fn(candidate.getFd(), *info))
+				socket = std::move(candidate);
+		}
+		freeaddrinfo(results);
+		if (!socket.isOpen())
+			throw ConnectionException("Can't " + std::string{passive ? "listen on " : "connect to "} + address);
+		return socket;
+	}
+
+	// Splits a tile handed to a worker among its threads
+	std::vector<PixelRect> splitTile(const PixelRect& tile, int size)
+	{
+		std::vector<PixelRect> parts;
+		for (int y = tile.y; y < tile.y + tile.h; y += size)
+			for (int x = tile.x; x < tile.x + tile.w; x += size)
+				parts.push_back({x, y, std::min(size, tile.x + tile.w - x), std::min(size, tile.y + tile.h - y)});
+		return parts;
+	}
+
+	Camera getCamera(const FrameMessage& frame)
+	{
+		Camera camera{{0, 0, 0}, {0, 0, -1}, 1};
+		std::memcpy(&camera, frame.camera, sizeof(Camera));
+		return camera;
+	}
+}
+
+void Socket::close()
+{
+	if (fd >= 0)
+		::close(fd);
+	fd = -1;
+}
+
+void Socket::sendAll(const void* data, size_t size)
+{
+	const char* bytes = static_cast<const char*>(data);
+	while (size > 0)
+	{
+		// A peer that went away must not kill the process with SIGPIPE
+		const ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent <= 0)
+			throw ConnectionException(std::string{"Can't send: "} + std::strerror(errno));
+		bytes += sent;
+		size -= size_t(sent);
+	}
+}
+
+void Socket::setTimeout(double seconds)
+{
+	timeval timeout = {};
+	timeout.tv_sec = time_t(seconds);
+	timeout.tv_usec = suseconds_t((seconds - double(timeout.tv_sec)) * 1e6);
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0
+		|| setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) != 0)
+		throw ConnectionException(std::string{"Can't set a timeout: "} + std::strerror(errno));
+}
+
+bool Socket::tryReceiveAll(void* data, size_t size)
+{
+	char* bytes = static_cast<char*>(data);
+	const size_t total = size;
+	while (size > 0)
+	{
+		const ssize_t received = recv(fd, bytes, size, 0);
+		if (received < 0 && errno == EINTR)
+			continue;
+		if (received == 0 && size == total)
+			return false;
+		if (received <= 0)
+			throw ConnectionException(received == 0 ? "Connection closed" : std::string{"Can't receive: "} + std::strerror(errno));
+		bytes += received;
+		size -= size_t(received);
+	}
+	return true;
+}
+
+void Socket::receiveAll(void* data, size_t size)
+{
+	if (!tryReceiveAll(data, size))
+		throw ConnectionException("Connection closed");
+}
+
+Socket connectSocket(const std::string& address)
+{
+	const std::string unixPath = detail::getUnixPath(address);
+	if (!unixPath.empty())
+	{
+		Socket socket{::socket(AF_UNIX, SOCK_STREAM, 0)};
+		const sockaddr_un addr = detail::makeUnixAddress(unixPath);
+		if (!socket.isOpen() || connect(socket.getFd(), reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0)
+			throw ConnectionException("Can't connect to " + address);
+		return socket;
+	}
+
+	return detail::openTcpSocket(address, false, [](int fd, const addrinfo& info) {
+		if (connect(fd, info.ai_addr, info.ai_addrlen) != 0)
+			return false;
+		const int noDelay = 1; // tile requests are small and latency bound
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+		return true;
+	});
+}
+
+Socket listenSocket(const std::string& address)
+{
+	const std::string unixPath = detail::getUnixPath(address);
+	if (!unixPath.empty())
+	{
+		Socket socket{::socket(AF_UNIX, SOCK_STREAM, 0)};
+		const sockaddr_un addr = detail::makeUnixAddress(unixPath);
+		unlink(unixPath.c_str()); // left over by an earlier worker
+		if (!socket.isOpen() || bind(socket.getFd(), reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0
+			|| listen(socket.getFd(), 4) != 0)
+			throw ConnectionException("Can't listen on " + address);
+		return socket;
+	}
+
+	return detail::openTcpSocket(address, true, [](int fd, const addrinfo& info) {
+		const int reuse = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+		return bind(fd, info.ai_addr, info.ai_addrlen) == 0 && listen(fd, 4) == 0;
+	});
+}
+
+Socket acceptSocket(const Socket& listener)
+{
+	while (true)
+	{
+		const int fd = accept(listener.getFd(), nullptr, nullptr);
+		if (fd >= 0)
+		{
+			const int noDelay = 1; // fails harmlessly on Unix domain sockets
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+			return Socket{fd};
+		}
+		if (errno != EINTR)
+			throw ConnectionException(std::string{"Can't accept: "} + std::strerror(errno));
+	}
+}
+
+DistributedRenderer::DistributedRenderer(const std::vector<std::string>& workerAddresses, ThreadPool& threadPool) :
+	threadPool(threadPool)
+{
+	for (const std::string& address : workerAddresses)
+	{
+		Worker worker;
+		worker.address = address;
+		worker.socket = connectSocket(address);
+		// A worker stalling within a message is given up like a silent one
+		worker.socket.setTimeout(workerTimeoutSeconds);
+		detail::exchangeHello(worker.socket);
+		workers.push_back(std::move(worker));
+	}
+}
+
+void DistributedRenderer::setScene(AcceleratedScene newScene)
+{
+	scene = std::move(newScene);
+
+	// Serialized through a temporary scene cache file
+	char tempPath[] = "/tmp/raytracer_sceneXXXXXX";
+	const int fd = mkstemp(tempPath);
+	if (fd < 0)
+		throw SceneCacheException("Can't create a temporary file");
+	::close(fd);
+
+	std::vector<char> payload(sizeof(uint64_t));
+	try
+	{
+		writeSceneCache(*scene, 0, tempPath);
+		std::ifstream file{tempPath, std::ios::binary | std::ios::ate};
+		payload.resize(sizeof(uint64_t) + size_t(file.tellg()));
+		file.seekg(0);
+		if (!file.read(payload.data() + sizeof(uint64_t), std::streamsize(payload.size() - sizeof(uint64_t))))
+			throw SceneCacheException(std::string{"Can't read "} + tempPath);
+	}
+	catch (...)
+	{
+		std::remove(tempPath);
+		throw;
+	}
+	std::remove(tempPath);
+
+	std::deque<uint32_t> unused;
+	for (Worker& worker : workers)
+	{
+		if (!worker.socket.isOpen())
+			continue;
+		try
+		{
+			detail::sendMessage(worker.socket, detail::MessageType::Scene, payload.data(), payload.size());
+		}
+		catch (const ConnectionException&)
+		{
+			dropWorker(worker, unused);
+		}
+	}
+}
+
+void DistributedRenderer::dropWorker(Worker& worker, std::deque<uint32_t>& pending)
+{
+	worker.socket.close();
+	pending.insert(pending.begin(), worker.assignedTiles.begin(), worker.assignedTiles.end());
+	worker.assignedTiles.clear();
+}
+
+size_t DistributedRenderer::getBatchSize(const Worker& worker, size_t pendingCount) const
+{
+	double totalThroughput = 0;
+	int liveCount = 0;
+	for (const Worker& other : workers)
+	{
+		if (other.socket.isOpen())
+		{
+			totalThroughput += other.pixelsPerSecond;
+			++liveCount;
+		}
+	}
+
+	// Unmeasured workers get a single tile to measure them by
+	if (worker.pixelsPerSecond <= 0 || totalThroughput <= 0)
+		return 1;
+
+	// Guided by the remaining work: batches shrink towards the end of the frame, so that
+	//  the last ones finish at about the same time
+	const double share = worker.pixelsPerSecond / totalThroughput;
+	const auto batch = size_t(double(pendingCount) * share / 2);
+	return std::clamp<size_t>(batch, 1, 16);
+}
+
+void DistributedRenderer::render(SWScreen& screen, const Camera& camera, const RenderSettings& settings,
+	std::optional<CameraSpan> span)
+{
+	assert(scene && "setScene() first");
+	using namespace detail;
+
+	const int tileSize = settings.tileSize > 0 ? settings.tileSize : 64;
+	const std::vector<PixelRect> tiles = makeTiles(screen.getW(), screen.getH(), tileSize);
+	std::deque<uint32_t> pending(tiles.size());
+	std::iota(begin(pending), end(pending), 0);
+	size_t doneCount = 0;
+	++frameIndex;
+
+	FrameMessage frame = {};
+	frame.frameIndex = frameIndex;
+	frame.width = screen.getW();
+	frame.height = screen.getH();
+	std::memcpy(frame.camera, &camera, sizeof(Camera));
+	frame.hasSpan = span.has_value();
+	frame.span = span.value_or(CameraSpan{});
+	frame.settings = settings;
+
+	const auto now = std::chrono::steady_clock::now();
+	for (Worker& worker : workers)
+	{
+		if (!worker.socket.isOpen())
+			continue;
+		try
+		{
+			sendMessage(worker.socket, MessageType::Frame, &frame, sizeof(frame));
+			worker.lastMessage = now;
+		}
+		catch (const ConnectionException&)
+		{
+			dropWorker(worker, pending);
+		}
+	}
+
+	std::vector<pollfd> pollFds;
+	std::vector<Worker*> polledWorkers;
+	std::vector<char> payload;
+	std::vector<PixelRect> batch;
+	while (doneCount < tiles.size())
+	{
+		// Keep two batches in flight per worker, so that none waits for the next one
+		pollFds.clear();
+		polledWorkers.clear();
+		for (Worker& worker : workers)
+		{
+			if (!worker.socket.isOpen())
+				continue;
+
+			const size_t batchSize = getBatchSize(worker, pending.size());
+			if (!pending.empty() && worker.assignedTiles.size() < 2*batchSize)
+			{
+				batch.clear();
+				while (!pending.empty() && batch.size() < batchSize)
+				{
+					worker.assignedTiles.push_back(pending.front());
+					batch.push_back(tiles[pending.front()]);
+					pending.pop_front();
+				}
+				try
+				{
+					if (worker.assignedTiles.size() == batch.size())
+						worker.lastMessage = std::chrono::steady_clock::now(); // was idle
+					sendMessage(worker.socket, MessageType::Tiles, batch.data(), batch.size()*sizeof(PixelRect));
+				}
+				catch (const ConnectionException&)
+				{
+					dropWorker(worker, pending);
+					continue;
+				}
+			}
+
+			if (!worker.assignedTiles.empty())
+			{
+				pollFds.push_back({worker.socket.getFd(), POLLIN, 0});
+				polledWorkers.push_back(&worker);
+			}
+		}
+
+		// Without workers, render what is left here
+		if (pollFds.empty())
+		{
+			const std::vector<PixelRect> localTiles = [&] {
+				std::vector<PixelRect> rects;
+				for (const uint32_t tile : pending)
+					rects.push_back(tiles[tile]);
+				return rects;
+			}();
+			parallelRenderTiles(*scene, screen, camera, threadPool, localTiles, span, settings);
+			localTileCount += localTiles.size();
+			doneCount += localTiles.size();
+			pending.clear();
+			break;
+		}
+
+		if (poll(pollFds.data(), nfds_t(pollFds.size()), 1000) < 0 && errno != EINTR)
+			throw ConnectionException(std::string{"Can't poll: "} + std::strerror(errno));
+
+		for (size_t i = 0; i < pollFds.size(); ++i)
+		{
+			Worker& worker = *polledWorkers[i];
+			if (!(pollFds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+			{
+				const double silentSeconds = std::chrono::duration<double>{std::chrono::steady_clock::now() - worker.lastMessage}.count();
+				if (silentSeconds > workerTimeoutSeconds)
+					dropWorker(worker, pending);
+				continue;
+			}
+
+			try
+			{
+				MessageType type;
+				if (!receiveMessage(worker.socket, type, payload, tileSize) || type != MessageType::Pixels)
+					throw ConnectionException("Worker " + worker.address + " hung up");
+
+				const auto pixels = readMessage<PixelsMessage>(payload);
+				const PixelRect& rect = pixels.rect;
+				const auto tile = std::find_if(begin(worker.assignedTiles), end(worker.assignedTiles), [&](uint32_t t) {
+					return tiles[t].x == rect.x && tiles[t].y == rect.y;
+				});
+				if (pixels.frameIndex != frameIndex || tile == end(worker.assignedTiles)
+					|| tiles[*tile].w != rect.w || tiles[*tile].h != rect.h
+					|| payload.size() != sizeof(PixelsMessage) + size_t(rect.w)*rect.h*sizeof(RgbColor))
+					throw ConnectionException("Worker " + worker.address + " sent an unexpected tile");
+
+				const char* colors = payload.data() + sizeof(PixelsMessage);
+				for (int y = 0; y < rect.h; ++y)
+				{
+					for (int x = 0; x < rect.w; ++x)
+					{
+						RgbColor color;
+						std::memcpy(&color, colors + (size_t(y)*rect.w + x)*sizeof(RgbColor), sizeof(RgbColor));
+						screen.putPixel({rect.x + x, rect.y + y}, color);
+					}
+				}
+
+				worker.assignedTiles.erase(tile);
+				worker.lastMessage = std::chrono::steady_clock::now();
+				++worker.tilesRendered;
+				++doneCount;
+
+				// Smoothed, as tiles differ in cost
+				if (pixels.seconds > 0)
+				{
+					const double measured = double(rect.w) * rect.h / pixels.seconds;
+					worker.pixelsPerSecond = worker.pixelsPerSecond > 0 ? 0.7*worker.pixelsPerSecond + 0.3*measured : measured;
+				}
+			}
+			catch (const ConnectionException&)
+			{
+				dropWorker(worker, pending);
+			}
+		}
+	}
+}
+
+std::vector<DistributedRenderer::WorkerStats> DistributedRenderer::getWorkerStats() const
+{
+	std::vector<WorkerStats> stats;
+	for (const Worker& worker : workers)
+		stats.push_back({worker.address, worker.socket.isOpen(), worker.tilesRendered, worker.pixelsPerSecond});
+	return stats;
+}
+
+void serveCoordinator(Socket& connection, ThreadPool& threadPool)
+{
+	using namespace detail;
+	exchangeHello(connection);
+
+	std::optional<AcceleratedScene> scene;
+	std::optional<FrameMessage> frame;
+	std::optional<SWScreen> screen;
+	std::vector<char> payload;
+	std::vector<RgbColor> pixels;
+	MessageHeader header;
+	while (receiveHeader(connection, header))
+	{
+		if (header.type != MessageType::Scene)
+			receivePayload(connection, header, payload);
+
+		switch (header.type)
+		{
+		case MessageType::Scene:
+		{
+			// Mapped from a temporary file, which can be unlinked right away
+			char tempPath[] = "/tmp/raytracer_sceneXXXXXX";
+			const int fd = mkstemp(tempPath);
+			if (fd < 0)
+				throw ConnectionException("Can't create a temporary file for the scene");
+			::close(fd);
+
+			try
+			{
+				const uint64_t sourceHash = receiveScene(connection, header, tempPath);
+				scene = readSceneCache(tempPath, sourceHash);
+			}
+			catch (...)
+			{
+				std::remove(tempPath);
+				throw;
+			}
+			std::remove(tempPath);
+			if (!scene)
+				throw ConnectionException("Received a damaged scene");
+			break;
+		}
+
+		case MessageType::Frame:
+			frame = readMessage<FrameMessage>(payload);
+			if (frame->width <= 0 || frame->height <= 0)
+				throw ConnectionException("Received an empty frame");
+			if (!screen || screen->getW() != frame->width || screen->getH() != frame->height)
+				screen.emplace(frame->width, frame->height);
+			break;
+
+		case MessageType::Tiles:
+		{
+			if (!scene || !frame)
+				throw ConnectionException("Received tiles before the scene and frame");
+
+			const Camera camera = getCamera(*frame);
+			const std::optional<CameraSpan> span = frame->hasSpan ? std::optional<CameraSpan>{frame->span} : std::nullopt;
+			for (size_t offset = 0; offset + sizeof(PixelRect) <= payload.size(); offset += sizeof(PixelRect))
+			{
+				const auto rect = readMessage<PixelRect>(payload, offset);
+				if (rect.x < 0 || rect.y < 0 || rect.w <= 0 || rect.h <= 0
+					|| rect.x + rect.w > frame->width || rect.y + rect.h > frame->height)
+					throw ConnectionException("Received a tile outside the frame");
+
+				const auto beginTimepoint = std::chrono::steady_clock::now();
+				parallelRenderTiles(*scene, *screen, camera, threadPool,
+					splitTile(rect, getAutoTileSize(rect.w, rect.h, threadPool.getThreadCount())), span, frame->settings);
+				const auto endTimepoint = std::chrono::steady_clock::now();
+
+				pixels.clear();
+				for (int y = rect.y; y < rect.y + rect.h; ++y)
+					for (int x = rect.x; x < rect.x + rect.w; ++x)
+						pixels.push_back(screen->getPixel({x, y}));
+
+				const PixelsMessage pixelsHeader{frame->frameIndex, rect, std::chrono::duration<float>{endTimepoint - beginTimepoint}.count()};
+				sendMessage(connection, MessageType::Pixels, &pixelsHeader, sizeof(pixelsHeader), pixels.data(), pixels.size()*sizeof(RgbColor));
+			}
+			break;
+		}
+
+		default:
+			throw ConnectionException("Received an unknown message");
+		}
+	}
+}
@@ -0,0 +1,171 @@
+#pragma once
+#include "Rendering.h"
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cassert>
+
+// How the governor trades quality for frame time
+struct GovernorSettings
+{
+	double targetSeconds = 1.0 / 30; // frame time to stay within
+	// Quality is raised only when the next level is predicted to take at most this
+	//  fraction of the target, and only after that held for settleFrames frames in a row
+	double headroom = 0.8;
+	int settleFrames = 8;
+	// The next level up is tried after this many frames with headroom even when predicted
+	//  not to fit, as its prediction may stem from frames that were slow for other reasons
+	int probeFrames = 60;
+	float minResolutionScale = 0.25f;
+};
+
+// Picks render settings and resolution for each frame so that frames meet a time target
+// Quality levels go from the given maximum settings at full resolution down by halving
+//  the samples per pixel, then removing bounces, then lowering the resolution (to be
+//  upscaled to the window). The time of a level is learned from the frames rendered at
+//  it; levels not rendered yet are predicted from the nearest level that was, scaled by
+//  the number of rays the levels trace at most.
+// A frame over the target drops straight to a level predicted to fit with headroom;
+//  quality rises one level at a time, when predicted to fit or to probe the level.
+class FrameGovernor
+{
+public:
+	explicit FrameGovernor(RenderSettings maxQuality = {}, GovernorSettings settings = {});
+
+	// Reports the render time of a frame rendered at the given level
+	// Frames in flight when the level changed still report the level they used.
+	void addFrameTime(double seconds, int frameLevel);
+
+	RenderSettings getRenderSettings() const;
+	// Render resolution for a window of the given size
+	vec2i getRenderSize(int windowW, int windowH) const;
+
+	int getLevel() const { return level; } // 0 is the highest quality
+	auto getLevelCount() const { return int(levels.size()); }
+
+private:
+	struct Level
+	{
+		int samplesPerPixel;
+		int maxDepth;
+		float resolutionScale;
+		double cost;        // rays per window pixel at most
+		double seconds = 0; // of frames rendered at the level, smoothed; 0 until the first
+	};
+
+	RenderSettings maxQuality;
+	GovernorSettings settings;
+	std::vector<Level> levels;
+	int level = 0;
+	int headroomFrames = 0; // in a row, with the next level up predicted to fit
+	int probeCountdown = 0; // frames with headroom until the next level up is tried anyway
+
+	// 0 while no level was rendered
+	double predictSeconds(int levelIndex) const;
+};
+
+// .cpp
+FrameGovernor::FrameGovernor(RenderSettings maxQuality, GovernorSettings settings) :
+	maxQuality(maxQuality),
+	settings(settings)
+{
+	auto addLevel = [&](int samplesPerPixel, int maxDepth, float resolutionScale) {
+		// Each bounce spawns branchFactor rays per hit
+		double raysPerSample = 0;
+		double raysAtDepth = 1;
+		for (int depth = 0; depth <= maxDepth; ++depth)
+		{
+			raysPerSample += raysAtDepth;
+			raysAtDepth *= maxQuality.path.branchFactor;
+		}
+		const double cost = raysPerSample * samplesPerPixel * resolutionScale * resolutionScale;
+		levels.push_back({samplesPerPixel, maxDepth, resolutionScale, cost});
+	};
+
+	int samplesPerPixel = std::max(maxQuality.samplesPerPixel, 1);
+	int maxDepth = maxQuality.path.maxDepth;
+	for (; samplesPerPixel > 1; samplesPerPixel /= 2)
+		addLevel(samplesPerPixel, maxDepth, 1);
+	for (; maxDepth > 0; --maxDepth)
+		addLevel(1, maxDepth, 1);
+	for (float scale = 1; scale >= settings.minResolutionScale; scale *= 0.75f)
+		addLevel(1, 0, scale);
+	probeCountdown = settings.probeFrames;
+}
+
+void FrameGovernor::addFrameTime(double seconds, int frameLevel)
+{
+	assert(frameLevel >= 0 && frameLevel < int(levels.size()));
+
+	// Smoothed to ride out single slow frames, but a frame over the target acts at once
+	Level& rendered = levels[frameLevel];
+	rendered.seconds = rendered.seconds > 0 ? 0.7*rendered.seconds + 0.3*seconds : seconds;
+	if (frameLevel != level)
+		return; // rendered before the last change, which already accounted for it
+
+	const auto levelCount = int(levels.size());
+	const double headroomSeconds = settings.headroom * settings.targetSeconds;
+	if (seconds > settings.targetSeconds)
+	{
+		rendered.seconds = std::max(rendered.seconds, seconds);
+		int fitting = level;
+		while (fitting + 1 < levelCount && predictSeconds(fitting) > headroomSeconds)
+			++fitting;
+		level = fitting;
+		headroomFrames = 0;
+		probeCountdown = settings.probeFrames;
+		return;
+	}
+
+	if (level == 0)
+		return;
+	if (predictSeconds(level - 1) <= headroomSeconds)
+	{
+		if (++headroomFrames >= settings.settleFrames)
+		{
+			--level;
+			headroomFrames = 0;
+			probeCountdown = settings.probeFrames;
+		}
+		return;
+	}
+	headroomFrames = 0;
+
+	// A frame over the target above drops back at once, which bounds what a probe costs
+	if (seconds <= headroomSeconds && --probeCountdown <= 0)
+	{
+		--level;
+		probeCountdown = settings.probeFrames;
+	}
+}
+
+double FrameGovernor::predictSeconds(int levelIndex) const
+{
+	if (levels[levelIndex].seconds > 0)
+		return levels[levelIndex].seconds;
+
+	const auto levelCount = int(levels.size());
+	for (int distance = 1; distance < levelCount; ++distance)
+	{
+		for (const int other : {levelIndex - distance, levelIndex + distance})
+		{
+			if (other >= 0 && other < levelCount && levels[other].seconds > 0)
+				return levels[other].seconds * levels[levelIndex].cost / levels[other].cost;
+		}
+	}
+	return 0;
+}
+
+RenderSettings FrameGovernor::getRenderSettings() const
+{
+	RenderSettings renderSettings = maxQuality;
+	renderSettings.samplesPerPixel = levels[level].samplesPerPixel;
+	renderSettings.path.maxDepth = levels[level].maxDepth;
+	return renderSettings;
+}
+
+vec2i FrameGovernor::getRenderSize(int windowW, int windowH) const
+{
+	const float scale = levels[level].resolutionScale;
+	return {std::max(int(std::lround(windowW * scale)), 1), std::max(int(std::lround(windowH * scale)), 1)};
+}
@@ -0,0 +1,128 @@
+#pragma once
+#include "ParallelRendering.h"
+#include "SWScreen.h"
+#include "ThreadPool.h"
+#include <array>
+#include <future>
+#include <optional>
+#include <chrono>
+#include <cstdint>
+
+// Overlaps the serial steps of an animation with rendering
+// Frame N renders on the pool while the scene is advanced to frame N+1 on another
+//  thread and frame N-1 is presented on the calling thread. The scene is kept in two
+//  snapshots, one per frame in flight: the one frame N renders stays untouched, and
+//  frame N+1's snapshot is a copy of it that is then updated.
+// AnimatedScene is one of the canonical scenes (see Scenes.h), which must be copyable.
+template <typename AnimatedScene>
+class FramePipeline
+{
+public:
+	FramePipeline(const AnimatedScene& scene, ThreadPool& threadPool, int w, int h, RenderSettings settings = {});
+
+	// Settings and resolution of the frames advance() starts from now on
+	void setFrameSettings(RenderSettings newSettings, int newW, int newH);
+
+	FramePipeline(const FramePipeline&) = delete;
+	FramePipeline& operator=(const FramePipeline&) = delete;
+	~FramePipeline(); // waits for the frame in flight
+
+	// Starts rendering the next frame, then calls present(const SWScreen&) with the
+	//  previous one, if any, while the next one renders
+	template <typename PresentFn>
+	void advance(const Camera& camera, PresentFn&& present);
+
+	// Waits for the frame in flight and presents it; advance() then continues with the next frame
+	template <typename PresentFn>
+	void flush(PresentFn&& present);
+
+	uint64_t getFrameIndex() const { return frameIndex; } // of the next frame advance() starts
+
+	// Render time of the frame last presented, nullopt before the first
+	std::optional<double> getLastRenderSeconds() const { return lastRenderSeconds; }
+
+private:
+	std::array<AnimatedScene, 2> snapshots; // frame N uses snapshots[N % 2]
+	std::array<SWScreen, 2> images;         // frame N renders into images[N % 2]
+	ThreadPool& threadPool;
+	RenderSettings settings;
+	int w, h;
+	uint64_t frameIndex = 0;
+	std::optional<double> lastRenderSeconds;
+
+	// Declared last, so that they are waited for before the buffers go away
+	std::future<double> rendering; // frameIndex - 1, returns its render time
+	std::future<void> updating;  // snapshots[frameIndex % 2]
+};
+
+// .cpp
+template <typename AnimatedScene>
+FramePipeline<AnimatedScene>::FramePipeline(const AnimatedScene& scene, ThreadPool& threadPool, int w, int h,
+	RenderSettings settings) :
+	snapshots{scene, scene},
+	images{SWScreen{w, h}, SWScreen{w, h}},
+	threadPool(threadPool),
+	settings(settings),
+	w(w), h(h)
+{}
+
+template <typename AnimatedScene>
+void FramePipeline<AnimatedScene>::setFrameSettings(RenderSettings newSettings, int newW, int newH)
+{
+	settings = newSettings;
+	w = newW;
+	h = newH;
+}
+
+template <typename AnimatedScene>
+FramePipeline<AnimatedScene>::~FramePipeline()
+{
+	if (rendering.valid())
+		rendering.wait();
+	if (updating.valid())
+		updating.wait();
+}
+
+template <typename AnimatedScene>
+template <typename PresentFn>
+void FramePipeline<AnimatedScene>::advance(const Camera& camera, PresentFn&& present)
+{
+	// The previous frame is done with its snapshot and image once it finished rendering,
+	//  and this frame's snapshot is ready once its update finished
+	const bool hasPrevious = rendering.valid(); // not after flush()
+	if (hasPrevious)
+		lastRenderSeconds = rendering.get();
+	if (updating.valid())
+		updating.get();
+
+	const AnimatedScene& scene = snapshots[frameIndex % 2];
+	SWScreen& image = images[frameIndex % 2];
+	if (image.getW() != w || image.getH() != h)
+		image = SWScreen{w, h};
+	rendering = std::async(std::launch::async, [this, &scene, &image, camera, frameSettings = settings] {
+		const auto beginTimepoint = std::chrono::steady_clock::now();
+		parallelRender(scene.getScene(), image, camera, threadPool, std::nullopt, frameSettings);
+		return std::chrono::duration<double>{std::chrono::steady_clock::now() - beginTimepoint}.count();
+	});
+
+	// Copying the snapshot only reads it, as rendering does
+	AnimatedScene& nextScene = snapshots[(frameIndex + 1) % 2];
+	updating = std::async(std::launch::async, [&scene, &nextScene] {
+		nextScene = scene;
+		nextScene.update();
+	});
+
+	if (hasPrevious)
+		present(static_cast<const SWScreen&>(images[(frameIndex - 1) % 2]));
+	++frameIndex;
+}
+
+template <typename AnimatedScene>
+template <typename PresentFn>
+void FramePipeline<AnimatedScene>::flush(PresentFn&& present)
+{
+	if (!rendering.valid())
+		return;
+	lastRenderSeconds = rendering.get();
+	present(static_cast<const SWScreen&>(images[(frameIndex - 1) % 2]));
+}
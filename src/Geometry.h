@@ -1,8 +1,13 @@
 #pragma once
 #include "Vec.h"
+#include "Stats.h"
 #include <optional>
 #include <variant>
 #include <utility>
+#include <limits>
+#include <cmath>
+#include <memory>
+#include <cstdint>
 
 // ---------------------
 // - Renderable shapes -
@@ -19,8 +24,23 @@ struct Triangle
 	vec3f verts[3];
 };
 
+// Triangle prepared for repeated intersection tests (see makePrecomputedTriangle())
+struct PrecomputedTriangle
+{
+	vec3f v0;
+	vec3f edge1; // v1 - v0
+	vec3f edge2; // v2 - v0
+	vec3f normal; // normalized, same orientation as getNormal(Triangle)
+};
+
+struct MeshData; // defined in Mesh.h
+
+// Indexed triangle mesh with its own acceleration structure
+// Geometry is immutable and shared between copies of the mesh.
 struct Mesh
-{};
+{
+	std::shared_ptr<const MeshData> data;
+};
 
 using Shape = std::variant<Sphere, Triangle, Mesh>;
 
@@ -41,11 +61,13 @@ vec3f getNormal(const Triangle& tri, vec3f p)
 	return getNormal(tri);
 }
 
-vec3f getNormal(const Mesh& mesh, vec3f p)
+PrecomputedTriangle makePrecomputedTriangle(const Triangle& tri)
 {
-	return {};
+	return PrecomputedTriangle{tri.verts[0], tri.verts[1] - tri.verts[0], tri.verts[2] - tri.verts[0], getNormal(tri)};
 }
 
+vec3f getNormal(const Mesh& mesh, uint32_t triIndex); // defined in Mesh.h
+
 // -------------------------------
 // - General geometrical objects -
 // -------------------------------
@@ -56,8 +78,86 @@ struct Ray
 	vec3f dir;
 };
 
-std::optional<std::pair<vec3f, float>> findIntersection(const Ray& ray, const Sphere& sphere)
+// Ray-shape intersection
+struct Intersection
+{
+	vec3f pos;
+	float t;
+	uint32_t primIndex = 0; // hit triangle of a Mesh
+};
+
+// Axis-aligned bounding box
+// Default-constructed box is empty (min > max) and acts as an identity for merging.
+struct Aabb
+{
+	vec3f min = {std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity()};
+	vec3f max = {-std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity()};
+};
+
+bool isEmpty(const Aabb& box)
+{
+	return box.min.x > box.max.x || box.min.y > box.max.y || box.min.z > box.max.z;
+}
+
+Aabb merge(const Aabb& a, const Aabb& b)
+{
+	return Aabb{min(a.min, b.min), max(a.max, b.max)};
+}
+
+Aabb merge(const Aabb& box, vec3f p)
+{
+	return Aabb{min(box.min, p), max(box.max, p)};
+}
+
+vec3f getCenter(const Aabb& box)
+{
+	if (isEmpty(box))
+		return {};
+	return 0.5f*(box.min + box.max);
+}
+
+float getSurfaceArea(const Aabb& box)
+{
+	if (isEmpty(box))
+		return 0.f;
+	const vec3f e = box.max - box.min;
+	return 2.f*(e.x*e.y + e.y*e.z + e.z*e.x);
+}
+
+// Index of the axis along which the box is the longest
+int getLongestAxis(const Aabb& box)
+{
+	const vec3f e = box.max - box.min;
+	if (e.x >= e.y && e.x >= e.z)
+		return 0;
+	return e.y >= e.z ? 1 : 2;
+}
+
+// Slab test; invDir holds the per-component reciprocals of ray.dir
+// Returns the entry distance if the ray hits the box within [0, tmax].
+std::optional<float> findIntersection(const Ray& ray, vec3f invDir, const Aabb& box, float tmax)
+{
+	stats::countTests(stats::TestType::Box);
+	float tnear = 0.f;
+	float tfar = tmax;
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		float t1 = (box.min[axis] - ray.origin[axis]) * invDir[axis];
+		float t2 = (box.max[axis] - ray.origin[axis]) * invDir[axis];
+		if (t1 > t2)
+			std::swap(t1, t2);
+		tnear = t1 > tnear ? t1 : tnear; // NaN-safe ordering (origin lying on a slab)
+		tfar = t2 < tfar ? t2 : tfar;
+	}
+
+	if (tnear > tfar)
+		return std::nullopt;
+	return tnear;
+}
+
+std::optional<Intersection> findIntersection(const Ray& ray, const Sphere& sphere)
 {
+	stats::countTests(stats::TestType::Sphere);
 	const auto& o = ray.origin;
 	const auto& d = ray.dir;
 	const auto& s = sphere.pos;
@@ -79,51 +179,62 @@ std::optional<std::pair<vec3f, float>> findIntersection(const Ray& ray, const Sp
 	if (tmin >= 0.f)
 	{
 		const auto hitpoint = o + tmin*d;
-		return std::make_pair(hitpoint, tmin);
+		return Intersection{hitpoint, tmin};
 	}
 
 	return std::nullopt;
 }
 
-std::optional<std::pair<vec3f, float>> findIntersection(const Ray& ray, const Triangle& tri)
+// Moller-Trumbore test of the triangle spanned by edge1 and edge2 from v0; both sides are hit
+// The packet and SIMD kernels repeat this arithmetic operation by operation.
+std::optional<Intersection> findTriangleIntersection(const Ray& ray, vec3f v0, vec3f edge1, vec3f edge2)
 {
-	auto n = getNormal(tri);
-	auto connector = tri.verts[0] - ray.origin;
-	auto speed = -(n * ray.dir);
-	auto dist = -(connector * n);
-	auto t = dist / speed;
-	if (t < 0.f)
+	stats::countTests(stats::TestType::Triangle);
+	const vec3f p = ray.dir ^ edge2;
+	const float invDet = 1.f / (edge1 * p); // degenerate triangles give inf or NaN and fail below
+	const vec3f s = ray.origin - v0;
+	const vec3f q = s ^ edge1;
+
+	// Barycentric coordinates of the hit and its distance
+	const float u = (s * p) * invDet;
+	const float v = (ray.dir * q) * invDet;
+	const float t = (edge2 * q) * invDet;
+	if (!((u >= 0.f) & (v >= 0.f) & (u + v <= 1.f) & (t >= 0.f)))
 		return std::nullopt;
 
-	// Find point on plane, check whether it's in triangles's boundaries
-	vec3f p = ray.origin + t*ray.dir;
-	vec3f es[] = {
-		tri.verts[1] - tri.verts[0],
-		tri.verts[2] - tri.verts[1],
-		tri.verts[0] - tri.verts[2]
-	};
-	vec3f ns[] = {
-		es[0] ^ n,
-		es[1] ^ n,
-		es[2] ^ n
-	};
-	vec3f ps[] = {
-		p - tri.verts[0],
-		p - tri.verts[1],
-		p - tri.verts[2]
-	};
-
-	if (ps[0] * ns[0] <= 0.f &&
-		ps[1] * ns[1] <= 0.f &&
-		ps[2] * ns[2] <= 0.f)
-	{
-		return std::make_pair(p, t);
-	}
+	return Intersection{ray.origin + t*ray.dir, t};
+}
 
-	return std::nullopt;
+std::optional<Intersection> findIntersection(const Ray& ray, const Triangle& tri)
+{
+	return findTriangleIntersection(ray, tri.verts[0], tri.verts[1] - tri.verts[0], tri.verts[2] - tri.verts[0]);
 }
 
-std::optional<std::pair<vec3f, float>> findIntersection(const Ray& ray, const Mesh& mesh)
+std::optional<Intersection> findIntersection(const Ray& ray, const PrecomputedTriangle& tri)
 {
-	return std::nullopt;
+	return findTriangleIntersection(ray, tri.v0, tri.edge1, tri.edge2);
+}
+
+// Only hits closer than tmax are reported
+std::optional<Intersection> findIntersection(const Ray& ray, const Mesh& mesh,
+	float tmax = std::numeric_limits<float>::infinity()); // defined in Mesh.h
+
+// Whether the ray hits the mesh closer than tmax; stops at the first hit found
+bool hasIntersection(const Ray& ray, const Mesh& mesh, float tmax); // defined in Mesh.h
+
+// ------------------
+// - Bounding boxes -
+// ------------------
+
+Aabb getBounds(const Sphere& sphere)
+{
+	const vec3f r = {sphere.radius, sphere.radius, sphere.radius};
+	return Aabb{sphere.pos - r, sphere.pos + r};
 }
+
+Aabb getBounds(const Triangle& tri)
+{
+	return merge(merge(Aabb{tri.verts[0], tri.verts[0]}, tri.verts[1]), tri.verts[2]);
+}
+
+Aabb getBounds(const Mesh& mesh); // defined in Mesh.h
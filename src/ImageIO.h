@@ -0,0 +1,88 @@
+#pragma once
+#include "SWScreen.h"
+#include "Color.h"
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+
+// Thrown when an image file can't be written
+struct ImageWriteException : std::runtime_error
+{
+	explicit ImageWriteException(const std::string& msg) :
+		std::runtime_error(msg)
+	{}
+};
+
+// Binary PPM (P6), 8 bits per channel, clamped to [0, 1]
+void writePpm(const SWScreen& screen, const std::string& path);
+
+// Little-endian PFM, 32-bit float per channel, unclamped
+void writePfm(const SWScreen& screen, const std::string& path);
+
+// Picks the format by the extension (.pfm, otherwise PPM)
+void writeImage(const SWScreen& screen, const std::string& path);
+
+// .cpp
+void writePpm(const SWScreen& screen, const std::string& path)
+{
+	std::ofstream file{path, std::ios::binary};
+	if (!file)
+		throw ImageWriteException("Can't open " + path);
+
+	const int w = screen.getW();
+	const int h = screen.getH();
+	file << "P6\n" << w << " " << h << "\n255\n";
+
+	// PPM stores the top row first, screen row 0 is the bottom one
+	std::string row(size_t(w)*3, '\0');
+	for (int y = h-1; y >= 0; --y)
+	{
+		for (int x = 0; x < w; ++x)
+		{
+			const RgbColor col = screen.getPixel({x, y});
+			row[3*x + 0] = char(uint8_t(255*std::clamp(col.x, 0.f, 1.f)));
+			row[3*x + 1] = char(uint8_t(255*std::clamp(col.y, 0.f, 1.f)));
+			row[3*x + 2] = char(uint8_t(255*std::clamp(col.z, 0.f, 1.f)));
+		}
+		file.write(row.data(), std::streamsize(row.size()));
+	}
+
+	if (!file)
+		throw ImageWriteException("Can't write " + path);
+}
+
+void writePfm(const SWScreen& screen, const std::string& path)
+{
+	std::ofstream file{path, std::ios::binary};
+	if (!file)
+		throw ImageWriteException("Can't open " + path);
+
+	const int w = screen.getW();
+	const int h = screen.getH();
+	file << "PF\n" << w << " " << h << "\n-1.0\n"; // negative scale = little endian
+
+	// PFM stores the bottom row first, like the screen
+	for (int y = 0; y < h; ++y)
+	{
+		for (int x = 0; x < w; ++x)
+		{
+			const RgbColor col = screen.getPixel({x, y});
+			const float rgb[3] = {col.x, col.y, col.z};
+			file.write(reinterpret_cast<const char*>(rgb), sizeof(rgb));
+		}
+	}
+
+	if (!file)
+		throw ImageWriteException("Can't write " + path);
+}
+
+void writeImage(const SWScreen& screen, const std::string& path)
+{
+	const bool isPfm = path.size() >= 4 && path.compare(path.size()-4, 4, ".pfm") == 0;
+	if (isPfm)
+		writePfm(screen, path);
+	else
+		writePpm(screen, path);
+}
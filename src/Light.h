@@ -0,0 +1,57 @@
+#pragma once
+#include "Vec.h"
+#include "Color.h"
+#include <cstdint>
+
+enum class LightKind : uint8_t
+{
+	Point,       // emits from pos in all directions, falls off with the squared distance
+	Directional, // parallel light travelling along dir, e.g. the sun
+	Area         // one-sided parallelogram at pos spanned by edge1 and edge2
+};
+
+// Light source of a scene
+struct Light
+{
+	LightKind kind = LightKind::Point;
+	RgbColor color = {1, 1, 1}; // point: intensity, directional: irradiance, area: radiance
+
+	vec3f pos = {};   // point: position, area: corner
+	vec3f dir = {0, -1, 0}; // directional: normalized direction of travel
+	vec3f edge1 = {}; // area: emits towards edge1 ^ edge2
+	vec3f edge2 = {};
+};
+
+Light makePointLight(vec3f pos, RgbColor intensity);
+Light makeDirectionalLight(vec3f dir, RgbColor irradiance);
+Light makeAreaLight(vec3f corner, vec3f edge1, vec3f edge2, RgbColor radiance);
+
+// .cpp
+Light makePointLight(vec3f pos, RgbColor intensity)
+{
+	Light light;
+	light.kind = LightKind::Point;
+	light.color = intensity;
+	light.pos = pos;
+	return light;
+}
+
+Light makeDirectionalLight(vec3f dir, RgbColor irradiance)
+{
+	Light light;
+	light.kind = LightKind::Directional;
+	light.color = irradiance;
+	light.dir = normalized(dir);
+	return light;
+}
+
+Light makeAreaLight(vec3f corner, vec3f edge1, vec3f edge2, RgbColor radiance)
+{
+	Light light;
+	light.kind = LightKind::Area;
+	light.color = radiance;
+	light.pos = corner;
+	light.edge1 = edge1;
+	light.edge2 = edge2;
+	return light;
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include "Vec.h"
+#include "Color.h"
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <cassert>
+
+// Visual attributes of a shape
+struct Material
+{
+	RgbColor color = {0.8, 0.8, 0.8};
+	float reflectivity = 0.2f;
+	float roughness = 0.f;
+};
+
+// Index into a scene's MaterialTable
+using MaterialId = uint32_t;
+
+// Built-in shader kinds
+// Evaluated through a switch rather than an indirect call, so they inline.
+enum class MaterialKind : uint8_t
+{
+	Constant, // material is the same for the whole surface
+	Stripes   // color alternates between two colors along an axis of the object
+};
+
+// Entry of a MaterialTable
+struct MaterialEntry
+{
+	MaterialKind kind = MaterialKind::Constant;
+	Material material; // Stripes: color is the first stripe color
+
+	// Stripes
+	RgbColor stripeColor = {};
+	vec3f stripeAxis = {0, 1, 0};
+	float stripeFrequency = 0.f; // radians per unit of object-local coordinates
+};
+
+MaterialEntry makeConstantMaterial(Material material);
+MaterialEntry makeStripedMaterial(Material material, RgbColor stripeColor, vec3f axis, float frequency);
+
+// Scene-level storage of materials, indexed by MaterialId
+// Entry 0 always exists and holds the default material.
+class MaterialTable
+{
+public:
+	MaterialTable() : entries{makeConstantMaterial(Material{})} {}
+
+	MaterialId add(const MaterialEntry& entry);
+	const MaterialEntry& operator[](MaterialId id) const { assert(id < entries.size()); return entries[id]; }
+	auto size() const { return MaterialId(entries.size()); }
+
+private:
+	std::vector<MaterialEntry> entries;
+};
+
+// Material at a point given in object-local coordinates
+// (see getLocalCoords() in Object.h)
+Material evaluate(const MaterialEntry& entry, vec3f localPos);
+
+// Whether evaluate() depends on the point at all
+bool isProcedural(const MaterialEntry& entry) { return entry.kind != MaterialKind::Constant; }
+
+// .cpp
+MaterialEntry makeConstantMaterial(Material material)
+{
+	return MaterialEntry{MaterialKind::Constant, material};
+}
+
+MaterialEntry makeStripedMaterial(Material material, RgbColor stripeColor, vec3f axis, float frequency)
+{
+	return MaterialEntry{MaterialKind::Stripes, material, stripeColor, axis, frequency};
+}
+
+MaterialId MaterialTable::add(const MaterialEntry& entry)
+{
+	entries.push_back(entry);
+	return MaterialId(entries.size() - 1);
+}
+
+Material evaluate(const MaterialEntry& entry, vec3f localPos)
+{
+	switch (entry.kind)
+	{
+	case MaterialKind::Constant:
+		return entry.material;
+
+	case MaterialKind::Stripes:
+	{
+		const float w = 0.5f + 0.5f*std::sin(entry.stripeFrequency * (localPos * entry.stripeAxis));
+		Material material = entry.material;
+		material.color = material.color + w*(entry.stripeColor - material.color);
+		return material;
+	}
+	}
+
+	return entry.material;
+}
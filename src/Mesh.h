@@ -0,0 +1,138 @@
+#pragma once
+#include "Geometry.h"
+#include "Bvh.h"
+#include "ArrayView.h"
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cassert>
+
+// Immutable geometry of a Mesh
+// Triangles are stored as vertex index triples, ordered to match the leaves
+//  of the mesh's own bounding volume hierarchy, and once more in the same order
+//  in the precomputed form that intersection tests and normals use.
+// The arrays are views into storage, which is either a MeshStorage built by
+//  makeMesh() or a memory-mapped scene cache file (see SceneCache.h).
+struct MeshData
+{
+	ArrayView<vec3f> vertices;
+	ArrayView<uint32_t> indices; // 3 per triangle
+	ArrayView<PrecomputedTriangle> triangles;
+	ArrayView<BvhNode> nodes;
+	std::shared_ptr<const void> storage;
+
+	auto getTriangleCount() const { return uint32_t(indices.size() / 3); }
+};
+
+// Arrays of a mesh built in memory
+struct MeshStorage
+{
+	std::vector<vec3f> vertices;
+	std::vector<uint32_t> indices;
+	std::vector<PrecomputedTriangle> triangles;
+	std::vector<BvhNode> nodes;
+};
+
+// Builds a mesh from a shared vertex buffer and a triangle index buffer
+Mesh makeMesh(std::vector<vec3f> vertices, std::vector<uint32_t> indices);
+
+Triangle getTriangle(const MeshData& data, uint32_t triIndex);
+
+// .cpp
+Mesh makeMesh(std::vector<vec3f> vertices, std::vector<uint32_t> indices)
+{
+	assert(indices.size() % 3 == 0);
+	auto storage = std::make_shared<MeshStorage>();
+	auto data = std::make_shared<MeshData>();
+	storage->vertices = std::move(vertices);
+	data->vertices = storage->vertices;
+	data->indices = indices;
+
+	const auto triCount = data->getTriangleCount();
+	std::vector<Aabb> bounds;
+	bounds.reserve(triCount);
+	for (uint32_t i = 0; i < triCount; ++i)
+		bounds.push_back(getBounds(getTriangle(*data, i)));
+
+	Bvh bvh{bounds};
+
+	// Reorder triangles to match the leaves of the hierarchy
+	storage->indices.reserve(indices.size());
+	for (auto tri : bvh.getPrimOrder())
+	{
+		storage->indices.push_back(indices[3*tri + 0]);
+		storage->indices.push_back(indices[3*tri + 1]);
+		storage->indices.push_back(indices[3*tri + 2]);
+	}
+	data->indices = storage->indices;
+	storage->nodes = bvh.getNodes();
+	data->nodes = storage->nodes;
+
+	storage->triangles.reserve(triCount);
+	for (uint32_t i = 0; i < triCount; ++i)
+		storage->triangles.push_back(makePrecomputedTriangle(getTriangle(*data, i)));
+	data->triangles = storage->triangles;
+
+	data->storage = std::move(storage);
+	return Mesh{std::move(data)};
+}
+
+Triangle getTriangle(const MeshData& data, uint32_t triIndex)
+{
+	const uint32_t* tri = &data.indices[3*triIndex];
+	return Triangle{{data.vertices[tri[0]], data.vertices[tri[1]], data.vertices[tri[2]]}};
+}
+
+vec3f getNormal(const Mesh& mesh, uint32_t triIndex)
+{
+	return mesh.data->triangles[triIndex].normal;
+}
+
+Aabb getBounds(const Mesh& mesh)
+{
+	if (!mesh.data || mesh.data->nodes.empty())
+		return {};
+	return mesh.data->nodes[0].bounds;
+}
+
+std::optional<Intersection> findIntersection(const Ray& ray, const Mesh& mesh, float tmax)
+{
+	std::optional<Intersection> minHit;
+	if (!mesh.data || mesh.data->nodes.empty())
+		return minHit;
+
+	const MeshData& data = *mesh.data;
+	traverseBvh(data.nodes.data(), ray, tmax,
+		[&data, &ray, &minHit](uint32_t triIndex, float& tmax) {
+			auto intersection = findIntersection(ray, data.triangles[triIndex]);
+			if (intersection && intersection->t < tmax) {
+				tmax = intersection->t;
+				minHit = Intersection{intersection->pos, intersection->t, triIndex};
+			}
+		}
+	);
+
+	return minHit;
+}
+
+bool hasIntersection(const Ray& ray, const Mesh& mesh, float tmax)
+{
+	if (!mesh.data || mesh.data->nodes.empty())
+		return false;
+
+	const MeshData& data = *mesh.data;
+	bool isHit = false;
+	traverseBvh(data.nodes.data(), ray, tmax,
+		[&data, &ray, &isHit](uint32_t triIndex, float& tmax) {
+			if (isHit)
+				return; // rest of the leaf
+			auto intersection = findIntersection(ray, data.triangles[triIndex]);
+			if (intersection && intersection->t < tmax) {
+				isHit = true;
+				tmax = -1.f;
+			}
+		}
+	);
+
+	return isHit;
+}
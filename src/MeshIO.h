@@ -0,0 +1,646 @@
+#pragma once
+#include "Mesh.h"
+#include "ThreadPool.h"
+#include "Vec.h"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <exception>
+#include <stdexcept>
+#include <charconv>
+#include <algorithm>
+#include <cstring>
+#include <cctype>
+#include <cstdint>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Mesh file loading
+// Files are memory-mapped and split into chunks that the threads of a pool parse
+//  in parallel: a first pass counts the vertices and triangles of every chunk, so
+//  that a second pass can write each chunk straight into its part of the final arrays.
+
+// Thrown when a mesh file can't be read or parsed
+struct MeshReadException : std::runtime_error
+{
+	explicit MeshReadException(const std::string& msg) :
+		std::runtime_error(msg)
+	{}
+};
+
+// Read-only memory mapping of a whole file
+class MappedFile
+{
+public:
+	// prefetch asks the kernel to read the whole file ahead; without it, pages are
+	//  read as they are touched (for files that are used only in parts)
+	explicit MappedFile(const std::string& path, bool prefetch = true);
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile();
+
+	const char* data() const { return static_cast<const char*>(mapping); }
+	size_t size() const { return mappingSize; }
+
+private:
+	void* mapping = nullptr;
+	size_t mappingSize = 0;
+};
+
+// Vertex and index buffers as taken by makeMesh()
+struct MeshArrays
+{
+	std::vector<vec3f> vertices;
+	std::vector<uint32_t> indices; // 3 per triangle
+};
+
+// Wavefront OBJ: v and f lines; polygons are triangulated as fans, everything else is skipped
+MeshArrays readObj(const std::string& path, ThreadPool& threadPool);
+
+// Binary PLY (little or big endian): x, y, z of the vertex element and the index list
+//  of the face element; polygons are triangulated as fans
+MeshArrays readPly(const std::string& path, ThreadPool& threadPool);
+
+// Picks the format by the extension (.obj or .ply)
+MeshArrays readMeshFile(const std::string& path, ThreadPool& threadPool);
+
+// Whether readMeshFile() knows the extension of path
+bool isMeshFile(const std::string& path);
+
+// .cpp
+MappedFile::MappedFile(const std::string& path, bool prefetch)
+{
+	const int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw MeshReadException("Can't open " + path);
+
+	struct stat status;
+	if (fstat(fd, &status) != 0)
+	{
+		close(fd);
+		throw MeshReadException("Can't read the size of " + path);
+	}
+
+	mappingSize = size_t(status.st_size);
+	if (mappingSize > 0)
+	{
+		mapping = mmap(nullptr, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapping == MAP_FAILED)
+		{
+			close(fd);
+			throw MeshReadException("Can't map " + path);
+		}
+		madvise(mapping, mappingSize, prefetch ? MADV_WILLNEED : MADV_RANDOM);
+	}
+	close(fd); // the mapping stays valid
+}
+
+MappedFile::~MappedFile()
+{
+	if (mapping)
+		munmap(mapping, mappingSize);
+}
+
+namespace detail
+{
+	// Runs fn(chunk) for all chunks on the pool and waits for them;
+	//  then rethrows the first exception thrown by fn, if any
+	template <typename Fn>
+	void forEachChunk(ThreadPool& threadPool, int chunkCount, const Fn& fn)
+	{
+		threadPool.addTasks(unsigned(chunkCount), [&fn](unsigned chunk) { fn(int(chunk)); }).get();
+	}
+
+	// Enough chunks to balance the threads, but not so many that per-chunk overhead shows
+	int getChunkCount(size_t byteCount, const ThreadPool& threadPool)
+	{
+		constexpr size_t minChunkBytes = 1 << 20;
+		const auto maxChunks = size_t(std::max(threadPool.getThreadCount(), 1u)) * 8;
+		return int(std::clamp<size_t>(byteCount / minChunkBytes, 1, maxChunks));
+	}
+
+	bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+	bool hasExtension(const std::string& path, std::string_view ext)
+	{
+		return path.size() >= ext.size() && std::equal(ext.rbegin(), ext.rend(), path.rbegin(),
+			[](char a, char b) { return a == std::tolower(static_cast<unsigned char>(b)); });
+	}
+
+	// Text of one OBJ chunk: starts at a line start, ends after a newline or at the end of the file
+	struct ObjChunk
+	{
+		const char* begin;
+		const char* end;
+		uint32_t vertexCount = 0;
+		uint32_t triangleCount = 0;
+		uint32_t firstVertex = 0;   // of the chunk within the whole file
+		uint32_t firstTriangle = 0;
+	};
+
+	const char* skipSpaces(const char* p, const char* end)
+	{
+		while (p < end && isSpace(*p))
+			++p;
+		return p;
+	}
+
+	const char* skipToken(const char* p, const char* end)
+	{
+		while (p < end && !isSpace(*p) && *p != '\n')
+			++p;
+		return p;
+	}
+
+	// Splits [begin, end) into chunkCount pieces at line boundaries; some may be empty
+	std::vector<ObjChunk> splitLines(const char* begin, const char* end, int chunkCount)
+	{
+		std::vector<ObjChunk> chunks;
+		const char* chunkBegin = begin;
+		for (int chunk = 1; chunk <= chunkCount; ++chunk)
+		{
+			const char* chunkEnd = chunk == chunkCount ? end : std::max(chunkBegin, begin + (end - begin) * chunk / chunkCount);
+			chunkEnd = std::find(chunkEnd, end, '\n');
+			chunkEnd = chunkEnd < end ? chunkEnd + 1 : end;
+			chunks.push_back(ObjChunk{chunkBegin, chunkEnd});
+			chunkBegin = chunkEnd;
+		}
+		return chunks;
+	}
+
+	// Calls onVertex(p, lineEnd) and onFace(p, lineEnd) with p after the v or f keyword
+	template <typename OnVertex, typename OnFace>
+	void forEachObjLine(const char* p, const char* end, OnVertex&& onVertex, OnFace&& onFace)
+	{
+		while (p < end)
+		{
+			const char* lineEnd = std::find(p, end, '\n');
+			p = skipSpaces(p, lineEnd);
+			if (lineEnd - p >= 2 && isSpace(p[1]))
+			{
+				if (p[0] == 'v')
+					onVertex(p + 1, lineEnd);
+				else if (p[0] == 'f')
+					onFace(p + 1, lineEnd);
+			}
+			p = lineEnd + 1;
+		}
+	}
+
+	float parseObjFloat(const char*& p, const char* end)
+	{
+		p = skipSpaces(p, end);
+		if (p < end && *p == '+')
+			++p; // from_chars doesn't accept a plus sign
+		float x;
+		const auto [next, error] = std::from_chars(p, end, x);
+		if (error != std::errc{})
+			throw MeshReadException("Invalid vertex coordinate '" + std::string{p, skipToken(p, end)} + "'");
+		p = next;
+		return x;
+	}
+
+	void countObjChunk(ObjChunk& chunk)
+	{
+		forEachObjLine(chunk.begin, chunk.end,
+			[&](const char*, const char*) { ++chunk.vertexCount; },
+			[&](const char* p, const char* lineEnd) {
+				uint32_t cornerCount = 0;
+				for (p = skipSpaces(p, lineEnd); p < lineEnd; p = skipSpaces(skipToken(p, lineEnd), lineEnd))
+					++cornerCount;
+				if (cornerCount < 3)
+					throw MeshReadException("Face with fewer than 3 vertices");
+				chunk.triangleCount += cornerCount - 2;
+			});
+	}
+
+	void parseObjChunk(const ObjChunk& chunk, uint32_t totalVertexCount, vec3f* vertices, uint32_t* indices)
+	{
+		uint32_t vertexCount = chunk.firstVertex; // defined so far, for relative indices
+		forEachObjLine(chunk.begin, chunk.end,
+			[&](const char* p, const char* lineEnd) {
+				const float x = parseObjFloat(p, lineEnd);
+				const float y = parseObjFloat(p, lineEnd);
+				const float z = parseObjFloat(p, lineEnd);
+				*vertices++ = vec3f{x, y, z};
+				++vertexCount;
+			},
+			[&](const char* p, const char* lineEnd) {
+				// Corners are v, v/vt, v//vn or v/vt/vn; only v is used
+				uint32_t corners[3];
+				int cornerCount = 0;
+				for (p = skipSpaces(p, lineEnd); p < lineEnd; p = skipSpaces(skipToken(p, lineEnd), lineEnd))
+				{
+					int64_t index = 0;
+					const auto [next, error] = std::from_chars(p, lineEnd, index);
+					const int64_t resolved = index > 0 ? index - 1 : int64_t(vertexCount) + index; // negative: relative
+					if (error != std::errc{} || index == 0 || resolved < 0 || resolved >= int64_t(totalVertexCount))
+						throw MeshReadException("Invalid vertex index '" + std::string{p, skipToken(p, lineEnd)} + "'");
+
+					// Fan triangulation: (first, previous, current)
+					if (cornerCount < 2)
+						corners[cornerCount] = uint32_t(resolved);
+					else
+					{
+						corners[2] = uint32_t(resolved);
+						*indices++ = corners[0];
+						*indices++ = corners[1];
+						*indices++ = corners[2];
+						corners[1] = corners[2];
+					}
+					++cornerCount;
+				}
+			});
+	}
+}
+
+MeshArrays readObj(const std::string& path, ThreadPool& threadPool)
+{
+	const MappedFile file{path};
+	const char* begin = file.data();
+	const char* end = begin + file.size();
+	auto chunks = detail::splitLines(begin, end, detail::getChunkCount(file.size(), threadPool));
+
+	try
+	{
+		detail::forEachChunk(threadPool, int(chunks.size()), [&](int chunk) {
+			detail::countObjChunk(chunks[chunk]);
+		});
+
+		uint64_t vertexCount = 0, triangleCount = 0;
+		for (auto& chunk : chunks)
+		{
+			chunk.firstVertex = uint32_t(vertexCount);
+			chunk.firstTriangle = uint32_t(triangleCount);
+			vertexCount += chunk.vertexCount;
+			triangleCount += chunk.triangleCount;
+		}
+		if (vertexCount > UINT32_MAX || 3*triangleCount > UINT32_MAX)
+			throw MeshReadException("Too many vertices or triangles");
+
+		MeshArrays arrays;
+		arrays.vertices.resize(vertexCount);
+		arrays.indices.resize(3*triangleCount);
+		detail::forEachChunk(threadPool, int(chunks.size()), [&](int chunk) {
+			detail::parseObjChunk(chunks[chunk], uint32_t(vertexCount),
+				arrays.vertices.data() + chunks[chunk].firstVertex,
+				arrays.indices.data() + 3*size_t(chunks[chunk].firstTriangle));
+		});
+		return arrays;
+	}
+	catch (const MeshReadException& e)
+	{
+		throw MeshReadException(path + ": " + e.what());
+	}
+}
+
+namespace detail
+{
+	enum class PlyType : uint8_t { Int8, Uint8, Int16, Uint16, Int32, Uint32, Float32, Float64 };
+
+	struct PlyProperty
+	{
+		std::string name;
+		PlyType type;
+		bool isList = false;
+		PlyType countType = PlyType::Uint8; // of lists
+	};
+
+	struct PlyElement
+	{
+		std::string name;
+		uint64_t count = 0;
+		std::vector<PlyProperty> properties;
+	};
+
+	PlyType parsePlyType(std::string_view name)
+	{
+		if (name == "char" || name == "int8") return PlyType::Int8;
+		if (name == "uchar" || name == "uint8") return PlyType::Uint8;
+		if (name == "short" || name == "int16") return PlyType::Int16;
+		if (name == "ushort" || name == "uint16") return PlyType::Uint16;
+		if (name == "int" || name == "int32") return PlyType::Int32;
+		if (name == "uint" || name == "uint32") return PlyType::Uint32;
+		if (name == "float" || name == "float32") return PlyType::Float32;
+		if (name == "double" || name == "float64") return PlyType::Float64;
+		throw MeshReadException("Unknown PLY type " + std::string{name});
+	}
+
+	size_t getSize(PlyType type)
+	{
+		const size_t sizes[] = {1, 1, 2, 2, 4, 4, 4, 8};
+		return sizes[int(type)];
+	}
+
+	template <typename T>
+	T readPlyScalar(const char* p, bool swapBytes)
+	{
+		unsigned char bytes[sizeof(T)];
+		std::memcpy(bytes, p, sizeof(T));
+		if (swapBytes)
+			std::reverse(bytes, bytes + sizeof(T));
+		T value;
+		std::memcpy(&value, bytes, sizeof(T));
+		return value;
+	}
+
+	// Reads a value of the given type, swapping bytes for big endian files
+	double readPlyValue(const char* p, PlyType type, bool swapBytes)
+	{
+		switch (type)
+		{
+		case PlyType::Int8: return readPlyScalar<int8_t>(p, swapBytes);
+		case PlyType::Uint8: return readPlyScalar<uint8_t>(p, swapBytes);
+		case PlyType::Int16: return readPlyScalar<int16_t>(p, swapBytes);
+		case PlyType::Uint16: return readPlyScalar<uint16_t>(p, swapBytes);
+		case PlyType::Int32: return readPlyScalar<int32_t>(p, swapBytes);
+		case PlyType::Uint32: return readPlyScalar<uint32_t>(p, swapBytes);
+		case PlyType::Float32: return readPlyScalar<float>(p, swapBytes);
+		case PlyType::Float64: return readPlyScalar<double>(p, swapBytes);
+		}
+		return 0.0;
+	}
+
+	struct PlyHeader
+	{
+		std::vector<PlyElement> elements;
+		bool swapBytes = false;
+		size_t dataOffset = 0; // of the first element record
+	};
+
+	PlyHeader parsePlyHeader(const char* begin, const char* end)
+	{
+		const std::string_view text{begin, size_t(end - begin)};
+		const auto headerEnd = text.find("end_header");
+		if (text.substr(0, 3) != "ply" || headerEnd == std::string_view::npos)
+			throw MeshReadException("Not a PLY file");
+
+		PlyHeader header;
+		const auto dataStart = text.find('\n', headerEnd);
+		header.dataOffset = dataStart == std::string_view::npos ? text.size() : dataStart + 1;
+
+		size_t lineStart = 0;
+		while (lineStart < headerEnd)
+		{
+			const auto lineEnd = text.find('\n', lineStart);
+			std::string_view line = text.substr(lineStart, lineEnd - lineStart);
+			lineStart = lineEnd + 1;
+
+			// Split into at most 5 words
+			std::string_view words[5];
+			int wordCount = 0;
+			for (size_t pos = 0; pos < line.size() && wordCount < 5;)
+			{
+				while (pos < line.size() && isSpace(line[pos]))
+					++pos;
+				const size_t wordStart = pos;
+				while (pos < line.size() && !isSpace(line[pos]))
+					++pos;
+				if (pos > wordStart)
+					words[wordCount++] = line.substr(wordStart, pos - wordStart);
+			}
+
+			if (wordCount == 0)
+				continue;
+			if (words[0] == "format")
+			{
+				if (words[1] == "binary_big_endian")
+					header.swapBytes = true;
+				else if (words[1] != "binary_little_endian")
+					throw MeshReadException("Unsupported PLY format " + std::string{words[1]} + ", only binary PLY is supported");
+			}
+			else if (words[0] == "element" && wordCount >= 3)
+			{
+				PlyElement element;
+				element.name = words[1];
+				if (std::from_chars(words[2].data(), words[2].data() + words[2].size(), element.count).ec != std::errc{})
+					throw MeshReadException("Invalid element count " + std::string{words[2]});
+				header.elements.push_back(std::move(element));
+			}
+			else if (words[0] == "property" && wordCount >= 3 && !header.elements.empty())
+			{
+				PlyProperty property;
+				if (words[1] == "list" && wordCount >= 5)
+				{
+					property.isList = true;
+					property.countType = parsePlyType(words[2]);
+					property.type = parsePlyType(words[3]);
+					property.name = words[4];
+				}
+				else
+				{
+					property.type = parsePlyType(words[1]);
+					property.name = words[2];
+				}
+				header.elements.back().properties.push_back(std::move(property));
+			}
+		}
+
+		return header;
+	}
+
+	// Size of the element record at p, which may vary when it has lists
+	// Throws if the record doesn't fit in the remaining bytes of the file.
+	size_t getRecordSize(const PlyElement& element, const char* p, size_t remaining, bool swapBytes)
+	{
+		size_t size = 0;
+		auto skip = [&](size_t valueCount, size_t valueSize) {
+			if (valueCount > (remaining - size) / valueSize)
+				throw MeshReadException("File is truncated");
+			size += valueCount * valueSize;
+		};
+		for (const PlyProperty& property : element.properties)
+		{
+			if (property.isList)
+			{
+				const char* countValue = p + size;
+				skip(1, getSize(property.countType));
+				const double count = readPlyValue(countValue, property.countType, swapBytes);
+				if (!(count >= 0.0))
+					throw MeshReadException("Negative list length");
+				skip(size_t(std::min(count, double(remaining))), getSize(property.type));
+			}
+			else
+				skip(1, getSize(property.type));
+		}
+		return size;
+	}
+
+	// Face records of one chunk; offsets are known after a serial walk over the records
+	struct PlyFaceChunk
+	{
+		size_t offset;     // of the first record
+		uint64_t faceCount;
+		uint64_t firstTriangle;
+	};
+}
+
+MeshArrays readPly(const std::string& path, ThreadPool& threadPool)
+{
+	using namespace detail;
+
+	const MappedFile file{path};
+	const char* begin = file.data();
+	const char* end = begin + file.size();
+
+	try
+	{
+		const PlyHeader header = parsePlyHeader(begin, end);
+		const bool swap = header.swapBytes;
+
+		uint64_t vertexCount = 0;
+		for (const PlyElement& element : header.elements)
+			vertexCount = element.name == "vertex" ? element.count : vertexCount;
+
+		MeshArrays arrays;
+		size_t offset = header.dataOffset;
+		auto checkSize = [&](size_t size) {
+			if (size > file.size() - std::min(offset, file.size()))
+				throw MeshReadException("File is truncated");
+		};
+
+		for (const PlyElement& element : header.elements)
+		{
+			if (element.name == "vertex")
+			{
+				// Fixed-size records, every chunk of vertices can be decoded independently
+				size_t stride = 0;
+				size_t coordinateOffsets[3] = {SIZE_MAX, SIZE_MAX, SIZE_MAX};
+				PlyType coordinateTypes[3] = {};
+				for (const PlyProperty& property : element.properties)
+				{
+					if (property.isList)
+						throw MeshReadException("Vertex element with list properties");
+					const int axis = property.name == "x" ? 0 : property.name == "y" ? 1 : property.name == "z" ? 2 : -1;
+					if (axis >= 0) {
+						coordinateOffsets[axis] = stride;
+						coordinateTypes[axis] = property.type;
+					}
+					stride += getSize(property.type);
+				}
+				if (std::count(coordinateOffsets, coordinateOffsets + 3, SIZE_MAX) > 0)
+					throw MeshReadException("Vertex element without x, y and z");
+				if (element.count > UINT32_MAX)
+					throw MeshReadException("Too many vertices");
+				checkSize(element.count * stride);
+
+				arrays.vertices.resize(element.count);
+				const char* records = begin + offset;
+				const int chunkCount = getChunkCount(element.count * stride, threadPool);
+				forEachChunk(threadPool, chunkCount, [&](int chunk) {
+					const uint64_t first = element.count * chunk / chunkCount;
+					const uint64_t last = element.count * (chunk + 1) / chunkCount;
+					for (uint64_t i = first; i < last; ++i)
+					{
+						const char* record = records + i*stride;
+						vec3f& v = arrays.vertices[i];
+						v.x = float(readPlyValue(record + coordinateOffsets[0], coordinateTypes[0], swap));
+						v.y = float(readPlyValue(record + coordinateOffsets[1], coordinateTypes[1], swap));
+						v.z = float(readPlyValue(record + coordinateOffsets[2], coordinateTypes[2], swap));
+					}
+				});
+				offset += element.count * stride;
+			}
+			else if (element.name == "face")
+			{
+				const auto indexList = std::find_if(element.properties.begin(), element.properties.end(), [](const PlyProperty& property) {
+					return property.isList && (property.name == "vertex_indices" || property.name == "vertex_index");
+				});
+				if (indexList == element.properties.end())
+					throw MeshReadException("Face element without vertex_indices");
+				size_t listOffset = 0; // within the record, constant as long as the list comes first
+				for (auto property = element.properties.begin(); property != indexList; ++property)
+				{
+					if (property->isList)
+						throw MeshReadException("Face element with lists before vertex_indices");
+					listOffset += getSize(property->type);
+				}
+
+				// Serial walk over the record sizes to find the chunk boundaries and triangle counts
+				const int chunkCount = getChunkCount(file.size() - std::min(offset, file.size()), threadPool);
+				std::vector<PlyFaceChunk> chunks;
+				uint64_t triangleCount = 0;
+				for (uint64_t face = 0; face < element.count; ++face)
+				{
+					if (face == element.count * chunks.size() / chunkCount)
+						chunks.push_back(PlyFaceChunk{offset, 0, triangleCount});
+					checkSize(listOffset + getSize(indexList->countType));
+					const auto cornerCount = uint64_t(readPlyValue(begin + offset + listOffset, indexList->countType, swap));
+					if (cornerCount < 3)
+						throw MeshReadException("Face with fewer than 3 vertices");
+					const size_t recordSize = getRecordSize(element, begin + offset, file.size() - offset, swap);
+
+					++chunks.back().faceCount;
+					triangleCount += cornerCount - 2;
+					offset += recordSize;
+				}
+				if (3*triangleCount > UINT32_MAX)
+					throw MeshReadException("Too many triangles");
+
+				arrays.indices.resize(3*triangleCount);
+				forEachChunk(threadPool, int(chunks.size()), [&](int chunk) {
+					const char* record = begin + chunks[chunk].offset;
+					uint32_t* indices = arrays.indices.data() + 3*chunks[chunk].firstTriangle;
+					const size_t countSize = getSize(indexList->countType);
+					const size_t indexSize = getSize(indexList->type);
+					for (uint64_t face = 0; face < chunks[chunk].faceCount; ++face)
+					{
+						const char* list = record + listOffset;
+						const auto cornerCount = uint64_t(readPlyValue(list, indexList->countType, swap));
+						auto readIndex = [&](uint64_t corner) {
+							const double index = readPlyValue(list + countSize + corner*indexSize, indexList->type, swap);
+							if (!(index >= 0.0 && index < double(vertexCount)))
+								throw MeshReadException("Invalid vertex index " + std::to_string(int64_t(index)));
+							return uint32_t(index);
+						};
+
+						// Fan triangulation: (first, previous, current)
+						const uint32_t first = readIndex(0);
+						uint32_t previous = readIndex(1);
+						for (uint64_t corner = 2; corner < cornerCount; ++corner)
+						{
+							const uint32_t current = readIndex(corner);
+							*indices++ = first;
+							*indices++ = previous;
+							*indices++ = current;
+							previous = current;
+						}
+						record += getRecordSize(element, record, size_t(end - record), swap);
+					}
+				});
+			}
+			else
+			{
+				// Skip other elements record by record
+				for (uint64_t i = 0; i < element.count; ++i)
+				{
+					const size_t recordSize = getRecordSize(element, begin + offset, file.size() - std::min(offset, file.size()), swap);
+					offset += recordSize;
+				}
+			}
+		}
+
+		return arrays;
+	}
+	catch (const MeshReadException& e)
+	{
+		throw MeshReadException(path + ": " + e.what());
+	}
+}
+
+MeshArrays readMeshFile(const std::string& path, ThreadPool& threadPool)
+{
+	if (detail::hasExtension(path, ".obj"))
+		return readObj(path, threadPool);
+	if (detail::hasExtension(path, ".ply"))
+		return readPly(path, threadPool);
+	throw MeshReadException("Unknown mesh format of " + path);
+}
+
+bool isMeshFile(const std::string& path)
+{
+	return detail::hasExtension(path, ".obj") || detail::hasExtension(path, ".ply");
+}
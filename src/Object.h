@@ -1,22 +1,17 @@
 #pragma once
 #include "Geometry.h"
-#include <functional>
-
-// Visual attributes of a shape
-struct Material
-{
-	RgbColor color = {0.8, 0.8, 0.8};
-	float reflectivity = 0.2f;
-	float roughness = 0.f;
-};
+#include "Color.h"
+#include "Mesh.h"
+#include "Material.h"
+#include "Packet.h"
+#include <type_traits>
+#include <limits>
 
 // Shape with a material
 struct Object
 {
 	Shape shape;
-
-	// Returns the material of a point (absolute coords) on the object's surface
-	std::function<Material(const Object&, vec3f)> getMaterial;
+	MaterialId material = 0; // index into the scene's MaterialTable
 };
 
 // Ray-object intersection
@@ -24,14 +19,113 @@ struct Hit
 {
 	vec3f pos;
 	const Object* obj;
+	uint32_t primIndex = 0; // hit triangle of a Mesh
 };
 
-Material getMaterial(const Object& obj, vec3f p)
+// Point relative to the object (sphere: center at origin, unit radius)
+vec3f getLocalCoords(const Object& obj, vec3f p)
 {
-	return obj.getMaterial(obj, p);
+	if (auto* sphere = std::get_if<Sphere>(&obj.shape))
+		return (p - sphere->pos) / sphere->radius;
+	return p - getCenter(std::visit([](const auto& shape) { return getBounds(shape); }, obj.shape));
+}
+
+// Returns the material of a point (absolute coords) on the object's surface
+Material getMaterial(const MaterialTable& materials, const Object& obj, vec3f p)
+{
+	const MaterialEntry& entry = materials[obj.material];
+	if (!isProcedural(entry))
+		return entry.material;
+	return evaluate(entry, getLocalCoords(obj, p));
+}
+
+// Batched getMaterial() for `count` hits
+// Constant materials are copied out in a first pass, procedural ones
+//  are evaluated in a second one, keeping each loop free of mixed work.
+void getMaterials(const MaterialTable& materials, const Hit* hits, int count, Material* out)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		const MaterialEntry& entry = materials[hits[i].obj->material];
+		if (!isProcedural(entry))
+			out[i] = entry.material;
+	}
+
+	for (int i = 0; i < count; ++i)
+	{
+		const MaterialEntry& entry = materials[hits[i].obj->material];
+		if (isProcedural(entry))
+			out[i] = evaluate(entry, getLocalCoords(*hits[i].obj, hits[i].pos));
+	}
 }
 
-vec3f getNormal(const Object& obj, vec3f p)
+vec3f getNormal(const Hit& hit)
 {
-	return std::visit([p](const auto& shape) { return getNormal(shape, p); }, obj.shape);
+	return std::visit([&hit](const auto& shape) {
+		if constexpr (std::is_same_v<std::decay_t<decltype(shape)>, Mesh>)
+			return getNormal(shape, hit.primIndex);
+		else
+			return getNormal(shape, hit.pos);
+	}, hit.obj->shape);
+}
+
+// Hits farther than tmax may be skipped (meshes use it to cull their hierarchy)
+std::optional<Intersection> findIntersection(const Ray& ray, const Object& obj,
+	float tmax = std::numeric_limits<float>::infinity())
+{
+	return std::visit([&ray, tmax](const auto& shape) {
+		if constexpr (std::is_same_v<std::decay_t<decltype(shape)>, Mesh>)
+			return findIntersection(ray, shape, tmax);
+		else
+			return findIntersection(ray, shape);
+	}, obj.shape);
+}
+
+// Whether the ray hits the object closer than tmax
+bool hasIntersection(const Ray& ray, const Object& obj, float tmax)
+{
+	return std::visit([&ray, tmax](const auto& shape) {
+		if constexpr (std::is_same_v<std::decay_t<decltype(shape)>, Mesh>)
+			return hasIntersection(ray, shape, tmax);
+		else
+		{
+			const auto intersection = findIntersection(ray, shape);
+			return intersection && intersection->t < tmax;
+		}
+	}, obj.shape);
+}
+
+// Packet version of findIntersection(Ray, Object)
+// Lanes hitting the object closer than tnear[lane] get tnear and primIndices updated;
+//  the mask of updated lanes is returned. Lanes outside activeMask may still be
+//  updated by the cheap shape kernels, so disabled lanes should have tnear = 0.
+template<int N>
+LaneMask intersectPacket(const RayPacket<N>& packet, const Object& obj,
+	float (&tnear)[N], uint32_t (&primIndices)[N], LaneMask activeMask)
+{
+	LaneMask hitMask = 0;
+	if (auto* sphere = std::get_if<Sphere>(&obj.shape))
+		hitMask = intersectPacket(packet, *sphere, tnear);
+	else if (auto* tri = std::get_if<Triangle>(&obj.shape))
+		hitMask = intersectPacket(packet, *tri, tnear);
+	else
+	{
+		// Meshes have their own hierarchy, trace them lane by lane
+		for (int lane = 0; lane < N; ++lane)
+		{
+			if (!((activeMask >> lane) & 1))
+				continue;
+			auto intersection = findIntersection(packet.getRay(lane), obj, tnear[lane]);
+			if (intersection && intersection->t < tnear[lane]) {
+				tnear[lane] = intersection->t;
+				primIndices[lane] = intersection->primIndex;
+				hitMask |= LaneMask{1} << lane;
+			}
+		}
+		return hitMask;
+	}
+
+	for (int lane = 0; lane < N; ++lane)
+		primIndices[lane] = (hitMask >> lane) & 1 ? 0 : primIndices[lane];
+	return hitMask;
 }
@@ -0,0 +1,478 @@
+#pragma once
+#include "SceneCache.h"
+#include "Object.h"
+#include "Light.h"
+#include "Geometry.h"
+#include "Bvh.h"
+#include "Mesh.h"
+#include "MeshIO.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <optional>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <numeric>
+#include <limits>
+#include <cstdint>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Fulfills the Scene concept for scenes larger than memory
+// The scene is read from a scene cache file (see SceneCache.h, writeChunkedScene() writes
+//  a fitting one), which is memory-mapped without reading ahead. Materials, lights,
+//  objects with their bounds and the top-level hierarchy stay resident; the arrays of
+//  each mesh, a chunk, are paged in when a ray first reaches it, and dropped again,
+//  least recently used first, once the paged-in chunks exceed the resident budget.
+// The batch queries queue the rays of a batch by the chunks they enter and then work
+//  through the queues chunk by chunk, resident chunks first, so that every chunk is
+//  paged in at most once per batch. The single-ray queries page chunks in as their
+//  traversal reaches them.
+// Hits stay valid when their chunk is dropped: touching it again pages it back in.
+class OutOfCoreScene
+{
+public:
+	// Throws SceneCacheException if path isn't a readable scene cache or is damaged
+	OutOfCoreScene(const std::string& path, size_t residentBudget);
+
+	OutOfCoreScene(const OutOfCoreScene&) = delete;
+	OutOfCoreScene& operator=(const OutOfCoreScene&) = delete;
+
+	std::optional<Hit> findFirstHit(const Ray& ray) const;
+
+	// Whether anything lies on the ray closer than tmax
+	bool isOccluded(const Ray& ray, float tmax) const;
+
+	// findFirstHit() of count rays
+	void findFirstHitBatch(const Ray* rays, int count, std::optional<Hit>* hits) const;
+
+	// isOccluded() of count rays, occluded[i] is set to 0 or 1
+	void isOccludedBatch(const Ray* rays, const float* tmax, int count, uint8_t* occluded) const;
+
+	const auto& getObjects() const { return objects; }
+	const auto& getMaterials() const { return materials; }
+	const auto& getLights() const { return lights; }
+
+	struct PagingStats
+	{
+		uint64_t pageIns = 0;
+		uint64_t evictions = 0;
+		uint64_t residentBytes = 0;     // of paged-in chunks
+		uint64_t peakResidentBytes = 0;
+	};
+	PagingStats getPagingStats() const;
+
+private:
+	// Page-aligned range of a mesh's arrays in the mapping; empty for the other shapes
+	struct Chunk
+	{
+		char* begin = nullptr;
+		size_t size = 0;
+	};
+
+	struct ChunkState
+	{
+		std::atomic<uint64_t> lastUse{0}; // useClock when a ray last reached it
+		std::atomic<bool> isResident{false};
+	};
+
+	// Ray waiting for a chunk
+	struct QueuedRay
+	{
+		uint32_t objIndex;
+		uint32_t rayIndex;
+		float tnear; // where the ray enters the chunk's bounds
+	};
+
+	std::shared_ptr<const MappedFile> file;
+	std::vector<Object> objects; // in the leaf order of nodes
+	std::vector<Aabb> bounds;
+	MaterialTable materials;
+	std::vector<Light> lights;
+	std::vector<BvhNode> nodes;
+	std::vector<Chunk> chunks; // by object
+	size_t residentBudget;
+
+	std::unique_ptr<ChunkState[]> chunkStates;
+	mutable std::atomic<uint64_t> useClock{0}; // ticks with each page-in, so other uses only read it
+	mutable std::mutex pagingMutex; // guards paging chunks in and out and the members below
+	mutable std::vector<uint32_t> residentChunks;
+	mutable PagingStats pagingStats;
+
+	bool isChunk(uint32_t objIndex) const { return chunks[objIndex].size > 0; }
+
+	// Marks the chunk of an object as used and pages it in if needed
+	void acquire(uint32_t objIndex) const;
+
+	// Sorts the queue by chunk and runs process(entry) for all of its entries, chunk
+	//  by chunk, starting with the chunks that are resident already
+	template <typename ProcessFn>
+	void processQueue(std::vector<QueuedRay>& queue, ProcessFn&& process) const;
+};
+
+// Splits a triangle mesh into spatial chunks of at most chunkSize triangles and writes them,
+//  along with further objects, to a scene cache at path for OutOfCoreScene
+// Chunks are written as they are built, so only the source arrays are held in memory.
+void writeChunkedScene(const std::string& path, uint64_t sourceHash, const MeshArrays& mesh, MaterialId material,
+	const std::vector<Object>& objects, const MaterialTable& materials, const std::vector<Light>& lights,
+	uint32_t chunkSize = 16384);
+
+// .cpp
+OutOfCoreScene::OutOfCoreScene(const std::string& path, size_t residentBudget) :
+	residentBudget(residentBudget)
+{
+	try
+	{
+		file = std::make_shared<const MappedFile>(path, false);
+	}
+	catch (const MeshReadException& e)
+	{
+		throw SceneCacheException(e.what());
+	}
+
+	auto contents = mapSceneCache(file, std::nullopt, false);
+	if (!contents)
+		throw SceneCacheException(path + " isn't a scene cache of this version");
+	objects = std::move(contents->objects);
+	bounds = std::move(contents->bounds);
+	materials = std::move(contents->materials);
+	lights = std::move(contents->lights);
+	nodes = std::move(contents->nodes);
+
+	// A mesh's arrays are written back to back, so its chunk spans from the first to the last
+	const uintptr_t pageSize = uintptr_t(sysconf(_SC_PAGESIZE));
+	chunks.resize(objects.size());
+	for (size_t i = 0; i < objects.size(); ++i)
+	{
+		const auto* mesh = std::get_if<Mesh>(&objects[i].shape);
+		if (!mesh)
+			continue;
+
+		const MeshData& data = *mesh->data;
+		const auto first = std::min({uintptr_t(data.vertices.data()), uintptr_t(data.indices.data()),
+			uintptr_t(data.triangles.data()), uintptr_t(data.nodes.data())});
+		const auto last = std::max({uintptr_t(data.vertices.end()), uintptr_t(data.indices.end()),
+			uintptr_t(data.triangles.end()), uintptr_t(data.nodes.end())});
+		const uintptr_t begin = first / pageSize * pageSize;
+		const uintptr_t end = (last + pageSize - 1) / pageSize * pageSize;
+		chunks[i] = Chunk{reinterpret_cast<char*>(begin), size_t(end - begin)};
+
+		// Checked once up front, then dropped again until a ray reaches it
+		if (!isValidCachedMesh(data))
+			throw SceneCacheException(path + " is damaged");
+		madvise(chunks[i].begin, chunks[i].size, MADV_DONTNEED);
+	}
+	chunkStates = std::make_unique<ChunkState[]>(objects.size());
+}
+
+void OutOfCoreScene::acquire(uint32_t objIndex) const
+{
+	if (!isChunk(objIndex))
+		return;
+
+	// Chunks used since the last page-in share its tick: enough to pick the chunks to drop
+	//  at the next one, without every ray writing to the same cache line
+	ChunkState& state = chunkStates[objIndex];
+	const uint64_t now = useClock.load(std::memory_order_relaxed);
+	if (state.lastUse.load(std::memory_order_relaxed) != now)
+		state.lastUse.store(now, std::memory_order_relaxed);
+	if (state.isResident.load(std::memory_order_acquire))
+		return;
+
+	std::lock_guard<std::mutex> lock{pagingMutex};
+	if (state.isResident.load(std::memory_order_relaxed))
+		return;
+
+	state.lastUse.store(useClock.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	const Chunk& chunk = chunks[objIndex];
+	madvise(chunk.begin, chunk.size, MADV_WILLNEED);
+	state.isResident.store(true, std::memory_order_release);
+	residentChunks.push_back(objIndex);
+	pagingStats.residentBytes += chunk.size;
+	++pagingStats.pageIns;
+
+	// Drop the least recently used other chunks until the budget holds
+	// Threads still reading a dropped chunk just page it back in.
+	while (pagingStats.residentBytes > residentBudget && residentChunks.size() > 1)
+	{
+		size_t lru = residentChunks[0] == objIndex ? 1 : 0;
+		for (size_t i = lru + 1; i < residentChunks.size(); ++i)
+		{
+			if (residentChunks[i] != objIndex && chunkStates[residentChunks[i]].lastUse.load(std::memory_order_relaxed)
+				< chunkStates[residentChunks[lru]].lastUse.load(std::memory_order_relaxed))
+				lru = i;
+		}
+
+		const uint32_t evicted = residentChunks[lru];
+		madvise(chunks[evicted].begin, chunks[evicted].size, MADV_DONTNEED);
+		chunkStates[evicted].isResident.store(false, std::memory_order_release);
+		pagingStats.residentBytes -= chunks[evicted].size;
+		++pagingStats.evictions;
+		residentChunks[lru] = residentChunks.back();
+		residentChunks.pop_back();
+	}
+	pagingStats.peakResidentBytes = std::max(pagingStats.peakResidentBytes, pagingStats.residentBytes);
+}
+
+OutOfCoreScene::PagingStats OutOfCoreScene::getPagingStats() const
+{
+	std::lock_guard<std::mutex> lock{pagingMutex};
+	return pagingStats;
+}
+
+std::optional<Hit> OutOfCoreScene::findFirstHit(const Ray& ray) const
+{
+	std::optional<Hit> minHit;
+	if (objects.empty())
+		return minHit;
+
+	const vec3f invDir = {1.f/ray.dir.x, 1.f/ray.dir.y, 1.f/ray.dir.z};
+	traverseBvh(nodes.data(), ray, std::numeric_limits<float>::infinity(),
+		[this, &ray, &invDir, &minHit](uint32_t objIndex, float& tmax) {
+			// Leaves hold several objects, don't page in chunks the ray misses
+			if (isChunk(objIndex) && !findIntersection(ray, invDir, bounds[objIndex], tmax))
+				return;
+			acquire(objIndex);
+
+			const auto& obj = objects[objIndex];
+			auto intersection = findIntersection(ray, obj, tmax);
+			if (intersection) {
+				auto& [hitpos, t, primIndex] = *intersection;
+				if (t < tmax) {
+					tmax = t;
+					minHit = Hit{hitpos, &obj, primIndex};
+				}
+			}
+		}
+	);
+
+	return minHit;
+}
+
+bool OutOfCoreScene::isOccluded(const Ray& ray, float tmax) const
+{
+	bool isHit = false;
+	if (objects.empty())
+		return isHit;
+
+	const vec3f invDir = {1.f/ray.dir.x, 1.f/ray.dir.y, 1.f/ray.dir.z};
+	traverseBvh(nodes.data(), ray, tmax,
+		[this, &ray, &invDir, &isHit](uint32_t objIndex, float& tmax) {
+			if (isChunk(objIndex) && !findIntersection(ray, invDir, bounds[objIndex], tmax))
+				return;
+			acquire(objIndex);
+
+			if (hasIntersection(ray, objects[objIndex], tmax)) {
+				isHit = true;
+				tmax = -1.f; // any hit will do, end the traversal
+			}
+		}
+	);
+
+	return isHit;
+}
+
+template <typename ProcessFn>
+void OutOfCoreScene::processQueue(std::vector<QueuedRay>& queue, ProcessFn&& process) const
+{
+	std::sort(begin(queue), end(queue), [](const QueuedRay& a, const QueuedRay& b) {
+		return a.objIndex != b.objIndex ? a.objIndex < b.objIndex : a.rayIndex < b.rayIndex;
+	});
+
+	// Chunks that are resident now go first, they can't make others drop them while waiting
+	std::vector<std::pair<size_t, size_t>> pending; // entry ranges of the chunks left for the second pass
+	for (size_t first = 0; first < queue.size();)
+	{
+		const uint32_t objIndex = queue[first].objIndex;
+		size_t last = first;
+		while (last < queue.size() && queue[last].objIndex == objIndex)
+			++last;
+
+		if (chunkStates[objIndex].isResident.load(std::memory_order_acquire))
+		{
+			acquire(objIndex);
+			for (size_t i = first; i < last; ++i)
+				process(queue[i]);
+		}
+		else
+			pending.emplace_back(first, last);
+		first = last;
+	}
+
+	for (const auto& [first, last] : pending)
+	{
+		acquire(queue[first].objIndex);
+		for (size_t i = first; i < last; ++i)
+			process(queue[i]);
+	}
+}
+
+void OutOfCoreScene::findFirstHitBatch(const Ray* rays, int count, std::optional<Hit>* hits) const
+{
+	std::vector<float> tmin(count, std::numeric_limits<float>::infinity());
+	std::vector<QueuedRay> queue;
+	for (int r = 0; r < count; ++r)
+	{
+		hits[r].reset();
+		if (objects.empty())
+			continue;
+
+		// Resident shapes are intersected right away, chunks entered before their hit are queued
+		const Ray& ray = rays[r];
+		const vec3f invDir = {1.f/ray.dir.x, 1.f/ray.dir.y, 1.f/ray.dir.z};
+		traverseBvh(nodes.data(), ray, std::numeric_limits<float>::infinity(),
+			[&](uint32_t objIndex, float& tmax) {
+				if (isChunk(objIndex))
+				{
+					if (const auto tnear = findIntersection(ray, invDir, bounds[objIndex], tmax))
+						queue.push_back({objIndex, uint32_t(r), *tnear});
+					return;
+				}
+
+				const auto& obj = objects[objIndex];
+				auto intersection = findIntersection(ray, obj, tmax);
+				if (intersection && intersection->t < tmax) {
+					tmax = intersection->t;
+					tmin[r] = tmax;
+					hits[r] = Hit{intersection->pos, &obj, intersection->primIndex};
+				}
+			}
+		);
+	}
+
+	processQueue(queue, [&](const QueuedRay& entry) {
+		// A closer hit found in another chunk since queueing may rule this one out
+		float& tmax = tmin[entry.rayIndex];
+		if (entry.tnear > tmax)
+			return;
+
+		const auto& obj = objects[entry.objIndex];
+		auto intersection = findIntersection(rays[entry.rayIndex], obj, tmax);
+		if (intersection && intersection->t < tmax) {
+			tmax = intersection->t;
+			hits[entry.rayIndex] = Hit{intersection->pos, &obj, intersection->primIndex};
+		}
+	});
+}
+
+void OutOfCoreScene::isOccludedBatch(const Ray* rays, const float* tmax, int count, uint8_t* occluded) const
+{
+	std::vector<QueuedRay> queue;
+	for (int r = 0; r < count; ++r)
+	{
+		occluded[r] = 0;
+		if (objects.empty())
+			continue;
+
+		const Ray& ray = rays[r];
+		const vec3f invDir = {1.f/ray.dir.x, 1.f/ray.dir.y, 1.f/ray.dir.z};
+		traverseBvh(nodes.data(), ray, tmax[r],
+			[&](uint32_t objIndex, float& t) {
+				if (isChunk(objIndex))
+				{
+					if (const auto tnear = findIntersection(ray, invDir, bounds[objIndex], t))
+						queue.push_back({objIndex, uint32_t(r), *tnear});
+					return;
+				}
+
+				if (hasIntersection(ray, objects[objIndex], t)) {
+					occluded[r] = 1;
+					t = -1.f; // any hit will do, end the traversal
+				}
+			}
+		);
+	}
+
+	processQueue(queue, [&](const QueuedRay& entry) {
+		if (!occluded[entry.rayIndex] && hasIntersection(rays[entry.rayIndex], objects[entry.objIndex], tmax[entry.rayIndex]))
+			occluded[entry.rayIndex] = 1;
+	});
+}
+
+void writeChunkedScene(const std::string& path, uint64_t sourceHash, const MeshArrays& mesh, MaterialId material,
+	const std::vector<Object>& objects, const MaterialTable& materials, const std::vector<Light>& lights,
+	uint32_t chunkSize)
+{
+	assert(chunkSize > 0 && mesh.indices.size() % 3 == 0);
+	SceneCacheWriter writer{path};
+
+	// Objects of the scene, chunks appended; meshes are written right away
+	std::vector<Object> sceneObjects;
+	std::vector<Aabb> sceneBounds;
+	std::vector<uint32_t> meshIndices;
+	for (const Object& obj : objects)
+	{
+		const auto* objMesh = std::get_if<Mesh>(&obj.shape);
+		sceneObjects.push_back(obj);
+		sceneBounds.push_back(std::visit([](const auto& shape) { return getBounds(shape); }, obj.shape));
+		meshIndices.push_back(objMesh ? writer.addMesh(*objMesh->data) : 0);
+	}
+
+	const auto triCount = uint32_t(mesh.indices.size() / 3);
+	std::vector<vec3f> centroids(triCount);
+	const auto& v = mesh.vertices;
+	for (uint32_t t = 0; t < triCount; ++t)
+	{
+		centroids[t] = (v[mesh.indices[3*t]] + v[mesh.indices[3*t + 1]] + v[mesh.indices[3*t + 2]]) / 3.f;
+	}
+
+	// Median splits along the longest axis of the centroids, depth first so that
+	//  neighbouring chunks end up next to each other in the file
+	std::vector<uint32_t> tris(triCount);
+	std::iota(begin(tris), end(tris), 0);
+	std::vector<uint32_t> localIndex(mesh.vertices.size(), UINT32_MAX);
+	std::vector<std::pair<uint32_t, uint32_t>> stack;
+	if (triCount > 0)
+		stack.emplace_back(0, triCount);
+	while (!stack.empty())
+	{
+		const auto [first, last] = stack.back();
+		stack.pop_back();
+
+		if (last - first > chunkSize)
+		{
+			Aabb centroidBounds;
+			for (uint32_t i = first; i < last; ++i)
+				centroidBounds = merge(centroidBounds, centroids[tris[i]]);
+			const int axis = getLongestAxis(centroidBounds);
+			const uint32_t mid = first + (last - first) / 2;
+			std::nth_element(begin(tris) + first, begin(tris) + mid, begin(tris) + last,
+				[&](uint32_t a, uint32_t b) { return centroids[a][axis] < centroids[b][axis]; });
+			stack.emplace_back(mid, last);
+			stack.emplace_back(first, mid);
+			continue;
+		}
+
+		// Chunk with its own copy of the vertices it uses
+		std::vector<vec3f> vertices;
+		std::vector<uint32_t> indices;
+		indices.reserve(3*(last - first));
+		for (uint32_t i = first; i < last; ++i)
+		{
+			for (int v = 0; v < 3; ++v)
+			{
+				const uint32_t index = mesh.indices[3*tris[i] + v];
+				if (localIndex[index] == UINT32_MAX)
+				{
+					localIndex[index] = uint32_t(vertices.size());
+					vertices.push_back(mesh.vertices[index]);
+				}
+				indices.push_back(localIndex[index]);
+			}
+		}
+		for (uint32_t i = first; i < last; ++i)
+			for (int v = 0; v < 3; ++v)
+				localIndex[mesh.indices[3*tris[i] + v]] = UINT32_MAX;
+
+		const Mesh chunk = makeMesh(std::move(vertices), std::move(indices));
+		sceneObjects.push_back(Object{Mesh{}, material}); // the writer only needs the mesh index
+		sceneBounds.push_back(getBounds(chunk));
+		meshIndices.push_back(writer.addMesh(*chunk.data));
+	}
+
+	const Bvh bvh{sceneBounds};
+	for (const uint32_t i : bvh.getPrimOrder())
+		writer.addObject(sceneObjects[i], meshIndices[i]);
+	writer.finish(materials, lights, bvh.getNodes(), sourceHash);
+}
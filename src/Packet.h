@@ -0,0 +1,159 @@
+#pragma once
+#include "Geometry.h"
+#include <bitset>
+#include <cstdint>
+#include <limits>
+
+// Bundle of up to 32 rays with a common origin (e.g. primary camera rays)
+// Directions are stored per component so that loops over lanes vectorize.
+template<int N>
+struct RayPacket
+{
+	static_assert(N > 0 && N <= 32);
+
+	vec3f origin;
+	float dirX[N];
+	float dirY[N];
+	float dirZ[N];
+
+	vec3f getDir(int lane) const { return {dirX[lane], dirY[lane], dirZ[lane]}; }
+	Ray getRay(int lane) const { return {origin, getDir(lane)}; }
+	void setDir(int lane, vec3f dir) { dirX[lane] = dir.x; dirY[lane] = dir.y; dirZ[lane] = dir.z; }
+};
+
+// Bit i set = lane i is active
+using LaneMask = uint32_t;
+
+int getLaneCount(LaneMask mask)
+{
+	return int(std::bitset<32>{mask}.count());
+}
+
+template<int N>
+constexpr LaneMask getFullMask()
+{
+	return N == 32 ? ~LaneMask{0} : (LaneMask{1} << N) - 1;
+}
+
+// Whether all active lanes share the sign of each direction component,
+//  which makes packet traversal visit children in a common front-to-back order
+template<int N>
+bool isCoherent(const RayPacket<N>& packet, LaneMask activeMask);
+
+// Packet versions of the shape intersection tests
+// Lanes hitting the shape closer than tnear[lane] get tnear updated; the mask
+//  of updated lanes is returned. Results match the single-ray tests exactly.
+template<int N>
+LaneMask intersectPacket(const RayPacket<N>& packet, const Sphere& sphere, float (&tnear)[N]);
+
+template<int N>
+LaneMask intersectPacket(const RayPacket<N>& packet, const Triangle& tri, float (&tnear)[N]);
+
+// Mask of active lanes entering the box closer than tnear[lane]
+template<int N>
+LaneMask intersectPacket(const RayPacket<N>& packet, const float (&invDirX)[N], const float (&invDirY)[N],
+	const float (&invDirZ)[N], const Aabb& box, const float (&tnear)[N], LaneMask activeMask);
+
+// .cpp
+template<int N>
+bool isCoherent(const RayPacket<N>& packet, LaneMask activeMask)
+{
+	LaneMask negX = 0, negY = 0, negZ = 0;
+	for (int lane = 0; lane < N; ++lane)
+	{
+		negX |= LaneMask(packet.dirX[lane] < 0.f) << lane;
+		negY |= LaneMask(packet.dirY[lane] < 0.f) << lane;
+		negZ |= LaneMask(packet.dirZ[lane] < 0.f) << lane;
+	}
+
+	auto isUniform = [activeMask](LaneMask neg) { return (neg & activeMask) == 0 || (neg & activeMask) == activeMask; };
+	return isUniform(negX) && isUniform(negY) && isUniform(negZ);
+}
+
+template<int N>
+LaneMask intersectPacket(const RayPacket<N>& packet, const Sphere& sphere, float (&tnear)[N])
+{
+	stats::countTests(stats::TestType::Sphere, N);
+
+	// Same arithmetic as the single-ray test, with the lane-invariant terms hoisted
+	const vec3f oms = packet.origin - sphere.pos;
+	const float omsSqr = oms*oms;
+	const float r = sphere.radius;
+
+	LaneMask hitMask = 0;
+	for (int lane = 0; lane < N; ++lane)
+	{
+		const float dx = packet.dirX[lane], dy = packet.dirY[lane], dz = packet.dirZ[lane];
+		const float dd = dx*dx + dy*dy + dz*dz;
+		const float doms = dx*oms.x + dy*oms.y + dz*oms.z;
+
+		const float D = 4.f*doms*doms - 4.f*dd*(omsSqr-r*r);
+		const float sqrtD = std::sqrt(D < 0.f ? 0.f : D);
+		const float t1 = (-2.f*doms + sqrtD) / (2.f*dd);
+		const float t2 = (-2.f*doms - sqrtD) / (2.f*dd);
+		const float tmin = std::min(t1, t2);
+
+		const bool hit = D >= 0.f && tmin >= 0.f && tmin < tnear[lane];
+		tnear[lane] = hit ? tmin : tnear[lane];
+		hitMask |= LaneMask(hit) << lane;
+	}
+
+	return hitMask;
+}
+
+template<int N>
+LaneMask intersectPacket(const RayPacket<N>& packet, const Triangle& tri, float (&tnear)[N])
+{
+	stats::countTests(stats::TestType::Triangle, N);
+
+	// Same arithmetic as findTriangleIntersection(); the terms only depending on the origin are shared
+	const vec3f edge1 = tri.verts[1] - tri.verts[0];
+	const vec3f edge2 = tri.verts[2] - tri.verts[0];
+	const vec3f s = packet.origin - tri.verts[0];
+	const vec3f q = s ^ edge1;
+	const float edge2q = edge2 * q;
+
+	LaneMask hitMask = 0;
+	for (int lane = 0; lane < N; ++lane)
+	{
+		const vec3f dir = packet.getDir(lane);
+		const vec3f p = dir ^ edge2;
+		const float invDet = 1.f / (edge1 * p);
+		const float u = (s * p) * invDet;
+		const float v = (dir * q) * invDet;
+		const float t = edge2q * invDet;
+
+		const bool hit = (u >= 0.f) & (v >= 0.f) & (u + v <= 1.f) & (t >= 0.f) & (t < tnear[lane]);
+		tnear[lane] = hit ? t : tnear[lane];
+		hitMask |= LaneMask(hit) << lane;
+	}
+
+	return hitMask;
+}
+
+template<int N>
+LaneMask intersectPacket(const RayPacket<N>& packet, const float (&invDirX)[N], const float (&invDirY)[N],
+	const float (&invDirZ)[N], const Aabb& box, const float (&tnear)[N], LaneMask activeMask)
+{
+	stats::countTests(stats::TestType::Box, N);
+	const vec3f& o = packet.origin;
+	LaneMask hitMask = 0;
+	for (int lane = 0; lane < N; ++lane)
+	{
+		const float tx1 = (box.min.x - o.x) * invDirX[lane], tx2 = (box.max.x - o.x) * invDirX[lane];
+		const float ty1 = (box.min.y - o.y) * invDirY[lane], ty2 = (box.max.y - o.y) * invDirY[lane];
+		const float tz1 = (box.min.z - o.z) * invDirZ[lane], tz2 = (box.max.z - o.z) * invDirZ[lane];
+
+		float tmin = 0.f, tmax = tnear[lane];
+		tmin = std::min(tx1, tx2) > tmin ? std::min(tx1, tx2) : tmin;
+		tmin = std::min(ty1, ty2) > tmin ? std::min(ty1, ty2) : tmin;
+		tmin = std::min(tz1, tz2) > tmin ? std::min(tz1, tz2) : tmin;
+		tmax = std::max(tx1, tx2) < tmax ? std::max(tx1, tx2) : tmax;
+		tmax = std::max(ty1, ty2) < tmax ? std::max(ty1, ty2) : tmax;
+		tmax = std::max(tz1, tz2) < tmax ? std::max(tz1, tz2) : tmax;
+
+		hitMask |= LaneMask(tmin <= tmax) << lane;
+	}
+
+	return hitMask & activeMask;
+}
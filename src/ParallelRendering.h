@@ -2,61 +2,127 @@
 #include "Rendering.h"
 #include "SWScreen.h"
 #include "ThreadPool.h"
+#include "TileScheduling.h"
+#include "Stats.h"
 #include <vector>
 #include <future>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
 #include <optional>
+#include <type_traits>
 
+// Statistics of one parallelRender() call
+// Only filled when statistics are compiled in (see Stats.h).
+struct FrameStats
+{
+	stats::Counters counters; // merged from all threads
+	std::vector<PixelRect> tiles;
+	std::vector<float> tileSeconds; // render time of each tile
+};
+
+// Whether threads may call putPixel() on distinct pixels of the screen at the same time
+template <typename ScreenType, typename = void>
+struct AllowsConcurrentPutPixel : std::false_type {};
+
+template <typename ScreenType>
+struct AllowsConcurrentPutPixel<ScreenType, std::enable_if_t<ScreenType::concurrentPutPixel>> : std::true_type {};
+
+// Renders the given tiles of the image in parallel on all threads of the pool
+// The threads take the tiles from work-stealing queues, so that expensive parts
+//  of the image don't end up on a single thread. Pixels outside the tiles are left untouched.
 template <typename SceneType, typename ScreenType>
-void parallelRender(const SceneType& scene, ScreenType& screen, const Camera& camera,
-	ThreadPool& threadPool, int regionCount, std::optional<CameraSpan> span = std::nullopt)
+void parallelRenderTiles(const SceneType& scene, ScreenType& screen, const Camera& camera,
+	ThreadPool& threadPool, const std::vector<PixelRect>& tiles, std::optional<CameraSpan> span = std::nullopt,
+	const RenderSettings& settings = {}, FrameStats* frameStats = nullptr)
 {
-	std::vector<std::promise<SWScreen>> screenPromises{unsigned(regionCount)}; // note: unfortunately can't be stored in the task itself (std::function must be copyable)
-	std::vector<std::future<SWScreen>> screenFutures;
-	screenFutures.reserve(regionCount);
-
-	const auto regionW = screen.getW();
-	const auto regionH = screen.getH() / regionCount;
-	if (!span) {
-		float ratio = float(screen.getW())/screen.getH();
-		span = {-ratio, ratio, -1, 1};
-	}
+	const auto screenW = screen.getW();
+	const auto screenH = screen.getH();
+	const auto workerCount = std::max(threadPool.getThreadCount(), 1u);
+	TileQueues tileQueues{uint32_t(tiles.size()), workerCount};
 
-	// Render to SW screens in parallel, then copy to real (SDL) screen
-	for (int region = 0; region < regionCount; ++region)
+	const bool collectStats = stats::enabled && frameStats;
+	std::mutex statsMutex;
+	if (collectStats)
 	{
-		// Region to be rendered by a worker thread
-		CameraSpan regionSpan = {
-			span->left,
-			span->right,
-			span->bottom + region*(span->top-span->bottom)/regionCount,
-			span->bottom + (region+1)*(span->top-span->bottom)/regionCount
-		};
-
-		// Render in parallel
-		auto& screenPromise = screenPromises[region];
-		screenFutures.push_back(screenPromise.get_future());
-		threadPool.addTask(
-			[&screenPromise, &scene, &camera, regionSpan, regionW, regionH]
+		*frameStats = FrameStats{};
+		frameStats->tiles = tiles;
+		frameStats->tileSeconds.resize(tiles.size());
+	}
+
+	auto renderTiles = [&](auto& targetScreen) {
+		threadPool.addTasks(workerCount,
+			[&](unsigned worker)
 			{
-				SWScreen swScreen{regionW, regionH};
-				render(scene, swScreen, camera, regionSpan);
-				screenPromise.set_value(std::move(swScreen));
+				stats::takeThreadCounters(); // drop whatever this thread counted before
+				while (auto tile = tileQueues.pop(worker))
+				{
+					if (collectStats)
+					{
+						const auto beginTimepoint = std::chrono::steady_clock::now();
+						renderRect(scene, targetScreen, camera, tiles[*tile], span, settings);
+						const auto endTimepoint = std::chrono::steady_clock::now();
+						frameStats->tileSeconds[*tile] = std::chrono::duration<float>{endTimepoint - beginTimepoint}.count();
+					}
+					else
+						renderRect(scene, targetScreen, camera, tiles[*tile], span, settings);
+				}
+
+				if (collectStats)
+				{
+					const auto counters = stats::takeThreadCounters();
+					std::lock_guard lock{statsMutex};
+					frameStats->counters.merge(counters);
+				}
 			}
-		);
+		).get();
+	};
+
+	// Threads write disjoint tiles straight into the output screen when it allows that,
+	//  otherwise into a SW screen which is then copied to the output screen
+	if constexpr (AllowsConcurrentPutPixel<ScreenType>::value)
+		renderTiles(screen);
+	else
+	{
+		SWScreen swScreen{screenW, screenH};
+		renderTiles(swScreen);
+
+		for (const PixelRect& tile : tiles)
+			for (int y = tile.y; y < tile.y + tile.h; ++y)
+				for (int x = tile.x; x < tile.x + tile.w; ++x)
+					screen.putPixel({x, y}, swScreen.getPixel({x, y}));
 	}
+}
 
-	// Copy SW screens to output screen
-	for (int region = 0; region < regionCount; ++region)
+// Renders the whole image in parallel on all threads of the pool
+template <typename SceneType, typename ScreenType>
+void parallelRender(const SceneType& scene, ScreenType& screen, const Camera& camera,
+	ThreadPool& threadPool, std::optional<CameraSpan> span = std::nullopt,
+	const RenderSettings& settings = {}, FrameStats* frameStats = nullptr)
+{
+	const auto workerCount = std::max(threadPool.getThreadCount(), 1u);
+	const int tileSize = settings.tileSize > 0 ? settings.tileSize : getAutoTileSize(screen.getW(), screen.getH(), workerCount);
+	parallelRenderTiles(scene, screen, camera, threadPool, makeTiles(screen.getW(), screen.getH(), tileSize),
+		span, settings, frameStats);
+}
+
+// Visualizes the tile render times of a frame, from black (cheapest) over red to yellow (most expensive)
+SWScreen makeTileHeatmap(const FrameStats& frameStats, int w, int h)
+{
+	SWScreen heatmap{w, h};
+	if (frameStats.tileSeconds.empty())
+		return heatmap;
+
+	const float maxSeconds = *std::max_element(begin(frameStats.tileSeconds), end(frameStats.tileSeconds));
+	for (size_t i = 0; i < frameStats.tiles.size(); ++i)
 	{
-		auto swScreen = screenFutures[region].get();
+		const PixelRect& tile = frameStats.tiles[i];
+		const float cost = maxSeconds > 0 ? frameStats.tileSeconds[i] / maxSeconds : 0.f;
+		const RgbColor color = {std::min(2*cost, 1.f), std::max(2*cost - 1, 0.f), 0};
 
-		for (int y = 0; y < regionH; ++y)
-		{
-			for (int x = 0; x < regionW; ++x)
-			{
-				auto pixel = swScreen.getPixel({x, y});
-				screen.putPixel({x, region*regionH+y}, pixel);
-			}
-		}
+		for (int y = tile.y; y < tile.y + tile.h; ++y)
+			for (int x = tile.x; x < tile.x + tile.w; ++x)
+				heatmap.putPixel({x, y}, color);
 	}
+	return heatmap;
 }
@@ -0,0 +1,199 @@
+#pragma once
+#include "ParallelRendering.h"
+#include "TileScheduling.h"
+#include "ThreadPool.h"
+#include "Color.h"
+#include <vector>
+#include <optional>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cassert>
+
+// When progressive rendering stops refining a tile
+struct ProgressiveSettings
+{
+	// A tile is converged once the RMS standard error of its pixels' means
+	//  (in luminance, colors being in [0, 1]) drops to this
+	float errorThreshold = 0.002f;
+	int minPasses = 4;   // variance estimates of fewer samples aren't trusted
+	int maxPasses = 256; // tiles stop after this many samples per pixel anyway
+	int tileSize = 16;   // unit of convergence
+};
+
+// Screen concept implementation which sums up the colors put into each pixel
+class AccumulationScreen
+{
+public:
+	// putPixel() only touches its own pixel, so disjoint pixels may be written concurrently
+	static constexpr bool concurrentPutPixel = true;
+
+	AccumulationScreen(int w, int h) : w(w), h(h), pixels(size_t(w)*h) {}
+
+	auto getW() const { return w; }
+	auto getH() const { return h; }
+
+	void clear() { std::fill(begin(pixels), end(pixels), Pixel{}); }
+	void putPixel(vec2i pos, RgbColor col);
+
+	RgbColor getMean(vec2i pos) const;
+
+	// Standard error of the mean luminance of the pixel, 0 with fewer than 2 samples
+	float getStandardError(vec2i pos) const;
+
+private:
+	struct Pixel
+	{
+		RgbColor sum = {0, 0, 0};
+		float luminanceSqrSum = 0.f;
+		uint32_t count = 0;
+	};
+
+	int w, h;
+	std::vector<Pixel> pixels;
+
+	const Pixel& getPixel(vec2i pos) const { assert(pos.x >= 0 && pos.x < w && pos.y >= 0 && pos.y < h); return pixels[size_t(pos.y)*w + pos.x]; }
+};
+
+float getLuminance(RgbColor col) { return 0.2126f*col.x + 0.7152f*col.y + 0.0722f*col.z; }
+
+// Refines an image of a static scene and camera over successive passes
+// Each pass traces one more sample for every pixel of the tiles that haven't
+//  converged yet; converged tiles are left alone, so passes get cheaper over time.
+// The scene or camera changing requires reset().
+class ProgressiveRenderer
+{
+public:
+	ProgressiveRenderer(int w, int h, ProgressiveSettings settings = {});
+
+	// Discards all samples
+	void reset();
+
+	// Renders one pass over the unconverged tiles; returns the number of tiles rendered
+	// settings.sampleIndex is replaced by the pass index of each tile. A pass with
+	//  several samples per pixel counts as one sample towards the tile's error.
+	template <typename SceneType>
+	int renderPass(const SceneType& scene, const Camera& camera, ThreadPool& threadPool,
+		RenderSettings settings = {}, std::optional<CameraSpan> span = std::nullopt);
+
+	bool isConverged() const { return activeTiles.empty(); }
+	int getPassCount() const { return passCount; }
+	uint64_t getSampleCount() const { return sampleCount; } // pixel samples traced since the last reset
+	auto getTileCount() const { return int(tiles.size()); }
+
+	// Writes the current estimate of every pixel
+	template <typename ScreenType>
+	void resolve(ScreenType& screen) const;
+
+private:
+	ProgressiveSettings settings;
+	AccumulationScreen accumulation;
+	std::vector<PixelRect> tiles;
+	std::vector<uint32_t> activeTiles; // indices into tiles
+	std::vector<PixelRect> passTiles;
+	int passCount = 0;
+	uint64_t sampleCount = 0;
+
+	float getTileError(const PixelRect& tile) const;
+};
+
+// .cpp
+void AccumulationScreen::putPixel(vec2i pos, RgbColor col)
+{
+	assert(pos.x >= 0 && pos.x < w && pos.y >= 0 && pos.y < h);
+	Pixel& pixel = pixels[size_t(pos.y)*w + pos.x];
+	const float luminance = getLuminance(col);
+	pixel.sum = pixel.sum + col;
+	pixel.luminanceSqrSum += luminance*luminance;
+	++pixel.count;
+}
+
+RgbColor AccumulationScreen::getMean(vec2i pos) const
+{
+	const Pixel& pixel = getPixel(pos);
+	return pixel.count > 0 ? pixel.sum / float(pixel.count) : RgbColor{0, 0, 0};
+}
+
+float AccumulationScreen::getStandardError(vec2i pos) const
+{
+	const Pixel& pixel = getPixel(pos);
+	if (pixel.count < 2)
+		return 0.f;
+
+	const float n = float(pixel.count);
+	const float mean = getLuminance(pixel.sum) / n;
+	const float variance = std::max(pixel.luminanceSqrSum/n - mean*mean, 0.f) * n/(n - 1);
+	return std::sqrt(variance / n);
+}
+
+ProgressiveRenderer::ProgressiveRenderer(int w, int h, ProgressiveSettings settings) :
+	settings(settings),
+	accumulation(w, h),
+	tiles(makeTiles(w, h, settings.tileSize))
+{
+	reset();
+}
+
+void ProgressiveRenderer::reset()
+{
+	accumulation.clear();
+	activeTiles.resize(tiles.size());
+	for (uint32_t i = 0; i < activeTiles.size(); ++i)
+		activeTiles[i] = i;
+	passCount = 0;
+	sampleCount = 0;
+}
+
+template <typename SceneType>
+int ProgressiveRenderer::renderPass(const SceneType& scene, const Camera& camera, ThreadPool& threadPool,
+	RenderSettings renderSettings, std::optional<CameraSpan> span)
+{
+	if (activeTiles.empty())
+		return 0;
+
+	// All active tiles have seen the same number of passes
+	passTiles.clear();
+	for (const uint32_t tile : activeTiles)
+		passTiles.push_back(tiles[tile]);
+
+	renderSettings.sampleIndex = uint32_t(passCount);
+	parallelRenderTiles(scene, accumulation, camera, threadPool, passTiles, span, renderSettings);
+	++passCount;
+
+	const int renderedCount = int(activeTiles.size());
+	for (const PixelRect& tile : passTiles)
+		sampleCount += uint64_t(tile.w) * tile.h * renderSettings.samplesPerPixel;
+
+	// Retire tiles that converged or ran out of passes
+	if (passCount >= settings.minPasses)
+	{
+		const bool isLastPass = passCount >= settings.maxPasses;
+		activeTiles.erase(std::remove_if(begin(activeTiles), end(activeTiles), [&](uint32_t tile) {
+			return isLastPass || getTileError(tiles[tile]) <= settings.errorThreshold;
+		}), end(activeTiles));
+	}
+
+	return renderedCount;
+}
+
+template <typename ScreenType>
+void ProgressiveRenderer::resolve(ScreenType& screen) const
+{
+	for (int y = 0; y < accumulation.getH(); ++y)
+		for (int x = 0; x < accumulation.getW(); ++x)
+			screen.putPixel({x, y}, accumulation.getMean({x, y}));
+}
+
+float ProgressiveRenderer::getTileError(const PixelRect& tile) const
+{
+	float errorSqrSum = 0.f;
+	for (int y = tile.y; y < tile.y + tile.h; ++y)
+	{
+		for (int x = tile.x; x < tile.x + tile.w; ++x)
+		{
+			const float error = accumulation.getStandardError({x, y});
+			errorSqrSum += error*error;
+		}
+	}
+	return std::sqrt(errorSqrSum / float(tile.w * tile.h));
+}
@@ -1,6 +1,17 @@
 #pragma once
 #include "Vec.h"
+#include "Color.h"
+#include "Object.h"
+#include "Packet.h"
+#include "Sampler.h"
+#include "Stats.h"
+#include "Shading.h"
+#include "Wavefront.h"
 #include <optional>
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
 #include <cassert>
 
 class Camera
@@ -31,79 +42,352 @@ struct CameraSpan
 	float top;
 };
 
-template <typename SceneType, int maxDepth>
-RgbColor traceRay(const Ray& ray, const SceneType& scene, int branchFactor, int depth)
+// Directions of the primary rays through the pixels of a w x h screen
+// Without a span, the image covers [-w/h, w/h] x [-1, 1] at the focal length.
+class PrimaryRays
 {
-	if (depth > maxDepth)
+public:
+	PrimaryRays(const Camera& camera, int w, int h, std::optional<CameraSpan> span = std::nullopt);
+
+	vec3f getDir(int x, int y) const;
+
+	// Continuous pixel coordinates of the primary ray through p, whose depth along the
+	//  viewing direction is returned in depth; nullopt if p isn't in front of the camera
+	std::optional<vec2f> project(vec3f p, float& depth) const;
+
+private:
+	Camera camera;
+	int w, h;
+	CameraSpan span;
+	std::array<vec3f, 3> axes;
+};
+
+// Rectangle of screen pixels
+struct PixelRect
+{
+	int x;
+	int y;
+	int w;
+	int h;
+};
+
+enum class RenderEngine
+{
+	Recursive, // each pixel's ray tree is traced depth-first
+	Wavefront  // the rays of a tile are traced bounce by bounce in batches (see Wavefront.h)
+};
+
+// Options controlling how render() traces the image
+struct RenderSettings
+{
+	// Both engines produce the same image
+	RenderEngine engine = RenderEngine::Recursive;
+
+	// Recursive engine: primary rays are traced in packets of 4, 8 or 16 neighbouring
+	//  pixels when the scene supports it; 1 traces them one by one
+	int packetWidth = 8;
+
+	// Depth, branching and Russian roulette of the rays traced for each sample
+	PathSettings path;
+
+	// Samples averaged per pixel; they share the primary ray and differ in their secondary rays
+	int samplesPerPixel = 1;
+
+	// Source of the random numbers used by secondary rays
+	SamplerKind sampler = SamplerKind::Sobol;
+	uint32_t sampleIndex = 0; // successive passes over the same image should use successive indices
+
+	// Edge length of the square tiles parallelRender() distributes among threads;
+	//  0 picks one based on the image size and thread count
+	int tileSize = 0;
+};
+
+// Sampler of the sample-th of the settings.samplesPerPixel samples of a pixel
+Sampler getPixelSampler(const RenderSettings& settings, vec2i pixel, int sample);
+
+template <typename SceneType>
+RgbColor shadeHit(const Ray& ray, const Hit& hit, const Material& material, const SceneType& scene,
+	const Sampler& sampler, const PathSettings& path, int depth, float throughput);
+
+// Color seen along a ray whose color has the given weight (throughput) in its pixel
+template <typename SceneType>
+RgbColor traceRay(const Ray& ray, const SceneType& scene, const Sampler& sampler, const PathSettings& path,
+	int depth = 0, float throughput = 1.f)
+{
+	if (depth > path.maxDepth)
 		return {0, 0, 0}; // background color
 
 	// Primary ray
 	const auto hit = scene.findFirstHit(ray);
+	stats::countRay(depth == 0 ? stats::RayType::Primary : stats::RayType::Secondary, depth);
+	stats::countHit(hit.has_value());
 	if (hit)
 	{
-		const auto& obj = *hit->obj;
-		const vec3f hitpos = hit->pos;
-		const Material material = getMaterial(obj, hitpos);
-		const vec3f normal = getNormal(obj, hitpos);
-		const float intensity = -(ray.dir * normal);
-		RgbColor color = intensity*material.color*0.8f;
-
-		// Secondary rays
-		if (depth + 1 <= maxDepth)
+		const Material material = getMaterial(scene.getMaterials(), *hit->obj, hit->pos);
+		return shadeHit(ray, *hit, material, scene, sampler, path, depth, throughput);
+	}
+	else
+		return {0, 0, 0};
+}
+
+// Color of a found ray-object intersection, including secondary rays
+template <typename SceneType>
+RgbColor shadeHit(const Ray& ray, const Hit& hit, const Material& material, const SceneType& scene,
+	const Sampler& sampler, const PathSettings& path, int depth, float throughput)
+{
+	const vec3f normal = getNormal(hit);
+	RgbColor color = getDirectLighting(scene, ray, hit.pos, normal, material, sampler, depth);
+
+	// Secondary rays
+	if (depth + 1 <= path.maxDepth)
+	{
+		const float secondaryThroughput = getSecondaryThroughput(throughput, material, path.branchFactor);
+		for (int i = 0; i < path.branchFactor; ++i)
 		{
-			for (int i = 0; i < branchFactor; ++i)
+			const Sampler secondarySampler = sampler.getChild(i, path.branchFactor);
+			const float weight = getContinuationWeight(path, secondaryThroughput, secondarySampler);
+			if (weight == 0.f)
+				continue; // terminated by Russian roulette
+
+			const Ray secondaryRay = getSecondaryRay(ray, hit.pos, normal, material, sampler, i, path.branchFactor);
+			const RgbColor secondaryColor = traceRay(secondaryRay, scene, secondarySampler, path,
+				depth+1, secondaryThroughput*weight);
+
+			color = addSecondaryColor(color, material, secondaryColor, weight, path.branchFactor);
+		}
+	}
+	else
+		stats::countDepthLimit();
+
+	return clamp(color, {0, 0, 0}, {1, 1, 1});
+}
+
+// Average color of all samples of a pixel whose primary ray hit
+template <typename SceneType>
+RgbColor shadePixel(const Ray& ray, const Hit& hit, const Material& material, const SceneType& scene,
+	vec2i pixel, const RenderSettings& settings)
+{
+	RgbColor sum = {0, 0, 0};
+	for (int sample = 0; sample < settings.samplesPerPixel; ++sample)
+		sum = sum + shadeHit(ray, hit, material, scene, getPixelSampler(settings, pixel, sample), settings.path, 0, 1.f);
+	return sum / float(settings.samplesPerPixel);
+}
+
+// Whether the scene implements the packet query findFirstHits<N>()
+template <typename SceneType, int N, typename = void>
+struct HasPacketQuery : std::false_type {};
+
+template <typename SceneType, int N>
+struct HasPacketQuery<SceneType, N, std::void_t<decltype(
+	std::declval<const SceneType&>().template findFirstHits<N>(std::declval<const RayPacket<N>&>(), LaneMask{}))>> :
+	std::true_type {};
+
+// Traces the primary rays of packetW x packetH pixel blocks together
+template <int packetW, int packetH, typename SceneType, typename ScreenType, typename GetDirType>
+void renderPackets(const SceneType& scene, ScreenType& screen, PixelRect rect, vec3f origin, GetDirType&& getPrimaryDir,
+	const RenderSettings& settings)
+{
+	constexpr int N = packetW*packetH;
+	const int endX = rect.x + rect.w;
+	const int endY = rect.y + rect.h;
+
+	for (int y0 = rect.y; y0 < endY; y0 += packetH)
+	{
+		for (int x0 = rect.x; x0 < endX; x0 += packetW)
+		{
+			RayPacket<N> packet;
+			packet.origin = origin;
+			LaneMask activeMask = 0;
+			for (int lane = 0; lane < N; ++lane)
+			{
+				const int x = x0 + lane%packetW;
+				const int y = y0 + lane/packetW;
+				const bool inside = x < endX && y < endY;
+				packet.setDir(lane, inside ? getPrimaryDir(x, y) : getPrimaryDir(x0, y0));
+				activeMask |= LaneMask(inside) << lane;
+			}
+
+			const auto hits = scene.template findFirstHits<N>(packet, activeMask);
+
+			// Evaluate materials of all hits of the packet at once
+			Hit hitList[N];
+			int hitLanes[N];
+			int hitCount = 0;
+			for (int lane = 0; lane < N; ++lane)
 			{
-				const vec3f jitterDir = {(rand()%1001-500)/500.f, (rand()%1001-500)/500.f, (rand()%1001-500)/500.f};
-				const vec3f reflectedDir = ray.dir - (ray.dir * normal)*2*normal;
-				const vec3f newDir = normalized(material.roughness*jitterDir + reflectedDir);
-				const Ray secondaryRay = {hitpos + newDir*0.01, newDir};
-				const RgbColor secondaryColor = traceRay<SceneType, maxDepth>(secondaryRay, scene, branchFactor, depth+1);
+				if ((activeMask >> lane) & 1) {
+					stats::countRay(stats::RayType::Primary, 0);
+					stats::countHit(hits[lane].has_value());
+				}
+
+				if (((activeMask >> lane) & 1) && hits[lane]) {
+					hitList[hitCount] = *hits[lane];
+					hitLanes[hitCount++] = lane;
+				}
+				else if ((activeMask >> lane) & 1)
+					screen.putPixel(vec2i{x0 + lane%packetW, y0 + lane/packetW}, RgbColor{0, 0, 0});
+			}
+			Material materials[N];
+			getMaterials(scene.getMaterials(), hitList, hitCount, materials);
 
-				color = color + material.reflectivity * secondaryColor / branchFactor;
+			for (int i = 0; i < hitCount; ++i)
+			{
+				const int lane = hitLanes[i];
+				const vec2i pixel = {x0 + lane%packetW, y0 + lane/packetW};
+				screen.putPixel(pixel, shadePixel(packet.getRay(lane), hitList[i], materials[i], scene, pixel, settings));
 			}
 		}
+	}
+}
+
+// Traces the pixels of rect with a WavefrontTracer, a batch of samples at a time
+// Batches run along the rows of rect and may split rows and the samples of a pixel.
+template <typename SceneType, typename ScreenType, typename GetDirType>
+void renderWavefront(const SceneType& scene, ScreenType& screen, PixelRect rect, vec3f origin, GetDirType&& getPrimaryDir,
+	const RenderSettings& settings)
+{
+	// Bounds the tracer's memory: a primary ray may spawn up to branchFactor^maxDepth rays at
+	//  the last bounce, so a batch has at most about maxBatchRays rays in flight, unless
+	//  a single primary ray may spawn more
+	constexpr int maxBatchSize = 1024;
+	constexpr int maxBatchRays = 1 << 17;
+	int leafCount = 1;
+	for (int depth = 0; depth < settings.path.maxDepth && leafCount < maxBatchRays; ++depth)
+		leafCount *= settings.path.branchFactor;
+	const int batchSize = std::clamp(maxBatchRays / std::max(leafCount, 1), 1, maxBatchSize);
+
+	thread_local WavefrontTracer tracer; // keeps its buffers across calls
+
+	std::vector<Ray> rays;
+	std::vector<Sampler> samplers;
+	std::vector<RgbColor> colors;
+	const int samplesPerPixel = settings.samplesPerPixel;
+	const int64_t sampleCount = int64_t(rect.w) * rect.h * samplesPerPixel;
+	auto getPixel = [&](int64_t sample) {
+		const int64_t pixelIndex = sample / samplesPerPixel;
+		return vec2i{rect.x + int(pixelIndex % rect.w), rect.y + int(pixelIndex / rect.w)};
+	};
+
+	RgbColor sum = {0, 0, 0}; // of the pixel whose samples are being added up
+	for (int64_t begin = 0; begin < sampleCount; begin += batchSize)
+	{
+		const int64_t end = std::min(begin + batchSize, sampleCount);
+		rays.clear();
+		samplers.clear();
+		for (int64_t i = begin; i < end; ++i)
+		{
+			const vec2i pixel = getPixel(i);
+			rays.push_back(Ray{origin, getPrimaryDir(pixel.x, pixel.y)});
+			samplers.push_back(getPixelSampler(settings, pixel, int(i % samplesPerPixel)));
+		}
 
-		return clamp(color, {0, 0, 0}, {1, 1, 1});
+		colors.resize(rays.size());
+		tracer.trace(scene, rays.data(), samplers.data(), int(rays.size()), settings.path, colors.data());
+		for (int64_t i = begin; i < end; ++i)
+		{
+			sum = sum + colors[size_t(i - begin)];
+			if (i % samplesPerPixel == samplesPerPixel - 1)
+			{
+				screen.putPixel(getPixel(i), sum / float(samplesPerPixel));
+				sum = {0, 0, 0};
+			}
+		}
 	}
-	else
-		return {0, 0, 0};
 }
 
 template <typename SceneType, typename ScreenType>
-void render(const SceneType& scene, ScreenType& screen, const Camera& camera, std::optional<CameraSpan> span = std::nullopt)
+void renderRect(const SceneType& scene, ScreenType& screen, const Camera& camera, PixelRect rect,
+	std::optional<CameraSpan> span, const RenderSettings& settings);
+
+template <typename SceneType, typename ScreenType>
+void render(const SceneType& scene, ScreenType& screen, const Camera& camera, std::optional<CameraSpan> span = std::nullopt,
+	const RenderSettings& settings = {})
 {
-	const auto screenW = screen.getW();
-	const auto screenH = screen.getH();
-	if (!span) {
-		float ratio = float(screenW)/screenH;
-		span = {-ratio, ratio, -1, 1};
-	}
-	const float xScale = span->right - span->left;
-	const float yScale = span->top - span->bottom;
+	renderRect(scene, screen, camera, PixelRect{0, 0, screen.getW(), screen.getH()}, span, settings);
+}
 
+// Renders only the pixels within rect; rays are generated as for the whole screen,
+//  so any split of the screen into rectangles produces the same image
+template <typename SceneType, typename ScreenType>
+void renderRect(const SceneType& scene, ScreenType& screen, const Camera& camera, PixelRect rect,
+	std::optional<CameraSpan> span, const RenderSettings& settings)
+{
 	const vec3f origin = camera.pos;
-	const auto axes = getAxes(camera);
-	const vec3f xAxis = axes[0];
-	const vec3f yAxis = axes[1];
-	const vec3f zAxis = axes[2];
+	const PrimaryRays primaryRays{camera, screen.getW(), screen.getH(), span};
+	auto getPrimaryDir = [&](int x, int y) { return primaryRays.getDir(x, y); };
+
+	if (settings.engine == RenderEngine::Wavefront)
+		return renderWavefront(scene, screen, rect, origin, getPrimaryDir, settings);
+
+	// Packet ray tracing of primary rays
+	if constexpr (HasPacketQuery<SceneType, 16>::value)
+	{
+		switch (settings.packetWidth)
+		{
+		case 4: return renderPackets<2, 2>(scene, screen, rect, origin, getPrimaryDir, settings);
+		case 8: return renderPackets<4, 2>(scene, screen, rect, origin, getPrimaryDir, settings);
+		case 16: return renderPackets<4, 4>(scene, screen, rect, origin, getPrimaryDir, settings);
+		default: assert(settings.packetWidth == 1); break;
+		}
+	}
 
 	// Per-pixel ray tracing
-	for (int y = 0; y < screenH; ++y)
+	for (int y = rect.y; y < rect.y + rect.h; ++y)
 	{
-		for (int x = 0; x < screenW; ++x)
+		for (int x = rect.x; x < rect.x + rect.w; ++x)
 		{
-			const vec3f dir = normalized(
-				xAxis*(span->left + xScale*x/screenW) +
-				yAxis*(span->bottom + yScale*y/screenH) +
-				-zAxis*camera.focalLength
-			);
-			const Ray ray = {origin, dir};
-
-			screen.putPixel(vec2i{x, y}, traceRay<SceneType, 4>(ray, scene, 3, 0));
+			const Ray ray = {origin, getPrimaryDir(x, y)};
+			const auto hit = scene.findFirstHit(ray);
+			stats::countRay(stats::RayType::Primary, 0);
+			stats::countHit(hit.has_value());
+
+			RgbColor color = {0, 0, 0};
+			if (hit)
+				color = shadePixel(ray, *hit, getMaterial(scene.getMaterials(), *hit->obj, hit->pos), scene, vec2i{x, y}, settings);
+			screen.putPixel(vec2i{x, y}, color);
 		}
 	}
 }
 
+PrimaryRays::PrimaryRays(const Camera& camera, int w, int h, std::optional<CameraSpan> span) :
+	camera(camera), w(w), h(h),
+	span(span.value_or(CameraSpan{-float(w)/h, float(w)/h, -1, 1})),
+	axes(getAxes(camera))
+{}
+
+vec3f PrimaryRays::getDir(int x, int y) const
+{
+	const float xScale = span.right - span.left;
+	const float yScale = span.top - span.bottom;
+	return normalized(
+		axes[0]*(span.left + xScale*x/w) +
+		axes[1]*(span.bottom + yScale*y/h) +
+		-axes[2]*camera.focalLength
+	);
+}
+
+std::optional<vec2f> PrimaryRays::project(vec3f p, float& depth) const
+{
+	// The axes are orthogonal, but only the viewing direction has unit length
+	const vec3f v = p - camera.pos;
+	depth = -(v * axes[2]);
+	if (!(depth > 0))
+		return std::nullopt;
+
+	const float scale = camera.focalLength / depth;
+	const float spanX = scale * (v * axes[0]) / lengthSqr(axes[0]);
+	const float spanY = scale * (v * axes[1]) / lengthSqr(axes[1]);
+	return vec2f{
+		(spanX - span.left) / (span.right - span.left) * float(w),
+		(spanY - span.bottom) / (span.top - span.bottom) * float(h)
+	};
+}
+
+Sampler getPixelSampler(const RenderSettings& settings, vec2i pixel, int sample)
+{
+	return Sampler{settings.sampler, pixel, settings.sampleIndex*uint32_t(settings.samplesPerPixel) + uint32_t(sample)};
+}
+
 std::array<vec3f, 3> getAxes(const Camera& camera)
 {
 	std::array<vec3f, 3> axes;
@@ -2,15 +2,26 @@
 #include "SDLWindow.h"
 #include "Vec.h"
 #include "Color.h"
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cassert>
 
 // SDL implementation of the Screen concept
 // Used as a render target for a graphical window.
+// Pixels are written into a packed 8-bit framebuffer, which present() uploads
+//  into a streaming texture with a single SDL_UpdateTexture call.
 class SDLScreen
 {
 public:
-	explicit SDLScreen(SDLWindow* sdlWindow) :
-		sdlWindow(sdlWindow)
-	{}
+	// putPixel() only touches its own pixel, so disjoint pixels may be written concurrently
+	static constexpr bool concurrentPutPixel = true;
+
+	explicit SDLScreen(SDLWindow* sdlWindow);
+
+	SDLScreen(const SDLScreen&) = delete;
+	SDLScreen& operator=(const SDLScreen&) = delete;
+	~SDLScreen();
 
 	auto getW() const { return sdlWindow->getW(); }
 	auto getH() const { return sdlWindow->getH(); }
@@ -18,20 +29,49 @@ public:
 	void clear();
 	void putPixel(vec2i pos, RgbColor col);
 
+	// Uploads the framebuffer and shows it in the window
+	void present();
+
 private:
 	SDLWindow* sdlWindow;
+	SDL_Texture* texture; // never null
+	std::vector<uint32_t> pixels; // ARGB8888, top row first
 };
 
+SDLScreen::SDLScreen(SDLWindow* sdlWindow) :
+	sdlWindow(sdlWindow),
+	pixels(size_t(sdlWindow->getW()) * sdlWindow->getH())
+{
+	texture = SDL_CreateTexture(&sdlWindow->getSDLRenderer(), SDL_PIXELFORMAT_ARGB8888,
+		SDL_TEXTUREACCESS_STREAMING, getW(), getH());
+	if (texture == NULL)
+		throw WindowInitException("Can't create SDL_Texture");
+	clear();
+}
+
+SDLScreen::~SDLScreen()
+{
+	SDL_DestroyTexture(texture);
+}
+
 void SDLScreen::clear()
 {
-	auto* renderer = &sdlWindow->getSDLRenderer();
-	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
-	SDL_RenderClear(renderer);
+	std::fill(begin(pixels), end(pixels), 0xff000000u);
 }
 
 void SDLScreen::putPixel(vec2i pos, RgbColor col)
+{
+	assert(pos.x >= 0 && pos.x < getW());
+	assert(pos.y >= 0 && pos.y < getH());
+	auto toByte = [](float c) { return uint32_t(255*std::clamp(c, 0.f, 1.f)); };
+	pixels[size_t(getH() - 1 - pos.y)*getW() + pos.x] =
+		0xff000000u | (toByte(col.x) << 16) | (toByte(col.y) << 8) | toByte(col.z);
+}
+
+void SDLScreen::present()
 {
 	auto* renderer = &sdlWindow->getSDLRenderer();
-	SDL_SetRenderDrawColor(renderer, 255*col.x, 255*col.y, 255*col.z, 255);
-	SDL_RenderDrawPoint(renderer, pos.x, getH() - pos.y);
+	SDL_UpdateTexture(texture, NULL, pixels.data(), getW() * int(sizeof(uint32_t)));
+	SDL_RenderCopy(renderer, texture, NULL, NULL);
+	sdlWindow->swapBuffers();
 }
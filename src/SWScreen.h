@@ -2,6 +2,7 @@
 #include "Vec.h"
 #include "Color.h"
 #include <vector>
+#include <cstdint>
 #include <cassert>
 
 // Software implementation of the Screen concept
@@ -9,6 +10,9 @@
 class SWScreen
 {
 public:
+	// putPixel() only touches its own pixel, so disjoint pixels may be written concurrently
+	static constexpr bool concurrentPutPixel = true;
+
 	explicit SWScreen(int w, int h) :
 		w(w),
 		h(h),
@@ -31,6 +35,10 @@ private:
 	std::vector<RgbColor> pixels;
 };
 
+// Copies source onto a screen of any size, scaled with nearest neighbour sampling
+template <typename ScreenType>
+void copyScaled(const SWScreen& source, ScreenType& target);
+
 void SWScreen::clear()
 {
 	std::fill(begin(pixels), end(pixels), RgbColor{});
@@ -40,3 +48,16 @@ void SWScreen::putPixel(vec2i pos, RgbColor col)
 {
 	pixels[pos.y*w+pos.x] = col;
 }
+
+template <typename ScreenType>
+void copyScaled(const SWScreen& source, ScreenType& target)
+{
+	const int targetW = target.getW();
+	const int targetH = target.getH();
+	for (int y = 0; y < targetH; ++y)
+	{
+		const int sourceY = int(int64_t(y) * source.getH() / targetH);
+		for (int x = 0; x < targetW; ++x)
+			target.putPixel({x, y}, source.getPixel({int(int64_t(x) * source.getW() / targetW), sourceY}));
+	}
+}
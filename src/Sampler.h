@@ -0,0 +1,220 @@
+#pragma once
+#include "Vec.h"
+#include <cstdint>
+
+// Small, fast random number generator (PCG-XSH-RR, 64-bit state, 32-bit output)
+class Pcg32
+{
+public:
+	explicit Pcg32(uint64_t seed, uint64_t stream = 0x14057b7ef767814full);
+
+	uint32_t next();
+	float nextFloat() { return (next() >> 8) * 0x1p-24f; } // [0, 1)
+
+private:
+	uint64_t state = 0;
+	uint64_t inc;
+};
+
+// Integer hashing used to derive independent seeds
+uint32_t hash(uint32_t x);
+uint32_t hashCombine(uint32_t seed, uint32_t x) { return hash(seed ^ (x + 0x9e3779b9u + (seed << 6) + (seed >> 2))); }
+
+// Owen-scrambled Sobol points (Burley 2020, "Practical Hash-based Owen Scrambling")
+// Returns the dim-th coordinate (dim < 3) of the index-th point in 32-bit fixed point.
+uint32_t sobol(uint32_t index, int dim);
+uint32_t owenScramble(uint32_t x, uint32_t seed);
+
+enum class SamplerKind
+{
+	Random, // independent PCG streams
+	Sobol   // shuffled, Owen-scrambled Sobol sequence; converges faster
+};
+
+// Source of sample points for one path of a pixel
+// A sampler is a small value seeded by (pixel, sample index, bounce), so that
+//  the same pixel always gets the same samples, no matter which thread traces it.
+// Rays spawned at a hit get child samplers: the branch-th of branchCount
+//  secondary rays uses point index*branchCount+branch, which keeps the
+//  branches of one hit (and the samples of one pixel) stratified.
+class Sampler
+{
+public:
+	Sampler(SamplerKind kind, vec2i pixel, uint32_t sampleIndex);
+
+	// Point in [0, 1)^3 for the branch-th secondary ray of the current bounce
+	vec3f get3D(int branch, int branchCount) const;
+
+	// Point in [0, 1)^2 for sampling the light-th light from the current bounce
+	vec2f getLight2D(int light) const;
+
+	// Number in [0, 1) deciding whether the ray of this sampler is traced (Russian roulette)
+	float getRoulette1D() const;
+
+	// Sampler used by the branch-th secondary ray for its own bounces
+	Sampler getChild(int branch, int branchCount) const;
+
+private:
+	SamplerKind kind;
+	uint32_t pixelSeed;
+	uint32_t index;
+	uint32_t bounce = 0;
+};
+
+// .cpp
+Pcg32::Pcg32(uint64_t seed, uint64_t stream) :
+	inc((stream << 1u) | 1u)
+{
+	next();
+	state += seed;
+	next();
+}
+
+uint32_t Pcg32::next()
+{
+	const uint64_t oldState = state;
+	state = oldState * 6364136223846793005ull + inc;
+	const auto xorShifted = uint32_t(((oldState >> 18u) ^ oldState) >> 27u);
+	const auto rot = uint32_t(oldState >> 59u);
+	return (xorShifted >> rot) | (xorShifted << ((32u - rot) & 31u));
+}
+
+uint32_t hash(uint32_t x)
+{
+	// PCG output hash (Jarzynski, Olano 2020)
+	const uint32_t state = x * 747796405u + 2891336453u;
+	const uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+namespace detail
+{
+	// Direction numbers of the first three Sobol dimensions (Joe-Kuo parameters)
+	struct SobolDirections
+	{
+		uint32_t v[3][32];
+
+		constexpr SobolDirections() : v{}
+		{
+			for (int bit = 0; bit < 32; ++bit)
+				v[0][bit] = 1u << (31 - bit);
+
+			// x + 1: s = 1, a = 0, m = {1}
+			v[1][0] = 1u << 31;
+			for (int bit = 1; bit < 32; ++bit)
+				v[1][bit] = v[1][bit-1] ^ (v[1][bit-1] >> 1);
+
+			// x^2 + x + 1: s = 2, a = 1, m = {1, 3}
+			v[2][0] = 1u << 31;
+			v[2][1] = 3u << 30;
+			for (int bit = 2; bit < 32; ++bit)
+				v[2][bit] = v[2][bit-2] ^ (v[2][bit-2] >> 2) ^ v[2][bit-1];
+		}
+	};
+
+	constexpr SobolDirections sobolDirections;
+
+	uint32_t reverseBits(uint32_t x)
+	{
+		x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+		x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+		x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+		x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+		return (x >> 16) | (x << 16);
+	}
+
+	float toUnitFloat(uint32_t x)
+	{
+		return (x >> 8) * 0x1p-24f;
+	}
+}
+
+uint32_t sobol(uint32_t index, int dim)
+{
+	uint32_t x = 0;
+	for (int bit = 0; index != 0; ++bit, index >>= 1)
+		x ^= (index & 1) * detail::sobolDirections.v[dim][bit];
+	return x;
+}
+
+uint32_t owenScramble(uint32_t x, uint32_t seed)
+{
+	// Laine-Karras style permutation applied to the reversed bits
+	x = detail::reverseBits(x);
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return detail::reverseBits(x);
+}
+
+Sampler::Sampler(SamplerKind kind, vec2i pixel, uint32_t sampleIndex) :
+	kind(kind),
+	pixelSeed(hashCombine(hash(uint32_t(pixel.x)), uint32_t(pixel.y))),
+	index(sampleIndex)
+{}
+
+vec3f Sampler::get3D(int branch, int branchCount) const
+{
+	const uint32_t pointIndex = index*uint32_t(branchCount) + uint32_t(branch);
+	const uint32_t seed = hashCombine(pixelSeed, bounce);
+
+	if (kind == SamplerKind::Random)
+	{
+		Pcg32 rng{(uint64_t(seed) << 32) | pointIndex};
+		const float x = rng.nextFloat();
+		const float y = rng.nextFloat();
+		const float z = rng.nextFloat();
+		return {x, y, z};
+	}
+
+	// Shuffle the point order per pixel and bounce, then scramble each dimension
+	const uint32_t shuffled = owenScramble(pointIndex, seed);
+	return {
+		detail::toUnitFloat(owenScramble(sobol(shuffled, 0), hashCombine(seed, 1))),
+		detail::toUnitFloat(owenScramble(sobol(shuffled, 1), hashCombine(seed, 2))),
+		detail::toUnitFloat(owenScramble(sobol(shuffled, 2), hashCombine(seed, 3)))
+	};
+}
+
+vec2f Sampler::getLight2D(int light) const
+{
+	// Separate scrambling seeds keep light samples independent of the secondary ray samples
+	const uint32_t seed = hashCombine(hashCombine(pixelSeed, bounce), 0x4c000000u + uint32_t(light));
+
+	if (kind == SamplerKind::Random)
+	{
+		Pcg32 rng{(uint64_t(seed) << 32) | index};
+		const float x = rng.nextFloat();
+		const float y = rng.nextFloat();
+		return {x, y};
+	}
+
+	const uint32_t shuffled = owenScramble(index, seed);
+	return {
+		detail::toUnitFloat(owenScramble(sobol(shuffled, 0), hashCombine(seed, 1))),
+		detail::toUnitFloat(owenScramble(sobol(shuffled, 1), hashCombine(seed, 2)))
+	};
+}
+
+float Sampler::getRoulette1D() const
+{
+	const uint32_t seed = hashCombine(hashCombine(pixelSeed, bounce), 0x52000000u);
+
+	if (kind == SamplerKind::Random)
+	{
+		Pcg32 rng{(uint64_t(seed) << 32) | index};
+		return rng.nextFloat();
+	}
+
+	return detail::toUnitFloat(owenScramble(sobol(owenScramble(index, seed), 0), hashCombine(seed, 1)));
+}
+
+Sampler Sampler::getChild(int branch, int branchCount) const
+{
+	Sampler child = *this;
+	child.index = index*uint32_t(branchCount) + uint32_t(branch);
+	child.bounce = bounce + 1;
+	return child;
+}
@@ -0,0 +1,519 @@
+#pragma once
+#include "AcceleratedScene.h"
+#include "Mesh.h"
+#include "MeshIO.h"
+#include "Material.h"
+#include "Light.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <fstream>
+#include <type_traits>
+#include <stdexcept>
+#include <variant>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <cassert>
+
+// Binary cache of a built AcceleratedScene
+// The file holds the materials, lights and objects of the scene together with the
+//  top-level hierarchy and the arrays of every mesh (including their hierarchies),
+//  each in its own 64-byte aligned section. Sections are referenced by file offset,
+//  so the file is position independent: it is memory-mapped and the mesh arrays,
+//  which make up nearly all of it, are used in place.
+// The header records the hash of what the scene was built from; a cache built from
+//  anything else, by another format version or on a machine of other byte order
+//  is ignored, and loadCachedScene() rebuilds and rewrites it.
+
+namespace detail
+{
+	constexpr char sceneCacheMagic[8] = {'R', 'T', 'S', 'C', 'A', 'C', 'H', 'E'};
+	constexpr uint32_t sceneCacheVersion = 2;
+	constexpr uint32_t sceneCacheByteOrder = 0x01020304; // reads differently on a machine of other byte order
+	constexpr uint64_t sceneCacheAlignment = 64;
+
+	// Array of count elements at offset bytes from the start of the file
+	struct CacheSection
+	{
+		uint64_t offset = 0;
+		uint64_t count = 0;
+	};
+
+	struct SceneCacheHeader
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t byteOrder;
+		uint64_t sourceHash;
+		uint64_t fileSize;
+		CacheSection materials; // MaterialEntry, including the default entry 0
+		CacheSection lights;    // Light
+		CacheSection objects;   // CachedObject in the leaf order of nodes
+		CacheSection nodes;     // BvhNode of the top-level hierarchy
+		CacheSection meshes;    // CachedMesh
+	};
+
+	enum class CachedShape : uint32_t { Sphere, Triangle, Mesh };
+
+	// Object with its shape flattened; meshes are referenced by index
+	struct CachedObject
+	{
+		CachedShape shape;
+		MaterialId material;
+		uint32_t mesh;    // Mesh: index into the meshes section
+		float data[9];    // Sphere: pos, radius; Triangle: vertices
+	};
+
+	struct CachedMesh
+	{
+		CacheSection vertices;  // vec3f
+		CacheSection indices;   // uint32_t
+		CacheSection triangles; // PrecomputedTriangle
+		CacheSection nodes;     // BvhNode
+		Aabb bounds;            // kept apart from the arrays, so that it can be read without them
+	};
+
+	// Everything is stored as raw bytes, layouts are part of the format version
+	static_assert(std::is_trivially_copyable_v<MaterialEntry> && sizeof(MaterialEntry) == 52);
+	static_assert(std::is_trivially_copyable_v<Light> && sizeof(Light) == 64);
+	static_assert(std::is_trivially_copyable_v<PrecomputedTriangle> && sizeof(PrecomputedTriangle) == 48);
+	static_assert(std::is_trivially_copyable_v<BvhNode> && sizeof(BvhNode) == 32);
+	static_assert(std::is_trivially_copyable_v<vec3f> && sizeof(vec3f) == 12);
+}
+
+// Thrown when a scene cache can't be written
+struct SceneCacheException : std::runtime_error
+{
+	explicit SceneCacheException(const std::string& msg) :
+		std::runtime_error(msg)
+	{}
+};
+
+// 64-bit hash of a byte range, fast enough to hash large mesh files on every start
+uint64_t hashBytes(const void* data, size_t size, uint64_t seed = 0);
+
+// hashBytes() of a file's contents; throws MeshReadException if it can't be read
+uint64_t hashFile(const std::string& path);
+
+// Streams a scene cache to a file
+// Mesh arrays are written as the meshes are added, so a scene can be written mesh by
+//  mesh without holding all of it in memory. path is only replaced by finish(); an
+//  unfinished writer removes its temporary file.
+class SceneCacheWriter
+{
+public:
+	explicit SceneCacheWriter(const std::string& path);
+	SceneCacheWriter(const SceneCacheWriter&) = delete;
+	SceneCacheWriter& operator=(const SceneCacheWriter&) = delete;
+	~SceneCacheWriter();
+
+	// Returns the index by which objects refer to the mesh
+	uint32_t addMesh(const MeshData& mesh);
+
+	// Objects have to be added in the leaf order of the nodes passed to finish();
+	//  meshIndex is used by Mesh objects only
+	void addObject(const Object& obj, uint32_t meshIndex = 0);
+
+	void finish(const MaterialTable& materials, const std::vector<Light>& lights,
+		const std::vector<BvhNode>& nodes, uint64_t sourceHash);
+
+private:
+	std::string path;
+	std::string tempPath;
+	std::ofstream file;
+	detail::SceneCacheHeader header;
+	std::vector<detail::CachedObject> objects;
+	std::vector<detail::CachedMesh> meshes;
+	bool isFinished = false;
+
+	template <typename T>
+	detail::CacheSection writeSection(const T* data, size_t count);
+};
+
+// Writes the scene to path, replacing an existing file only once the new one is complete
+void writeSceneCache(const AcceleratedScene& scene, uint64_t sourceHash, const std::string& path);
+
+// Scene read from a cache file; mesh objects use their arrays in place
+struct SceneCacheContents
+{
+	std::vector<Object> objects; // in the leaf order of nodes
+	std::vector<Aabb> bounds;    // of the objects, stored in the file for meshes
+	MaterialTable materials;
+	std::vector<Light> lights;
+	std::vector<BvhNode> nodes;
+};
+
+// Reads a mapped scene cache; nullopt if it is damaged, of another format version or
+//  (given a sourceHash) wasn't built from sourceHash
+// Unless checkMeshes is set, the pages of the mesh arrays aren't touched and checking them
+//  with isValidCachedMesh() is left to the caller.
+std::optional<SceneCacheContents> mapSceneCache(std::shared_ptr<const MappedFile> file, std::optional<uint64_t> sourceHash,
+	bool checkMeshes = true);
+
+// Whether the hierarchy and indices of a mesh read from a cache stay within its arrays
+bool isValidCachedMesh(const MeshData& mesh);
+
+// Maps the cache at path; nullopt if it is missing, damaged or wasn't built from sourceHash
+std::optional<AcceleratedScene> readSceneCache(const std::string& path, uint64_t sourceHash);
+
+// Whether the header of the cache at path is of this version, records sourceHash and
+//  the file's size (so a truncated file isn't current)
+// Only reads the header, for caches used without reading them as a whole.
+bool isSceneCacheCurrent(const std::string& path, uint64_t sourceHash);
+
+// Reads the scene from the cache at path, or builds it by build() and writes the cache
+// An empty path disables the cache.
+template <typename BuildFn>
+AcceleratedScene loadCachedScene(const std::string& path, uint64_t sourceHash, BuildFn&& build);
+
+// .cpp
+namespace detail
+{
+	uint64_t alignCacheOffset(uint64_t offset)
+	{
+		return (offset + sceneCacheAlignment - 1) / sceneCacheAlignment * sceneCacheAlignment;
+	}
+
+	uint64_t mixHash(uint64_t h)
+	{
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdull;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ull;
+		h ^= h >> 33;
+		return h;
+	}
+
+	// Array of a section of a mapped file; nullopt if it doesn't lie within the file
+	template <typename T>
+	std::optional<ArrayView<T>> getCacheSection(const MappedFile& file, const CacheSection& section)
+	{
+		if (section.offset % alignof(T) != 0 || section.offset > file.size()
+			|| section.count > (file.size() - section.offset) / sizeof(T))
+			return std::nullopt;
+		return ArrayView<T>{reinterpret_cast<const T*>(file.data() + section.offset), size_t(section.count)};
+	}
+
+	CachedObject makeCachedObject(const Object& obj, uint32_t meshIndex)
+	{
+		CachedObject cached = {};
+		cached.material = obj.material;
+		if (auto* sphere = std::get_if<Sphere>(&obj.shape))
+		{
+			cached.shape = CachedShape::Sphere;
+			const float data[] = {sphere->pos.x, sphere->pos.y, sphere->pos.z, sphere->radius};
+			std::copy(std::begin(data), std::end(data), cached.data);
+		}
+		else if (auto* tri = std::get_if<Triangle>(&obj.shape))
+		{
+			cached.shape = CachedShape::Triangle;
+			for (int v = 0; v < 3; ++v)
+			{
+				cached.data[3*v + 0] = tri->verts[v].x;
+				cached.data[3*v + 1] = tri->verts[v].y;
+				cached.data[3*v + 2] = tri->verts[v].z;
+			}
+		}
+		else
+		{
+			cached.shape = CachedShape::Mesh;
+			cached.mesh = meshIndex;
+		}
+		return cached;
+	}
+}
+
+uint64_t hashBytes(const void* data, size_t size, uint64_t seed)
+{
+	// Four independent lanes of 8-byte words keep the multipliers busy
+	const auto* bytes = static_cast<const unsigned char*>(data);
+	const uint64_t prime = 0x9e3779b97f4a7c15ull;
+	uint64_t lanes[4] = {seed, seed ^ prime, seed + prime, seed - prime};
+
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32)
+	{
+		for (int lane = 0; lane < 4; ++lane)
+		{
+			uint64_t word;
+			std::memcpy(&word, bytes + i + 8*lane, 8);
+			lanes[lane] = (lanes[lane] ^ (word * prime)) * 0xbf58476d1ce4e5b9ull;
+			lanes[lane] ^= lanes[lane] >> 31;
+		}
+	}
+
+	uint64_t h = uint64_t(size) * prime;
+	for (const uint64_t lane : lanes)
+		h = detail::mixHash(h ^ lane);
+
+	for (; i < size; ++i)
+		h = (h ^ bytes[i]) * 0x100000001b3ull;
+	return detail::mixHash(h);
+}
+
+uint64_t hashFile(const std::string& path)
+{
+	const MappedFile file{path};
+	return hashBytes(file.data(), file.size());
+}
+
+SceneCacheWriter::SceneCacheWriter(const std::string& path) :
+	path(path),
+	tempPath(path + ".tmp"),
+	file(tempPath, std::ios::binary | std::ios::trunc)
+{
+	if (!file)
+		throw SceneCacheException("Can't open " + tempPath);
+
+	// The header is rewritten by finish(), once the sections are known
+	header = {};
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+}
+
+SceneCacheWriter::~SceneCacheWriter()
+{
+	if (!isFinished)
+	{
+		file.close();
+		std::remove(tempPath.c_str());
+	}
+}
+
+uint32_t SceneCacheWriter::addMesh(const MeshData& mesh)
+{
+	detail::CachedMesh cached;
+	cached.vertices = writeSection(mesh.vertices.data(), mesh.vertices.size());
+	cached.indices = writeSection(mesh.indices.data(), mesh.indices.size());
+	cached.triangles = writeSection(mesh.triangles.data(), mesh.triangles.size());
+	cached.nodes = writeSection(mesh.nodes.data(), mesh.nodes.size());
+	cached.bounds = mesh.nodes.empty() ? Aabb{} : mesh.nodes[0].bounds;
+	meshes.push_back(cached);
+	return uint32_t(meshes.size() - 1);
+}
+
+void SceneCacheWriter::addObject(const Object& obj, uint32_t meshIndex)
+{
+	assert(!std::holds_alternative<Mesh>(obj.shape) || meshIndex < meshes.size());
+	objects.push_back(detail::makeCachedObject(obj, meshIndex));
+}
+
+void SceneCacheWriter::finish(const MaterialTable& materials, const std::vector<Light>& lights,
+	const std::vector<BvhNode>& nodes, uint64_t sourceHash)
+{
+	using namespace detail;
+	assert(!isFinished);
+
+	std::vector<MaterialEntry> materialEntries;
+	for (MaterialId id = 0; id < materials.size(); ++id)
+		materialEntries.push_back(materials[id]);
+
+	std::copy(std::begin(sceneCacheMagic), std::end(sceneCacheMagic), header.magic);
+	header.version = sceneCacheVersion;
+	header.byteOrder = sceneCacheByteOrder;
+	header.sourceHash = sourceHash;
+	header.materials = writeSection(materialEntries.data(), materialEntries.size());
+	header.lights = writeSection(lights.data(), lights.size());
+	header.objects = writeSection(objects.data(), objects.size());
+	header.nodes = writeSection(nodes.data(), nodes.size());
+	header.meshes = writeSection(meshes.data(), meshes.size());
+
+	// Pad the last section, so that the file size is a multiple of the alignment
+	header.fileSize = writeSection<char>(nullptr, 0).offset;
+	file.seekp(0);
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	if (!file.flush())
+		throw SceneCacheException("Can't write " + tempPath);
+	file.close();
+
+	// Renamed only once complete, so that readers never see a partial file
+	if (std::rename(tempPath.c_str(), path.c_str()) != 0)
+		throw SceneCacheException("Can't replace " + path);
+	isFinished = true;
+}
+
+template <typename T>
+detail::CacheSection SceneCacheWriter::writeSection(const T* data, size_t count)
+{
+	static const char zeros[detail::sceneCacheAlignment] = {};
+	const uint64_t pos = uint64_t(file.tellp());
+	const detail::CacheSection section{detail::alignCacheOffset(pos), count};
+	file.write(zeros, std::streamsize(section.offset - pos));
+	file.write(reinterpret_cast<const char*>(data), std::streamsize(count*sizeof(T)));
+	if (!file)
+		throw SceneCacheException("Can't write " + tempPath);
+	return section;
+}
+
+void writeSceneCache(const AcceleratedScene& scene, uint64_t sourceHash, const std::string& path)
+{
+	SceneCacheWriter writer{path};
+
+	// Meshes shared by several objects are stored once
+	std::unordered_map<const MeshData*, uint32_t> meshIndices;
+	for (const Object& obj : scene.getObjects())
+	{
+		uint32_t meshIndex = 0;
+		if (auto* mesh = std::get_if<Mesh>(&obj.shape))
+		{
+			auto it = meshIndices.find(mesh->data.get());
+			if (it == meshIndices.end())
+				it = meshIndices.emplace(mesh->data.get(), writer.addMesh(*mesh->data)).first;
+			meshIndex = it->second;
+		}
+		writer.addObject(obj, meshIndex);
+	}
+
+	writer.finish(scene.getMaterials(), scene.getLights(), scene.getBvh().getNodes(), sourceHash);
+}
+
+bool isValidCachedMesh(const MeshData& mesh)
+{
+	const size_t vertexCount = mesh.vertices.size();
+	return 3*mesh.triangles.size() == mesh.indices.size()
+		&& std::all_of(mesh.indices.begin(), mesh.indices.end(), [&](uint32_t i) { return i < vertexCount; })
+		&& isValidBvh(mesh.nodes.data(), mesh.nodes.size(), mesh.triangles.size());
+}
+
+std::optional<SceneCacheContents> mapSceneCache(std::shared_ptr<const MappedFile> file, std::optional<uint64_t> sourceHash,
+	bool checkMeshes)
+{
+	using namespace detail;
+
+	SceneCacheHeader header;
+	if (file->size() < sizeof(header))
+		return std::nullopt;
+	std::memcpy(&header, file->data(), sizeof(header));
+	if (!std::equal(std::begin(sceneCacheMagic), std::end(sceneCacheMagic), header.magic)
+		|| header.version != sceneCacheVersion || header.byteOrder != sceneCacheByteOrder
+		|| (sourceHash && header.sourceHash != *sourceHash) || header.fileSize != file->size())
+		return std::nullopt;
+
+	const auto materialEntries = getCacheSection<MaterialEntry>(*file, header.materials);
+	const auto lights = getCacheSection<Light>(*file, header.lights);
+	const auto cachedObjects = getCacheSection<CachedObject>(*file, header.objects);
+	const auto nodes = getCacheSection<BvhNode>(*file, header.nodes);
+	const auto cachedMeshes = getCacheSection<CachedMesh>(*file, header.meshes);
+	if (!materialEntries || materialEntries->empty() || !lights || !cachedObjects || !nodes || !cachedMeshes)
+		return std::nullopt;
+
+	// Mesh arrays stay in the mapping, which their MeshData keeps alive
+	std::vector<Mesh> meshes;
+	for (const CachedMesh& cached : *cachedMeshes)
+	{
+		const auto vertices = getCacheSection<vec3f>(*file, cached.vertices);
+		const auto indices = getCacheSection<uint32_t>(*file, cached.indices);
+		const auto triangles = getCacheSection<PrecomputedTriangle>(*file, cached.triangles);
+		const auto meshNodes = getCacheSection<BvhNode>(*file, cached.nodes);
+		if (!vertices || !indices || !triangles || !meshNodes || 3*triangles->size() != indices->size())
+			return std::nullopt;
+
+		auto data = std::make_shared<MeshData>();
+		data->vertices = *vertices;
+		data->indices = *indices;
+		data->triangles = *triangles;
+		data->nodes = *meshNodes;
+		data->storage = file;
+		if (checkMeshes && !isValidCachedMesh(*data))
+			return std::nullopt;
+		meshes.push_back(Mesh{std::move(data)});
+	}
+
+	SceneCacheContents contents;
+
+	// Entry 0 of a MaterialTable always exists
+	for (size_t i = 1; i < materialEntries->size(); ++i)
+		contents.materials.add((*materialEntries)[i]);
+
+	contents.objects.reserve(cachedObjects->size());
+	contents.bounds.reserve(cachedObjects->size());
+	for (const CachedObject& cached : *cachedObjects)
+	{
+		if (cached.material >= contents.materials.size())
+			return std::nullopt;
+
+		const float* d = cached.data;
+		switch (cached.shape)
+		{
+		case CachedShape::Sphere:
+		{
+			const Sphere sphere{{d[0], d[1], d[2]}, d[3]};
+			contents.objects.push_back(Object{sphere, cached.material});
+			contents.bounds.push_back(getBounds(sphere));
+			break;
+		}
+		case CachedShape::Triangle:
+		{
+			const Triangle tri{{{d[0], d[1], d[2]}, {d[3], d[4], d[5]}, {d[6], d[7], d[8]}}};
+			contents.objects.push_back(Object{tri, cached.material});
+			contents.bounds.push_back(getBounds(tri));
+			break;
+		}
+		case CachedShape::Mesh:
+			if (cached.mesh >= meshes.size())
+				return std::nullopt;
+			contents.objects.push_back(Object{meshes[cached.mesh], cached.material});
+			contents.bounds.push_back((*cachedMeshes)[cached.mesh].bounds); // without touching the mesh's pages
+			break;
+		default:
+			return std::nullopt;
+		}
+	}
+
+	if (!isValidBvh(nodes->data(), nodes->size(), contents.objects.size()))
+		return std::nullopt;
+	contents.lights.assign(lights->begin(), lights->end());
+	contents.nodes.assign(nodes->begin(), nodes->end());
+	return contents;
+}
+
+std::optional<AcceleratedScene> readSceneCache(const std::string& path, uint64_t sourceHash)
+{
+	std::shared_ptr<const MappedFile> file;
+	try
+	{
+		file = std::make_shared<const MappedFile>(path);
+	}
+	catch (const MeshReadException&)
+	{
+		return std::nullopt; // no cache yet
+	}
+
+	auto contents = mapSceneCache(std::move(file), sourceHash);
+	if (!contents)
+		return std::nullopt;
+	return AcceleratedScene{std::move(contents->objects), std::move(contents->materials),
+		std::move(contents->lights), Bvh{std::move(contents->nodes)}};
+}
+
+bool isSceneCacheCurrent(const std::string& path, uint64_t sourceHash)
+{
+	using namespace detail;
+
+	std::ifstream file{path, std::ios::binary | std::ios::ate};
+	const auto fileSize = file.tellg();
+	SceneCacheHeader header;
+	if (!file.seekg(0) || !file.read(reinterpret_cast<char*>(&header), sizeof(header)))
+		return false;
+	return std::equal(std::begin(sceneCacheMagic), std::end(sceneCacheMagic), header.magic)
+		&& header.version == sceneCacheVersion && header.byteOrder == sceneCacheByteOrder
+		&& header.sourceHash == sourceHash && header.fileSize == uint64_t(fileSize);
+}
+
+template <typename BuildFn>
+AcceleratedScene loadCachedScene(const std::string& path, uint64_t sourceHash, BuildFn&& build)
+{
+	if (path.empty())
+		return build();
+
+	if (auto cached = readSceneCache(path, sourceHash))
+		return std::move(*cached);
+
+	AcceleratedScene scene = build();
+	writeSceneCache(scene, sourceHash, path);
+	return scene;
+}
@@ -0,0 +1,295 @@
+#pragma once
+#include "BasicScene.h"
+#include "AcceleratedScene.h"
+#include "Material.h"
+#include "Mesh.h"
+#include "MeshIO.h"
+#include "ThreadPool.h"
+#include "SceneCache.h"
+#include "OutOfCoreScene.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <random>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+
+// Canonical scenes shared by the interactive viewer and the headless renderer
+// Each provides getScene() (a Scene) and update() (advances its animation).
+// The static scenes take an optional cachePath: when given, the built scene is
+//  read from that scene cache file, or written to it (see SceneCache.h).
+
+// A few reflective spheres above a floor
+class ExampleScene {
+public:
+	// Without lights, the scene is lit by a headlight; withLights adds a point
+	//  light and an area light, which cast (soft) shadows
+	explicit ExampleScene(bool withLights = false);
+	void update(); // simple animations
+
+	const BasicScene& getScene() const { return basicScene; }
+
+private:
+	BasicScene basicScene;
+	float time = 0.f; // used in animation
+};
+
+// Dense field of small random spheres above a floor
+class SphereFieldScene {
+public:
+	explicit SphereFieldScene(int sphereCount = 10000, unsigned seed = 1, const std::string& cachePath = {});
+	void update() {} // static
+
+	const AcceleratedScene& getScene() const { return acceleratedScene; }
+
+private:
+	AcceleratedScene acceleratedScene;
+};
+
+// Large mesh of randomly oriented small triangles above a floor
+class TriangleSoupScene {
+public:
+	explicit TriangleSoupScene(int triangleCount = 100000, unsigned seed = 1, const std::string& cachePath = {});
+	void update() {} // static
+
+	const AcceleratedScene& getScene() const { return acceleratedScene; }
+
+private:
+	AcceleratedScene acceleratedScene;
+};
+
+// Mesh loaded from an OBJ or PLY file, scaled and moved to stand on a floor
+//  in front of the default camera
+class MeshFileScene {
+public:
+	MeshFileScene(const std::string& path, ThreadPool& threadPool, const std::string& cachePath = {});
+	void update() {} // static
+
+	const AcceleratedScene& getScene() const { return acceleratedScene; }
+
+private:
+	AcceleratedScene acceleratedScene;
+};
+
+// The scene of MeshFileScene rendered out of core
+// The mesh is split into chunks that are written to the scene cache at cachePath, unless
+//  it is up to date, and paged in from there within residentBudget bytes.
+class OutOfCoreMeshScene {
+public:
+	OutOfCoreMeshScene(const std::string& path, ThreadPool& threadPool, const std::string& cachePath, size_t residentBudget);
+	void update() {} // static
+
+	const OutOfCoreScene& getScene() const { return *outOfCoreScene; }
+
+private:
+	std::unique_ptr<OutOfCoreScene> outOfCoreScene; // not movable
+};
+
+Mesh makeFloorMesh(float halfSize, float height);
+
+// .cpp
+namespace detail
+{
+	// Identifies what a procedural scene is built from, for its scene cache
+	// Bump the revision of a scene whenever its construction changes.
+	uint64_t getSceneSourceHash(const char* name, uint32_t revision, uint64_t count, uint64_t seed)
+	{
+		const uint64_t params[] = {revision, count, seed};
+		return hashBytes(params, sizeof(params), hashBytes(name, std::strlen(name)));
+	}
+
+	// Scales the longest side of a loaded mesh to 8 units and moves it onto the floor,
+	//  centered at the spheres of the example scene
+	void fitMeshFileToFloor(std::vector<vec3f>& vertices)
+	{
+		Aabb bounds;
+		for (const vec3f& v : vertices)
+			bounds = merge(bounds, v);
+		if (isEmpty(bounds))
+			return;
+
+		const vec3f extent = bounds.max - bounds.min;
+		const float scale = 8.f / std::max({extent.x, extent.y, extent.z, 1e-6f});
+		const vec3f center = getCenter(bounds);
+		const vec3f target = {0.f, -0.7f + 0.5f*scale*extent.y, -9.f};
+		for (vec3f& v : vertices)
+			v = (v - center)*scale + target;
+	}
+}
+
+ExampleScene::ExampleScene(bool withLights)
+{
+	MaterialTable materials;
+	const auto mirror = materials.add(makeConstantMaterial(Material{{0.8,0.8,0.8}, 0.8, 0}));
+	const auto striped = materials.add(makeStripedMaterial(Material{{0.0,0.2,0.2}, 0.8}, {1.0,0.2,0.2}, {0, 1, 0}, 3.14159f*20));
+	const auto red = materials.add(makeConstantMaterial(Material{{0.8,0.0,0.0}, 0.8, 0}));
+	const auto yellow = materials.add(makeConstantMaterial(Material{{0.8,0.8,0.0}, 0.8}));
+	const auto green = materials.add(makeConstantMaterial(Material{{0.0,0.8,0.0}, 0.8}));
+	const auto floor = materials.add(makeConstantMaterial(Material{{0.6f, 0.6f, 0.6f}, 0.8f}));
+
+	std::vector<Light> lights;
+	if (withLights)
+	{
+		lights.push_back(makePointLight({6, 5, -2}, {20, 18, 16}));
+		lights.push_back(makeAreaLight({-3, 8, -10}, {6, 0, 0}, {0, 0, 4}, {1.5, 1.5, 1.6})); // facing down
+	}
+
+	basicScene = BasicScene{{
+		Object{Sphere{-5, 2.0, -10, 2.5}, mirror},
+		Object{Sphere{5, 2.0, -10, 2.5}, striped},
+		Object{Sphere{0, 0.8, -7, 1.5}, red},
+		Object{Sphere{2, 0.5, -5, 0.8}, yellow},
+		Object{Sphere{-2, 0.5, -5, 0.8}, green},
+		Object{makeFloorMesh(16.f, -0.7f), floor}
+	}, std::move(materials), std::move(lights)};
+}
+
+void ExampleScene::update()
+{
+	basicScene.updateObjects([this](std::vector<Object>& objects) {
+		std::get<Sphere>(objects[0].shape).pos.y += cos(time)*0.2f;
+		std::get<Sphere>(objects[1].shape).pos.y += cos(time+4.8f)*0.1f;
+		std::get<Sphere>(objects[2].shape).pos.y += cos(time+4.8f)*0.1f;
+	});
+	time += 0.1f;
+}
+
+SphereFieldScene::SphereFieldScene(int sphereCount, unsigned seed, const std::string& cachePath)
+{
+	const uint64_t sourceHash = detail::getSceneSourceHash("spheres", 1, uint64_t(sphereCount), seed);
+	acceleratedScene = loadCachedScene(cachePath, sourceHash, [&] {
+		std::mt19937 rng{seed};
+		std::uniform_real_distribution<float> unit{0.f, 1.f};
+
+		MaterialTable materials;
+		std::vector<MaterialId> sphereMaterials;
+		for (int i = 0; i < 8; ++i)
+		{
+			const RgbColor color = {0.2f + 0.6f*unit(rng), 0.2f + 0.6f*unit(rng), 0.2f + 0.6f*unit(rng)};
+			sphereMaterials.push_back(materials.add(makeConstantMaterial(Material{color, 0.6f*unit(rng), 0.1f*unit(rng)})));
+		}
+		const auto floor = materials.add(makeConstantMaterial(Material{{0.6f, 0.6f, 0.6f}, 0.5f}));
+
+		// Spheres are spread over a square in front of the default camera, sized to keep a similar coverage at any count
+		std::vector<Object> objects;
+		objects.reserve(sphereCount + 1);
+		const float extent = 12.f;
+		const float radius = 2.f*extent / std::sqrt(float(std::max(sphereCount, 1))) * 0.35f;
+		for (int i = 0; i < sphereCount; ++i)
+		{
+			const vec3f pos = {
+				-extent + 2.f*extent*unit(rng),
+				-0.7f + radius + 3.f*unit(rng),
+				-2.f - 2.f*extent*unit(rng)
+			};
+			objects.push_back(Object{Sphere{pos, radius*(0.5f + unit(rng))}, sphereMaterials[i % sphereMaterials.size()]});
+		}
+		objects.push_back(Object{makeFloorMesh(32.f, -0.7f), floor});
+
+		return AcceleratedScene{std::move(objects), std::move(materials)};
+	});
+}
+
+TriangleSoupScene::TriangleSoupScene(int triangleCount, unsigned seed, const std::string& cachePath)
+{
+	const uint64_t sourceHash = detail::getSceneSourceHash("triangles", 1, uint64_t(triangleCount), seed);
+	acceleratedScene = loadCachedScene(cachePath, sourceHash, [&] {
+		std::mt19937 rng{seed};
+		std::uniform_real_distribution<float> unit{0.f, 1.f};
+
+		MaterialTable materials;
+		const auto soup = materials.add(makeConstantMaterial(Material{{0.8f, 0.5f, 0.2f}, 0.4f, 0.05f}));
+		const auto floor = materials.add(makeConstantMaterial(Material{{0.6f, 0.6f, 0.6f}, 0.5f}));
+
+		// Unshared vertices, triangle size shrinks with the count like the sphere field
+		std::vector<vec3f> vertices;
+		std::vector<uint32_t> indices;
+		vertices.reserve(3*triangleCount);
+		indices.reserve(3*triangleCount);
+		const float extent = 12.f;
+		const float size = 2.f*extent / std::sqrt(float(std::max(triangleCount, 1)));
+		for (int i = 0; i < triangleCount; ++i)
+		{
+			const vec3f center = {
+				-extent + 2.f*extent*unit(rng),
+				-0.7f + size + 3.f*unit(rng),
+				-2.f - 2.f*extent*unit(rng)
+			};
+			for (int v = 0; v < 3; ++v)
+			{
+				const vec3f offset = {2.f*unit(rng) - 1.f, 2.f*unit(rng) - 1.f, 2.f*unit(rng) - 1.f};
+				indices.push_back(uint32_t(vertices.size()));
+				vertices.push_back(center + size*offset);
+			}
+		}
+		return AcceleratedScene{{
+			Object{makeMesh(std::move(vertices), std::move(indices)), soup},
+			Object{makeFloorMesh(32.f, -0.7f), floor}
+		}, std::move(materials)};
+	});
+}
+
+MeshFileScene::MeshFileScene(const std::string& path, ThreadPool& threadPool, const std::string& cachePath)
+{
+	// The file's contents and the way the scene is built around it
+	const uint64_t sourceHash = cachePath.empty() ? 0 : detail::getSceneSourceHash("mesh file", 1, 0, hashFile(path));
+	acceleratedScene = loadCachedScene(cachePath, sourceHash, [&] {
+		MeshArrays arrays = readMeshFile(path, threadPool);
+		detail::fitMeshFileToFloor(arrays.vertices);
+
+		MaterialTable materials;
+		const auto model = materials.add(makeConstantMaterial(Material{{0.7f, 0.7f, 0.75f}, 0.3f, 0.05f}));
+		const auto floor = materials.add(makeConstantMaterial(Material{{0.6f, 0.6f, 0.6f}, 0.5f}));
+		return AcceleratedScene{{
+			Object{makeMesh(std::move(arrays.vertices), std::move(arrays.indices)), model},
+			Object{makeFloorMesh(32.f, -0.7f), floor}
+		}, std::move(materials)};
+	});
+}
+
+OutOfCoreMeshScene::OutOfCoreMeshScene(const std::string& path, ThreadPool& threadPool, const std::string& cachePath,
+	size_t residentBudget)
+{
+	const uint32_t chunkSize = 16384;
+	const uint64_t sourceHash = detail::getSceneSourceHash("chunked mesh file", 1, chunkSize, hashFile(path));
+	auto writeScene = [&] {
+		MeshArrays arrays = readMeshFile(path, threadPool);
+		detail::fitMeshFileToFloor(arrays.vertices);
+
+		MaterialTable materials;
+		const auto model = materials.add(makeConstantMaterial(Material{{0.7f, 0.7f, 0.75f}, 0.3f, 0.05f}));
+		const auto floor = materials.add(makeConstantMaterial(Material{{0.6f, 0.6f, 0.6f}, 0.5f}));
+		writeChunkedScene(cachePath, sourceHash, arrays, model, {Object{makeFloorMesh(32.f, -0.7f), floor}},
+			materials, {}, chunkSize);
+	};
+
+	const bool isCurrent = isSceneCacheCurrent(cachePath, sourceHash);
+	if (!isCurrent)
+		writeScene();
+	try
+	{
+		outOfCoreScene = std::make_unique<OutOfCoreScene>(cachePath, residentBudget);
+	}
+	catch (const SceneCacheException&)
+	{
+		// The header was intact, but the rest of the cache is damaged
+		if (!isCurrent)
+			throw;
+		writeScene();
+		outOfCoreScene = std::make_unique<OutOfCoreScene>(cachePath, residentBudget);
+	}
+}
+
+Mesh makeFloorMesh(float halfSize, float height)
+{
+	return makeMesh(
+		{
+			{-halfSize, height,  halfSize},
+			{ halfSize, height,  halfSize},
+			{-halfSize, height, -halfSize},
+			{ halfSize, height, -halfSize}
+		},
+		{0, 1, 2,  2, 1, 3}
+	);
+}
@@ -0,0 +1,177 @@
+#pragma once
+#include "Vec.h"
+#include "Color.h"
+#include "Geometry.h"
+#include "Material.h"
+#include "Sampler.h"
+#include "Light.h"
+#include "Stats.h"
+#include <vector>
+#include <optional>
+#include <limits>
+#include <cmath>
+
+// Shading model shared by the recursive and the wavefront renderers
+// A hit's color is its directly lit color plus the reflectivity-weighted average
+//  of branchFactor secondary rays, clamped to [0, 1].
+// Scenes with lights are lit by next event estimation: one shadow ray per light
+//  and hit. Scenes without lights use a headlight along the viewing direction.
+
+// Shape of the ray tree traced for each pixel sample
+struct PathSettings
+{
+	int maxDepth = 4;     // bounces after the primary ray
+	int branchFactor = 3; // secondary rays spawned at each hit
+
+	// Secondary rays whose throughput (the weight of their color in the pixel) falls below
+	//  this are traced only with probability throughput/minThroughput, and weighted up
+	//  by the inverse when they are, which keeps the expected color unchanged
+	// 0 traces every ray up to maxDepth.
+	float minThroughput = 0.f;
+};
+
+// Color of a hit without its secondary rays, lit by a headlight
+RgbColor getDirectColor(const Ray& ray, vec3f normal, const Material& material);
+
+// Light arriving at a hit from one light source, unless the ray towards the light is occluded
+struct ShadowRay
+{
+	Ray ray;
+	float tmax; // distance to the light
+	RgbColor contribution;
+};
+
+// Shadow ray towards the lightIndex-th light of the scene; nullopt if the light
+//  can't contribute (it lies behind the surface, or the hit lies behind an area light)
+std::optional<ShadowRay> getShadowRay(const Light& light, int lightIndex, const Ray& ray, vec3f hitpos, vec3f normal,
+	const Material& material, const Sampler& sampler);
+
+// Color of a hit without its secondary rays, lit by the scene's lights or the headlight
+template <typename SceneType>
+RgbColor getDirectLighting(const SceneType& scene, const Ray& ray, vec3f hitpos, vec3f normal,
+	const Material& material, const Sampler& sampler, int depth);
+
+// The branch-th of branchFactor secondary rays spawned at a hit
+Ray getSecondaryRay(const Ray& ray, vec3f hitpos, vec3f normal, const Material& material,
+	const Sampler& sampler, int branch, int branchFactor);
+
+// Throughput of the secondary rays spawned at a hit of a ray with the given throughput
+float getSecondaryThroughput(float throughput, const Material& material, int branchFactor);
+
+// Russian roulette for a secondary ray, decided by the ray's own sampler
+// Returns the weight of the ray's color: 0 if it isn't traced, 1/(survival probability) otherwise.
+float getContinuationWeight(const PathSettings& path, float secondaryThroughput, const Sampler& secondarySampler);
+
+// Adds the color returned by one secondary ray, scaled by its continuation weight, to the color of its hit
+RgbColor addSecondaryColor(RgbColor color, const Material& material, RgbColor secondaryColor, float weight, int branchFactor);
+
+// .cpp
+RgbColor getDirectColor(const Ray& ray, vec3f normal, const Material& material)
+{
+	const float intensity = -(ray.dir * normal);
+	return intensity*material.color*0.8f;
+}
+
+std::optional<ShadowRay> getShadowRay(const Light& light, int lightIndex, const Ray& ray, vec3f hitpos, vec3f normal,
+	const Material& material, const Sampler& sampler)
+{
+	// Light the side facing the viewer
+	const vec3f n = ray.dir * normal < 0.f ? normal : -normal;
+
+	vec3f toLight;
+	float distance;
+	RgbColor irradiance;
+	switch (light.kind)
+	{
+	case LightKind::Point:
+	{
+		const vec3f d = light.pos - hitpos;
+		const float distanceSqr = lengthSqr(d);
+		distance = std::sqrt(distanceSqr);
+		toLight = d / distance;
+		irradiance = light.color / distanceSqr;
+		break;
+	}
+	case LightKind::Directional:
+		toLight = -light.dir;
+		distance = std::numeric_limits<float>::infinity();
+		irradiance = light.color;
+		break;
+	case LightKind::Area:
+	{
+		// Uniformly sampled point on the light, weighted by the inverse of its pdf (the area)
+		const vec2f uv = sampler.getLight2D(lightIndex);
+		const vec3f d = light.pos + uv.x*light.edge1 + uv.y*light.edge2 - hitpos;
+		const float distanceSqr = lengthSqr(d);
+		distance = std::sqrt(distanceSqr);
+		toLight = d / distance;
+
+		const vec3f cross = light.edge1 ^ light.edge2;
+		const float area = length(cross);
+		const float cosLight = -(cross * toLight) / area;
+		if (cosLight <= 0.f)
+			return std::nullopt;
+		irradiance = light.color * (cosLight * area / distanceSqr);
+		break;
+	}
+	default:
+		return std::nullopt;
+	}
+
+	const float cosSurface = n * toLight;
+	if (cosSurface <= 0.f)
+		return std::nullopt;
+
+	const float offset = 0.01f; // like secondary rays, keeps the ray from hitting its own surface
+	return ShadowRay{{hitpos + toLight*offset, toLight}, distance - 2*offset, mul(material.color, irradiance) * cosSurface};
+}
+
+template <typename SceneType>
+RgbColor getDirectLighting(const SceneType& scene, const Ray& ray, vec3f hitpos, vec3f normal,
+	const Material& material, const Sampler& sampler, int depth)
+{
+	const std::vector<Light>& lights = scene.getLights();
+	if (lights.empty())
+		return getDirectColor(ray, normal, material);
+
+	RgbColor color = {0, 0, 0};
+	for (int i = 0; i < int(lights.size()); ++i)
+	{
+		const auto shadowRay = getShadowRay(lights[i], i, ray, hitpos, normal, material, sampler);
+		if (!shadowRay)
+			continue;
+
+		stats::countRay(stats::RayType::Shadow, depth);
+		if (!scene.isOccluded(shadowRay->ray, shadowRay->tmax))
+			color = color + shadowRay->contribution;
+	}
+	return color;
+}
+
+Ray getSecondaryRay(const Ray& ray, vec3f hitpos, vec3f normal, const Material& material,
+	const Sampler& sampler, int branch, int branchFactor)
+{
+	const vec3f jitterDir = 2.f*sampler.get3D(branch, branchFactor) - vec3f{1, 1, 1};
+	const vec3f reflectedDir = ray.dir - (ray.dir * normal)*2*normal;
+	const vec3f newDir = normalized(material.roughness*jitterDir + reflectedDir);
+	return {hitpos + newDir*0.01, newDir};
+}
+
+float getSecondaryThroughput(float throughput, const Material& material, int branchFactor)
+{
+	return throughput * material.reflectivity / float(branchFactor);
+}
+
+float getContinuationWeight(const PathSettings& path, float secondaryThroughput, const Sampler& secondarySampler)
+{
+	if (secondaryThroughput >= path.minThroughput)
+		return 1.f;
+
+	const float survivalProbability = secondaryThroughput / path.minThroughput;
+	return secondarySampler.getRoulette1D() < survivalProbability ? 1.f / survivalProbability : 0.f;
+}
+
+RgbColor addSecondaryColor(RgbColor color, const Material& material, RgbColor secondaryColor, float weight, int branchFactor)
+{
+	return color + material.reflectivity * (weight * secondaryColor) / branchFactor;
+}
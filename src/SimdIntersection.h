@@ -0,0 +1,303 @@
+#pragma once
+#include "Geometry.h"
+#include "SimdIsa.h"
+#include <vector>
+#include <limits>
+#include <cstdint>
+#include <cmath>
+#include <cstring>
+#if defined(RAYTRACER_SIMD_X86)
+#include <immintrin.h>
+#endif
+
+// Spheres stored as structure of arrays, padded to a multiple of the widest SIMD width
+struct SphereBuffer
+{
+	std::vector<float> x, y, z, radius;
+	// Pushed before pad(); kernels read up to the next multiple of their own width
+	uint32_t shapeCount = 0;
+
+	void push(const Sphere& sphere);
+	void clear();
+	void pad(); // called once after the last push
+	auto size() const { return uint32_t(x.size()); }
+};
+
+// Precomputed triangles (first vertex and the edges leaving it) stored as
+//  structure of arrays, padded like SphereBuffer
+struct TriangleBuffer
+{
+	std::vector<float> v0x, v0y, v0z, e1x, e1y, e1z, e2x, e2y, e2z;
+	uint32_t shapeCount = 0;
+
+	void push(const Triangle& tri);
+	void clear();
+	void pad();
+	auto size() const { return uint32_t(v0x.size()); }
+};
+
+// Nearest hit found by a brute-force kernel
+struct BufferHit
+{
+	float t = std::numeric_limits<float>::infinity();
+	uint32_t index = UINT32_MAX; // position in the buffer, UINT32_MAX if nothing was hit
+};
+
+// Test the ray against all shapes of the buffer, several at a time
+// Only hits closer than tmax are reported; ties are resolved by the lower index.
+// The arithmetic mirrors the single-ray findIntersection() tests, so that the kernels
+//  of all instruction sets (see SimdIsa.h) give the same results.
+BufferHit findNearestHit(const Ray& ray, const SphereBuffer& spheres, float tmax);
+BufferHit findNearestHit(const Ray& ray, const TriangleBuffer& triangles, float tmax);
+
+// Whether the ray hits any shape of the buffer closer than tmax; stops at the first hit found
+bool hasHit(const Ray& ray, const SphereBuffer& spheres, float tmax);
+bool hasHit(const Ray& ray, const TriangleBuffer& triangles, float tmax);
+
+// .cpp
+void SphereBuffer::push(const Sphere& sphere)
+{
+	x.push_back(sphere.pos.x);
+	y.push_back(sphere.pos.y);
+	z.push_back(sphere.pos.z);
+	radius.push_back(sphere.radius);
+}
+
+void SphereBuffer::clear()
+{
+	for (auto* v : {&x, &y, &z, &radius})
+		v->clear();
+	shapeCount = 0;
+}
+
+void SphereBuffer::pad()
+{
+	// NaN padding never produces a hit
+	shapeCount = size();
+	while (x.size() % simd::maxWidth != 0)
+		push(Sphere{{NAN, NAN, NAN}, NAN});
+}
+
+void TriangleBuffer::push(const Triangle& tri)
+{
+	const vec3f e1 = tri.verts[1] - tri.verts[0];
+	const vec3f e2 = tri.verts[2] - tri.verts[0];
+	v0x.push_back(tri.verts[0].x); v0y.push_back(tri.verts[0].y); v0z.push_back(tri.verts[0].z);
+	e1x.push_back(e1.x); e1y.push_back(e1.y); e1z.push_back(e1.z);
+	e2x.push_back(e2.x); e2y.push_back(e2.y); e2z.push_back(e2.z);
+}
+
+void TriangleBuffer::clear()
+{
+	for (auto* v : {&v0x, &v0y, &v0z, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z})
+		v->clear();
+	shapeCount = 0;
+}
+
+void TriangleBuffer::pad()
+{
+	shapeCount = size();
+	while (v0x.size() % simd::maxWidth != 0)
+		push(Triangle{{{NAN, NAN, NAN}, {NAN, NAN, NAN}, {NAN, NAN, NAN}}});
+}
+
+// Lane types of each instruction set, each followed by the kernels compiled for it
+// Masks are Floats with all bits set in the selected lanes, except with AVX-512,
+//  whose comparisons produce mask registers.
+namespace simd::scalar
+{
+	struct Floats
+	{
+		static constexpr int width = 1;
+		float v;
+
+		static Floats load(const float* p) { return {*p}; }
+		static Floats broadcast(float x) { return {x}; }
+		static Floats bits(uint32_t x) { Floats f; std::memcpy(&f.v, &x, sizeof(float)); return f; }
+		static Floats indices(uint32_t first) { return bits(first); }
+		void store(float* p) const { *p = v; }
+	};
+	using Mask = Floats;
+	bool any(Mask mask) { uint32_t bits; std::memcpy(&bits, &mask.v, sizeof(float)); return bits != 0; }
+	Mask maskOf(bool b) { return Floats::bits(b ? ~0u : 0u); }
+	Floats operator-(Floats a) { return {-a.v}; }
+	Floats operator+(Floats a, Floats b) { return {a.v + b.v}; }
+	Floats operator-(Floats a, Floats b) { return {a.v - b.v}; }
+	Floats operator*(Floats a, Floats b) { return {a.v * b.v}; }
+	Floats operator/(Floats a, Floats b) { return {a.v / b.v}; }
+	Mask operator&(Mask a, Mask b) { return maskOf(any(a) && any(b)); }
+	Mask operator<(Floats a, Floats b) { return maskOf(a.v < b.v); }
+	Mask operator<=(Floats a, Floats b) { return maskOf(a.v <= b.v); }
+	Mask operator>=(Floats a, Floats b) { return maskOf(a.v >= b.v); }
+	Floats sqrt(Floats a) { return {std::sqrt(a.v)}; }
+	Floats min(Floats a, Floats b) { return {a.v < b.v ? a.v : b.v}; }
+	Floats select(Mask mask, Floats a, Floats b) { return any(mask) ? a : b; }
+
+#include "SimdKernels.h"
+}
+
+#if defined(RAYTRACER_SIMD_X86)
+// No contraction into FMA (implied by AVX-512), which would round differently than the single-ray tests
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+#pragma GCC optimize("fp-contract=off")
+namespace simd::sse42
+{
+	struct Floats
+	{
+		static constexpr int width = 4;
+		__m128 v;
+
+		static Floats load(const float* p) { return {_mm_loadu_ps(p)}; }
+		static Floats broadcast(float x) { return {_mm_set1_ps(x)}; }
+		static Floats bits(uint32_t x) { return {_mm_castsi128_ps(_mm_set1_epi32(int(x)))}; }
+		static Floats indices(uint32_t first) { return {_mm_castsi128_ps(_mm_add_epi32(_mm_set1_epi32(int(first)), _mm_setr_epi32(0, 1, 2, 3)))}; }
+		void store(float* p) const { _mm_storeu_ps(p, v); }
+	};
+	using Mask = Floats;
+	Floats operator-(Floats a) { return {_mm_xor_ps(a.v, _mm_set1_ps(-0.f))}; }
+	Floats operator+(Floats a, Floats b) { return {_mm_add_ps(a.v, b.v)}; }
+	Floats operator-(Floats a, Floats b) { return {_mm_sub_ps(a.v, b.v)}; }
+	Floats operator*(Floats a, Floats b) { return {_mm_mul_ps(a.v, b.v)}; }
+	Floats operator/(Floats a, Floats b) { return {_mm_div_ps(a.v, b.v)}; }
+	Mask operator&(Mask a, Mask b) { return {_mm_and_ps(a.v, b.v)}; }
+	Mask operator<(Floats a, Floats b) { return {_mm_cmplt_ps(a.v, b.v)}; }
+	Mask operator<=(Floats a, Floats b) { return {_mm_cmple_ps(a.v, b.v)}; }
+	Mask operator>=(Floats a, Floats b) { return {_mm_cmpge_ps(a.v, b.v)}; }
+	Floats sqrt(Floats a) { return {_mm_sqrt_ps(a.v)}; }
+	Floats min(Floats a, Floats b) { return {_mm_min_ps(a.v, b.v)}; }
+	Floats select(Mask mask, Floats a, Floats b) { return {_mm_blendv_ps(b.v, a.v, mask.v)}; }
+	bool any(Mask mask) { return _mm_movemask_ps(mask.v) != 0; }
+
+#include "SimdKernels.h"
+}
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#pragma GCC optimize("fp-contract=off")
+namespace simd::avx2
+{
+	struct Floats
+	{
+		static constexpr int width = 8;
+		__m256 v;
+
+		static Floats load(const float* p) { return {_mm256_loadu_ps(p)}; }
+		static Floats broadcast(float x) { return {_mm256_set1_ps(x)}; }
+		static Floats bits(uint32_t x) { return {_mm256_castsi256_ps(_mm256_set1_epi32(int(x)))}; }
+		static Floats indices(uint32_t first) { return {_mm256_castsi256_ps(_mm256_add_epi32(_mm256_set1_epi32(int(first)), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)))}; }
+		void store(float* p) const { _mm256_storeu_ps(p, v); }
+	};
+	using Mask = Floats;
+	Floats operator-(Floats a) { return {_mm256_xor_ps(a.v, _mm256_set1_ps(-0.f))}; }
+	Floats operator+(Floats a, Floats b) { return {_mm256_add_ps(a.v, b.v)}; }
+	Floats operator-(Floats a, Floats b) { return {_mm256_sub_ps(a.v, b.v)}; }
+	Floats operator*(Floats a, Floats b) { return {_mm256_mul_ps(a.v, b.v)}; }
+	Floats operator/(Floats a, Floats b) { return {_mm256_div_ps(a.v, b.v)}; }
+	Mask operator&(Mask a, Mask b) { return {_mm256_and_ps(a.v, b.v)}; }
+	Mask operator<(Floats a, Floats b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)}; }
+	Mask operator<=(Floats a, Floats b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)}; }
+	Mask operator>=(Floats a, Floats b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ)}; }
+	Floats sqrt(Floats a) { return {_mm256_sqrt_ps(a.v)}; }
+	Floats min(Floats a, Floats b) { return {_mm256_min_ps(a.v, b.v)}; }
+	Floats select(Mask mask, Floats a, Floats b) { return {_mm256_blendv_ps(b.v, a.v, mask.v)}; }
+	bool any(Mask mask) { return _mm256_movemask_ps(mask.v) != 0; }
+
+#include "SimdKernels.h"
+}
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#pragma GCC optimize("fp-contract=off")
+namespace simd::avx512
+{
+	struct Floats
+	{
+		static constexpr int width = 16;
+		__m512 v;
+
+		static Floats load(const float* p) { return {_mm512_loadu_ps(p)}; }
+		static Floats broadcast(float x) { return {_mm512_set1_ps(x)}; }
+		static Floats bits(uint32_t x) { return {_mm512_castsi512_ps(_mm512_set1_epi32(int(x)))}; }
+		static Floats indices(uint32_t first) {
+			const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+			return {_mm512_castsi512_ps(_mm512_add_epi32(_mm512_set1_epi32(int(first)), lanes))};
+		}
+		void store(float* p) const { _mm512_storeu_ps(p, v); }
+	};
+	struct Mask
+	{
+		__mmask16 bits;
+	};
+	// Float xor is AVX-512DQ, the sign is flipped as an integer
+	Floats operator-(Floats a) { return {_mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a.v), _mm512_set1_epi32(INT32_MIN)))}; }
+	Floats operator+(Floats a, Floats b) { return {_mm512_add_ps(a.v, b.v)}; }
+	Floats operator-(Floats a, Floats b) { return {_mm512_sub_ps(a.v, b.v)}; }
+	Floats operator*(Floats a, Floats b) { return {_mm512_mul_ps(a.v, b.v)}; }
+	Floats operator/(Floats a, Floats b) { return {_mm512_div_ps(a.v, b.v)}; }
+	Mask operator&(Mask a, Mask b) { return {__mmask16(a.bits & b.bits)}; }
+	Mask operator<(Floats a, Floats b) { return {_mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ)}; }
+	Mask operator<=(Floats a, Floats b) { return {_mm512_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ)}; }
+	Mask operator>=(Floats a, Floats b) { return {_mm512_cmp_ps_mask(a.v, b.v, _CMP_GE_OQ)}; }
+	// Masked forms, as GCC 12 warns about the undefined pass-through of the plain ones
+	Floats sqrt(Floats a) { return {_mm512_mask_sqrt_ps(a.v, __mmask16(0xffff), a.v)}; }
+	Floats min(Floats a, Floats b) { return {_mm512_mask_min_ps(a.v, __mmask16(0xffff), a.v, b.v)}; }
+	Floats select(Mask mask, Floats a, Floats b) { return {_mm512_mask_blend_ps(mask.bits, b.v, a.v)}; }
+	bool any(Mask mask) { return mask.bits != 0; }
+
+#include "SimdKernels.h"
+}
+#pragma GCC pop_options
+#endif
+
+namespace detail
+{
+	// Kernels of one instruction set
+	struct BufferKernels
+	{
+		BufferHit (*findNearestSphere)(const Ray& ray, const SphereBuffer& spheres, float tmax);
+		BufferHit (*findNearestTriangle)(const Ray& ray, const TriangleBuffer& triangles, float tmax);
+		BufferHit (*findAnySphere)(const Ray& ray, const SphereBuffer& spheres, float tmax);
+		BufferHit (*findAnyTriangle)(const Ray& ray, const TriangleBuffer& triangles, float tmax);
+	};
+
+	// Those of the instruction set in use, for a buffer of shapeCount shapes
+	// The lanes of AVX-512 only pay off for buffers that fill them: smaller ones take AVX2.
+	const BufferKernels& getBufferKernels(uint32_t shapeCount)
+	{
+		static const BufferKernels kernels[] = { // indexed by simd::Isa
+			{simd::scalar::intersectBuffer<false>, simd::scalar::intersectBuffer<false>, simd::scalar::intersectBuffer<true>, simd::scalar::intersectBuffer<true>},
+#if defined(RAYTRACER_SIMD_X86)
+			{simd::sse42::intersectBuffer<false>, simd::sse42::intersectBuffer<false>, simd::sse42::intersectBuffer<true>, simd::sse42::intersectBuffer<true>},
+			{simd::avx2::intersectBuffer<false>, simd::avx2::intersectBuffer<false>, simd::avx2::intersectBuffer<true>, simd::avx2::intersectBuffer<true>},
+			{simd::avx512::intersectBuffer<false>, simd::avx512::intersectBuffer<false>, simd::avx512::intersectBuffer<true>, simd::avx512::intersectBuffer<true>},
+#endif
+		};
+		simd::Isa isa = simd::getIsa();
+		if (isa == simd::Isa::Avx512 && shapeCount <= 8)
+			isa = simd::Isa::Avx2;
+		return kernels[int(isa)];
+	}
+}
+
+BufferHit findNearestHit(const Ray& ray, const SphereBuffer& spheres, float tmax)
+{
+	return detail::getBufferKernels(spheres.shapeCount).findNearestSphere(ray, spheres, tmax);
+}
+
+BufferHit findNearestHit(const Ray& ray, const TriangleBuffer& triangles, float tmax)
+{
+	return detail::getBufferKernels(triangles.shapeCount).findNearestTriangle(ray, triangles, tmax);
+}
+
+bool hasHit(const Ray& ray, const SphereBuffer& spheres, float tmax)
+{
+	return detail::getBufferKernels(spheres.shapeCount).findAnySphere(ray, spheres, tmax).index != UINT32_MAX;
+}
+
+bool hasHit(const Ray& ray, const TriangleBuffer& triangles, float tmax)
+{
+	return detail::getBufferKernels(triangles.shapeCount).findAnyTriangle(ray, triangles, tmax).index != UINT32_MAX;
+}
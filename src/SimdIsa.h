@@ -0,0 +1,96 @@
+#pragma once
+#include <atomic>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <stdexcept>
+
+// The kernels of the wider instruction sets rely on GCC's target pragmas
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(__clang__)
+#define RAYTRACER_SIMD_X86 1
+#endif
+
+// Instruction sets the SIMD kernels are compiled for, picked when the program runs
+// The kernels of each instruction set are built into every binary (see SimdIntersection.h),
+//  so that one build runs on any x86 CPU with the widest kernels it supports.
+namespace simd
+{
+	// From the least to the most capable
+	enum class Isa
+	{
+		Scalar, // one lane, compiled for the baseline; the only one elsewhere
+		Sse42,  // 4 lanes
+		Avx2,   // 8 lanes
+		Avx512  // 16 lanes, AVX-512F
+	};
+
+	constexpr int maxWidth = 16; // lanes of the widest instruction set, which buffers are padded to
+
+	const char* getIsaName(Isa isa);
+	std::optional<Isa> parseIsa(std::string_view name);
+
+	// Most capable instruction set the CPU and OS support, detected once
+	Isa getSupportedIsa();
+
+	// Instruction set the kernels run with: the supported one, unless lowered by setIsa()
+	Isa getIsa();
+	// Throws std::invalid_argument if the CPU doesn't support it
+	void setIsa(Isa isa);
+}
+
+// .cpp
+namespace detail
+{
+	// Read for every kernel call, so not behind a function-local static's guard
+	std::atomic<simd::Isa> activeIsa{simd::getSupportedIsa()};
+}
+
+namespace simd
+{
+	const char* getIsaName(Isa isa)
+	{
+		switch (isa)
+		{
+		case Isa::Scalar: return "scalar";
+		case Isa::Sse42: return "sse4.2";
+		case Isa::Avx2: return "avx2";
+		case Isa::Avx512: return "avx512";
+		}
+		return "unknown";
+	}
+
+	std::optional<Isa> parseIsa(std::string_view name)
+	{
+		for (const Isa isa : {Isa::Scalar, Isa::Sse42, Isa::Avx2, Isa::Avx512})
+			if (name == getIsaName(isa))
+				return isa;
+		return std::nullopt;
+	}
+
+	Isa getSupportedIsa()
+	{
+#if defined(RAYTRACER_SIMD_X86)
+		// Also checks that the OS saves the wider registers
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f"))
+			return Isa::Avx512;
+		if (__builtin_cpu_supports("avx2"))
+			return Isa::Avx2;
+		if (__builtin_cpu_supports("sse4.2"))
+			return Isa::Sse42;
+#endif
+		return Isa::Scalar;
+	}
+
+	Isa getIsa()
+	{
+		return ::detail::activeIsa.load(std::memory_order_relaxed);
+	}
+
+	void setIsa(Isa isa)
+	{
+		if (isa > getSupportedIsa())
+			throw std::invalid_argument(std::string{"The CPU doesn't support "} + getIsaName(isa));
+		::detail::activeIsa.store(isa, std::memory_order_relaxed);
+	}
+}
@@ -0,0 +1,114 @@
+// Brute-force kernels of SimdIntersection.h, written once against Floats and Mask
+// Not a standalone header: SimdIntersection.h includes it into the namespace of each
+//  instruction set, after the lane types, with the matching target in effect.
+
+// A vec3 per lane, for the vector math of the kernels
+// The Vec.h templates are compiled for the baseline instruction set, so the operators
+//  the kernels use are overloaded here, within the target.
+using Vec3s = Vec3<Floats>;
+
+Vec3s broadcast(vec3f v) { return {Floats::broadcast(v.x), Floats::broadcast(v.y), Floats::broadcast(v.z)}; }
+Vec3s loadVec3s(const std::vector<float>& x, const std::vector<float>& y, const std::vector<float>& z, uint32_t i) {
+	return {Floats::load(&x[i]), Floats::load(&y[i]), Floats::load(&z[i])};
+}
+Vec3s operator-(const Vec3s& a, const Vec3s& b) { return {a.x - b.x, a.y - b.y, a.z - b.z}; }
+Floats operator*(const Vec3s& a, const Vec3s& b) { return a.x*b.x + a.y*b.y + a.z*b.z; }
+Vec3s operator^(const Vec3s& a, const Vec3s& b) { return {a.y*b.z - a.z*b.y, a.z*b.x - a.x*b.z, a.x*b.y - a.y*b.x}; }
+
+// Horizontal min-t reduction of the per-lane results
+BufferHit reduce(Floats bestT, Floats bestIndex)
+{
+	float ts[Floats::width];
+	float indexBits[Floats::width];
+	uint32_t indices[Floats::width];
+	bestT.store(ts);
+	bestIndex.store(indexBits);
+	std::memcpy(indices, indexBits, sizeof(indices));
+
+	BufferHit hit;
+	for (int lane = 0; lane < Floats::width; ++lane)
+	{
+		if (ts[lane] < hit.t || (ts[lane] == hit.t && indices[lane] < hit.index)) {
+			hit.t = ts[lane];
+			hit.index = indices[lane];
+		}
+	}
+	return hit.index == UINT32_MAX ? BufferHit{} : hit;
+}
+
+// Shared by the nearest-hit and any-hit queries; the latter return the first chunk with a hit
+template <bool anyHit>
+BufferHit intersectBuffer(const Ray& ray, const SphereBuffer& spheres, float tmax)
+{
+	const Vec3s origin = broadcast(ray.origin);
+	const Vec3s dir = broadcast(ray.dir);
+	const float dd = ray.dir * ray.dir;
+	const Floats twoDd = Floats::broadcast(2.f*dd);
+	const Floats fourDd = Floats::broadcast(4.f*dd);
+	const Floats zero = Floats::broadcast(0.f), two = Floats::broadcast(2.f), four = Floats::broadcast(4.f);
+
+	Floats bestT = Floats::broadcast(tmax);
+	Floats bestIndex = Floats::bits(UINT32_MAX);
+	for (uint32_t i = 0; i < spheres.shapeCount; i += Floats::width)
+	{
+		stats::countTests(stats::TestType::Sphere, Floats::width);
+		const Vec3s oms = origin - loadVec3s(spheres.x, spheres.y, spheres.z, i);
+		const Floats r = Floats::load(&spheres.radius[i]);
+		const Floats omsSqr = oms*oms;
+		const Floats doms = dir*oms;
+
+		const Floats D = four*doms*doms - fourDd*(omsSqr - r*r);
+		const Floats sqrtD = sqrt(D);
+		const Floats minusTwoDoms = -(two*doms);
+		const Floats t1 = (minusTwoDoms + sqrtD) / twoDd;
+		const Floats t2 = (minusTwoDoms - sqrtD) / twoDd;
+		const Floats t = min(t2, t1);
+
+		const Mask hit = (D >= zero) & (t >= zero) & (t < bestT);
+		if (any(hit)) {
+			bestT = select(hit, t, bestT);
+			bestIndex = select(hit, Floats::indices(i), bestIndex);
+			if constexpr (anyHit)
+				break;
+		}
+	}
+
+	return reduce(bestT, bestIndex);
+}
+
+template <bool anyHit>
+BufferHit intersectBuffer(const Ray& ray, const TriangleBuffer& triangles, float tmax)
+{
+	const Vec3s origin = broadcast(ray.origin);
+	const Vec3s dir = broadcast(ray.dir);
+	const Floats zero = Floats::broadcast(0.f), one = Floats::broadcast(1.f);
+
+	Floats bestT = Floats::broadcast(tmax);
+	Floats bestIndex = Floats::bits(UINT32_MAX);
+	for (uint32_t i = 0; i < triangles.shapeCount; i += Floats::width)
+	{
+		stats::countTests(stats::TestType::Triangle, Floats::width);
+		const Vec3s e1 = loadVec3s(triangles.e1x, triangles.e1y, triangles.e1z, i);
+		const Vec3s e2 = loadVec3s(triangles.e2x, triangles.e2y, triangles.e2z, i);
+
+		// Moller-Trumbore: p = dir ^ edge2, s = origin - v0, q = s ^ edge1
+		const Vec3s p = dir ^ e2;
+		const Floats invDet = one / (e1*p);
+		const Vec3s s = origin - loadVec3s(triangles.v0x, triangles.v0y, triangles.v0z, i);
+		const Vec3s q = s ^ e1;
+
+		const Floats u = (s*p) * invDet;
+		const Floats v = (dir*q) * invDet;
+		const Floats t = (e2*q) * invDet;
+
+		const Mask hit = (u >= zero) & (v >= zero) & (u + v <= one) & (t >= zero) & (t < bestT);
+		if (any(hit)) {
+			bestT = select(hit, t, bestT);
+			bestIndex = select(hit, Floats::indices(i), bestIndex);
+			if constexpr (anyHit)
+				break;
+		}
+	}
+
+	return reduce(bestT, bestIndex);
+}
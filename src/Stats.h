@@ -0,0 +1,169 @@
+#pragma once
+#include <cstdint>
+#include <ostream>
+#include <iomanip>
+
+// Render statistics
+// Every thread counts into its own counters, which the renderer merges at the end
+//  of a frame (see FrameStats in ParallelRendering.h).
+// Counting is compiled in only with RAYTRACER_STATS defined to 1 (CMake option
+//  ENABLE_STATS); otherwise the count functions are empty and the counters stay zero.
+
+#ifndef RAYTRACER_STATS
+#define RAYTRACER_STATS 0
+#endif
+
+namespace stats
+{
+	constexpr bool enabled = RAYTRACER_STATS;
+
+	enum class RayType : uint8_t
+	{
+		Primary,
+		Secondary,
+		Shadow, // any-hit queries towards lights
+		Count
+	};
+
+	enum class TestType : uint8_t
+	{
+		Sphere,
+		Triangle,
+		Box, // bounding volume of a BVH node
+		Count
+	};
+
+	struct Counters
+	{
+		static constexpr int maxTrackedDepth = 8; // deeper rays are counted at the last depth
+
+		uint64_t rays[int(RayType::Count)][maxTrackedDepth] = {};
+		uint64_t tests[int(TestType::Count)] = {};
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+		uint64_t depthLimitReached = 0; // hits whose secondary rays were cut off by the maximal depth
+
+		uint64_t getRayCount() const;
+		uint64_t getRayCount(RayType type) const;
+		void merge(const Counters& other);
+	};
+
+	// Counters of the calling thread
+	Counters& getThreadCounters();
+
+	// Returns the counters of the calling thread and resets them
+	Counters takeThreadCounters();
+
+	void countRay(RayType type, int depth);
+	void countTests(TestType type, uint32_t count = 1);
+	void countHit(bool isHit);
+	void countDepthLimit(uint64_t count = 1);
+
+	void print(std::ostream& out, const Counters& counters);
+}
+
+// .cpp
+namespace stats
+{
+	uint64_t Counters::getRayCount(RayType type) const
+	{
+		uint64_t count = 0;
+		for (int depth = 0; depth < maxTrackedDepth; ++depth)
+			count += rays[int(type)][depth];
+		return count;
+	}
+
+	uint64_t Counters::getRayCount() const
+	{
+		return getRayCount(RayType::Primary) + getRayCount(RayType::Secondary) + getRayCount(RayType::Shadow);
+	}
+
+	void Counters::merge(const Counters& other)
+	{
+		for (int type = 0; type < int(RayType::Count); ++type)
+			for (int depth = 0; depth < maxTrackedDepth; ++depth)
+				rays[type][depth] += other.rays[type][depth];
+		for (int type = 0; type < int(TestType::Count); ++type)
+			tests[type] += other.tests[type];
+		hits += other.hits;
+		misses += other.misses;
+		depthLimitReached += other.depthLimitReached;
+	}
+
+	Counters& getThreadCounters()
+	{
+		thread_local Counters counters;
+		return counters;
+	}
+
+	Counters takeThreadCounters()
+	{
+		Counters& counters = getThreadCounters();
+		const Counters taken = counters;
+		counters = {};
+		return taken;
+	}
+
+	void countRay([[maybe_unused]] RayType type, [[maybe_unused]] int depth)
+	{
+#if RAYTRACER_STATS
+		const int bucket = depth < Counters::maxTrackedDepth ? depth : Counters::maxTrackedDepth - 1;
+		++getThreadCounters().rays[int(type)][bucket];
+#endif
+	}
+
+	void countTests([[maybe_unused]] TestType type, [[maybe_unused]] uint32_t count)
+	{
+#if RAYTRACER_STATS
+		getThreadCounters().tests[int(type)] += count;
+#endif
+	}
+
+	void countHit([[maybe_unused]] bool isHit)
+	{
+#if RAYTRACER_STATS
+		auto& counters = getThreadCounters();
+		++(isHit ? counters.hits : counters.misses);
+#endif
+	}
+
+	void countDepthLimit([[maybe_unused]] uint64_t count)
+	{
+#if RAYTRACER_STATS
+		getThreadCounters().depthLimitReached += count;
+#endif
+	}
+
+	void print(std::ostream& out, const Counters& counters)
+	{
+		if (!enabled)
+		{
+			out << "statistics are disabled (build with ENABLE_STATS)\n";
+			return;
+		}
+
+		const uint64_t rayCount = counters.getRayCount();
+		const double perRay = rayCount > 0 ? 1.0 / double(rayCount) : 0.0;
+		const char* testNames[] = {"sphere", "triangle", "box"};
+
+		out << "rays: " << rayCount << " (" << counters.getRayCount(RayType::Primary) << " primary, "
+			<< counters.getRayCount(RayType::Secondary) << " secondary, "
+			<< counters.getRayCount(RayType::Shadow) << " shadow)\n";
+		out << "rays per depth:";
+		for (int depth = 0; depth < Counters::maxTrackedDepth; ++depth)
+		{
+			uint64_t count = 0;
+			for (int type = 0; type < int(RayType::Count); ++type)
+				count += counters.rays[type][depth];
+			out << " " << count;
+		}
+		out << "\n";
+		out << "hits: " << counters.hits << ", misses: " << counters.misses
+			<< ", depth limit reached: " << counters.depthLimitReached << "\n";
+		out << "tests:";
+		for (int type = 0; type < int(TestType::Count); ++type)
+			out << " " << testNames[type] << " " << counters.tests[type]
+				<< " (" << std::setprecision(3) << double(counters.tests[type]) * perRay << "/ray)";
+		out << "\n";
+	}
+}
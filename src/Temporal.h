@@ -0,0 +1,331 @@
+#pragma once
+#include "Rendering.h"
+#include "ThreadPool.h"
+#include "Color.h"
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <optional>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <cassert>
+
+// When a sample of the previous frame may be reused
+struct TemporalSettings
+{
+	// A reprojected sample is taken to be hidden when the samples reprojected next to it
+	//  on opposite sides both lie closer by more than this, relative to its depth
+	float depthTolerance = 0.05f;
+	// Surfaces seen at a grazing angle are retraced: cosine between normal and view direction
+	float minFacing = 0.1f;
+	// Shading is view dependent: cosine of the largest change in the direction a point is seen from
+	float minViewCosine = 0.999f;
+	// Of the (up to four) samples reprojected next to a sample, how many must have hit the same
+	//  triangle (or missed as well) for it to be reused; the one a hole was filled from doesn't count
+	int minSameNeighbours = 2;
+	// Samples are retraced after this many frames at the latest; each frame retraces a
+	//  rotating 1/refreshPeriod of the pixels anyway
+	int refreshPeriod = 16;
+};
+
+// Renders successive frames of a moving camera, reusing the previous frame
+// The primary hits of the previous frame are reprojected into the new camera. Pixels
+//  left without a sample take the nearest sample of their neighbours if those are mostly
+//  covered, as reprojected samples drift off the pixel grid. Pixels still without a
+//  sample, with a sample failing the depth, neighbour or view checks, or due for a
+//  refresh are traced anew; the others keep their color.
+// The scene must be static; reset() when it changes. Pixels are traced one by one with
+//  the recursive engine, as the traced pixels are scattered over the image.
+class TemporalRenderer
+{
+public:
+	TemporalRenderer(int w, int h, TemporalSettings settings = {});
+
+	// Discards the history, so that the next frame is traced completely
+	void reset();
+
+	// Renders a frame; returns the number of pixels traced
+	template <typename SceneType, typename ScreenType>
+	int renderFrame(const SceneType& scene, ScreenType& screen, const Camera& camera, ThreadPool& threadPool,
+		const RenderSettings& renderSettings = {}, std::optional<CameraSpan> span = std::nullopt);
+
+	auto getPixelCount() const { return w*h; }
+
+private:
+	enum class SampleKind : uint8_t
+	{
+		Empty,
+		Hit, // pos is the primary hit
+		Miss // pos is the primary ray's direction
+	};
+
+	struct Sample
+	{
+		RgbColor color;
+		vec3f pos;
+		vec3f normal;
+		const Object* obj = nullptr; // hit, or null for a miss
+		uint32_t primIndex = 0;
+		uint32_t frame; // traced in
+		SampleKind kind = SampleKind::Empty;
+	};
+
+	TemporalSettings settings;
+	int w, h;
+	std::vector<Sample> history; // of the last frame, per pixel
+	std::vector<Sample> samples; // of the current frame
+	std::vector<vec3f> cameraPositions; // of the last refreshPeriod frames, by frame % refreshPeriod
+	uint32_t frameIndex = 0;
+
+	// Nearest reprojected sample of each pixel: depth bits above the history index
+	std::unique_ptr<std::atomic<uint64_t>[]> splats;
+	std::vector<std::vector<uint32_t>> bandTraceLists;
+	std::vector<uint32_t> traceList; // pixel indices
+
+	static constexpr uint64_t noSplat = UINT64_MAX;
+
+	bool isDueForRefresh(int x, int y) const;
+	void splat(const PrimaryRays& primaryRays, vec3f cameraPos, int beginRow, int endRow);
+	uint64_t getSplat(int x, int y) const;
+	uint64_t fillHole(int x, int y) const;
+	bool isCoherent(const Sample& sample, uint64_t key, int x, int y) const;
+	bool isReusable(const Sample& sample, uint64_t key, int x, int y, vec3f cameraPos) const;
+};
+
+// .cpp
+namespace detail
+{
+	// Positive floats, infinity included, order like their bit patterns
+	uint32_t getDepthBits(float depth)
+	{
+		uint32_t bits;
+		std::memcpy(&bits, &depth, sizeof(bits));
+		return bits;
+	}
+
+	float getSplatDepth(uint64_t key)
+	{
+		const auto bits = uint32_t(key >> 32);
+		float depth;
+		std::memcpy(&depth, &bits, sizeof(depth));
+		return depth;
+	}
+
+	void atomicMin(std::atomic<uint64_t>& target, uint64_t value)
+	{
+		uint64_t current = target.load(std::memory_order_relaxed);
+		while (value < current && !target.compare_exchange_weak(current, value, std::memory_order_relaxed))
+			;
+	}
+}
+
+TemporalRenderer::TemporalRenderer(int w, int h, TemporalSettings settings) :
+	settings(settings),
+	w(w), h(h),
+	history(size_t(w)*h),
+	samples(size_t(w)*h),
+	cameraPositions(size_t(std::max(settings.refreshPeriod, 1))),
+	splats(new std::atomic<uint64_t>[size_t(w)*h])
+{
+	assert(settings.refreshPeriod >= 1);
+}
+
+void TemporalRenderer::reset()
+{
+	std::fill(begin(history), end(history), Sample{});
+}
+
+bool TemporalRenderer::isDueForRefresh(int x, int y) const
+{
+	// Ordered dither, so that the refreshed pixels of a frame are spread evenly
+	static constexpr uint8_t bayer[4][4] = {
+		{0, 8, 2, 10},
+		{12, 4, 14, 6},
+		{3, 11, 1, 9},
+		{15, 7, 13, 5}
+	};
+	const auto period = uint32_t(settings.refreshPeriod);
+	return (bayer[y & 3][x & 3] + frameIndex) % period == 0;
+}
+
+void TemporalRenderer::splat(const PrimaryRays& primaryRays, vec3f cameraPos, int beginRow, int endRow)
+{
+	for (int y = beginRow; y < endRow; ++y)
+	{
+		for (int x = 0; x < w; ++x)
+		{
+			const auto index = uint32_t(size_t(y)*w + x);
+			const Sample& sample = history[index];
+			if (sample.kind == SampleKind::Empty || frameIndex - sample.frame >= uint32_t(settings.refreshPeriod))
+				continue;
+
+			// Misses are directions, behind anything hit
+			float depth;
+			const auto pos = primaryRays.project(sample.kind == SampleKind::Hit ? sample.pos : cameraPos + sample.pos, depth);
+			if (!pos)
+				continue;
+			if (sample.kind == SampleKind::Miss)
+				depth = std::numeric_limits<float>::infinity();
+
+			const int px = int(std::floor(pos->x + 0.5f));
+			const int py = int(std::floor(pos->y + 0.5f));
+			if (px < 0 || px >= w || py < 0 || py >= h)
+				continue;
+			detail::atomicMin(splats[size_t(py)*w + px], (uint64_t(detail::getDepthBits(depth)) << 32) | index);
+		}
+	}
+}
+
+uint64_t TemporalRenderer::getSplat(int x, int y) const
+{
+	if (x < 0 || x >= w || y < 0 || y >= h)
+		return noSplat;
+	return splats[size_t(y)*w + x].load(std::memory_order_relaxed);
+}
+
+uint64_t TemporalRenderer::fillHole(int x, int y) const
+{
+	// A gap within a surface, not a disocclusion, when at most one neighbour is empty
+	const uint64_t neighbours[4] = {getSplat(x - 1, y), getSplat(x + 1, y), getSplat(x, y - 1), getSplat(x, y + 1)};
+	const auto emptyCount = std::count(std::begin(neighbours), std::end(neighbours), noSplat);
+	return emptyCount <= 1 ? *std::min_element(std::begin(neighbours), std::end(neighbours)) : noSplat;
+}
+
+// Samples drift off the pixel grid, and one landing at the edge of its triangle may
+//  not be what the pixel shows: reused are those whose neighbours hit the same triangle
+bool TemporalRenderer::isCoherent(const Sample& sample, uint64_t key, int x, int y) const
+{
+	int sameCount = 0;
+	for (const uint64_t neighbour : {getSplat(x - 1, y), getSplat(x + 1, y), getSplat(x, y - 1), getSplat(x, y + 1)})
+	{
+		if (neighbour == noSplat || uint32_t(neighbour) == uint32_t(key))
+			continue;
+		const Sample& other = history[uint32_t(neighbour)];
+		sameCount += other.obj == sample.obj && other.primIndex == sample.primIndex;
+	}
+	return sameCount >= settings.minSameNeighbours;
+}
+
+bool TemporalRenderer::isReusable(const Sample& sample, uint64_t key, int x, int y, vec3f cameraPos) const
+{
+	// Hidden, i.e. seen through a gap between the samples of a closer surface: closer samples
+	//  on opposite sides (a surface seen at a grazing angle is closer on one side only)
+	const float depth = detail::getSplatDepth(key);
+	auto isCloser = [&](int nx, int ny) {
+		const uint64_t neighbour = getSplat(nx, ny);
+		return neighbour != noSplat && detail::getSplatDepth(neighbour) * (1 + settings.depthTolerance) < depth;
+	};
+	if ((isCloser(x - 1, y) && isCloser(x + 1, y)) || (isCloser(x, y - 1) && isCloser(x, y + 1))
+		|| (isCloser(x - 1, y - 1) && isCloser(x + 1, y + 1)) || (isCloser(x - 1, y + 1) && isCloser(x + 1, y - 1)))
+		return false;
+
+	if (!isCoherent(sample, key, x, y))
+		return false;
+	if (sample.kind == SampleKind::Miss)
+		return true;
+
+	const vec3f toCamera = normalized(cameraPos - sample.pos);
+	if (std::abs(sample.normal * toCamera) < settings.minFacing)
+		return false;
+
+	const vec3f tracedFrom = cameraPositions[sample.frame % cameraPositions.size()];
+	const vec3f toTracedCamera = normalized(tracedFrom - sample.pos);
+	return toCamera * toTracedCamera >= settings.minViewCosine;
+}
+
+template <typename SceneType, typename ScreenType>
+int TemporalRenderer::renderFrame(const SceneType& scene, ScreenType& screen, const Camera& camera, ThreadPool& threadPool,
+	const RenderSettings& renderSettings, std::optional<CameraSpan> span)
+{
+	assert(screen.getW() == w && screen.getH() == h);
+	const PrimaryRays primaryRays{camera, w, h, span};
+	const size_t pixelCount = size_t(w)*h;
+	const auto bandCount = std::min(std::max(threadPool.getThreadCount(), 1u) * 4, unsigned(h));
+	auto getBandBegin = [&](unsigned band) { return int(uint64_t(h) * band / bandCount); };
+
+	// Reproject the history, keeping the nearest sample of each pixel
+	for (size_t i = 0; i < pixelCount; ++i)
+		splats[i].store(noSplat, std::memory_order_relaxed);
+	threadPool.addTasks(bandCount, [&](unsigned band) {
+		splat(primaryRays, camera.pos, getBandBegin(band), getBandBegin(band + 1));
+	}).get();
+
+	// Reuse what passes the checks, collect the rest
+	bandTraceLists.resize(bandCount);
+	threadPool.addTasks(bandCount, [&](unsigned band) {
+		std::vector<uint32_t>& bandTraceList = bandTraceLists[band];
+		bandTraceList.clear();
+		for (int y = getBandBegin(band); y < getBandBegin(band + 1); ++y)
+		{
+			for (int x = 0; x < w; ++x)
+			{
+				const auto index = uint32_t(size_t(y)*w + x);
+				uint64_t key = splats[index].load(std::memory_order_relaxed);
+				if (key == noSplat)
+					key = fillHole(x, y);
+				if (key != noSplat && !isDueForRefresh(x, y))
+				{
+					const Sample& sample = history[uint32_t(key)];
+					if (isReusable(sample, key, x, y, camera.pos))
+					{
+						samples[index] = sample;
+						continue;
+					}
+				}
+				bandTraceList.push_back(index);
+			}
+		}
+	}).get();
+
+	traceList.clear();
+	for (const auto& bandTraceList : bandTraceLists)
+		traceList.insert(end(traceList), begin(bandTraceList), end(bandTraceList));
+
+	// Trace the rest
+	constexpr uint32_t chunkSize = 256;
+	const auto chunkCount = unsigned((traceList.size() + chunkSize - 1) / chunkSize);
+	cameraPositions[frameIndex % cameraPositions.size()] = camera.pos;
+	threadPool.addTasks(chunkCount, [&](unsigned chunk) {
+		const size_t end = std::min(size_t(chunk + 1) * chunkSize, traceList.size());
+		for (size_t i = size_t(chunk) * chunkSize; i < end; ++i)
+		{
+			const uint32_t index = traceList[i];
+			const vec2i pixel = {int(index % uint32_t(w)), int(index / uint32_t(w))};
+			const Ray ray = {camera.pos, primaryRays.getDir(pixel.x, pixel.y)};
+			const auto hit = scene.findFirstHit(ray);
+			stats::countRay(stats::RayType::Primary, 0);
+			stats::countHit(hit.has_value());
+
+			Sample& sample = samples[index];
+			sample.frame = frameIndex;
+			if (hit)
+			{
+				sample.kind = SampleKind::Hit;
+				sample.pos = hit->pos;
+				sample.normal = getNormal(*hit);
+				sample.obj = hit->obj;
+				sample.primIndex = hit->primIndex;
+				sample.color = shadePixel(ray, *hit, getMaterial(scene.getMaterials(), *hit->obj, hit->pos), scene, pixel, renderSettings);
+			}
+			else
+			{
+				sample.kind = SampleKind::Miss;
+				sample.pos = ray.dir;
+				sample.obj = nullptr;
+				sample.primIndex = 0;
+				sample.color = {0, 0, 0};
+			}
+		}
+	}).get();
+
+	for (int y = 0; y < h; ++y)
+		for (int x = 0; x < w; ++x)
+			screen.putPixel({x, y}, samples[size_t(y)*w + x].color);
+
+	std::swap(history, samples);
+	++frameIndex;
+	return int(traceList.size());
+}
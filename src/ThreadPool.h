@@ -1,12 +1,26 @@
 #pragma once
-#include <queue>
+#include <deque>
 #include <condition_variable>
-#include <functional>
+#include <future>
+#include <memory>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <vector>
+#include <exception>
+#include <type_traits>
+#include <utility>
+#include <algorithm>
+#include <new>
+#include <cstddef>
+#include <cstdint>
 #include <cassert>
 
+// Pool of threads running tasks
+// Each thread has its own task queue, which submissions are spread over; a thread
+//  whose queue is empty steals from the others. Tasks may be move-only callables.
+// Waiting on a task's future from within another task of the same pool can deadlock,
+//  as the waiting thread doesn't run tasks meanwhile.
 class ThreadPool
 {
 public:
@@ -16,63 +30,328 @@ public:
 	ThreadPool& operator=(const ThreadPool&) = delete;
 	ThreadPool(ThreadPool&&) = delete;
 	ThreadPool& operator=(ThreadPool&&) = delete;
+
+	// Tasks not started yet are dropped, their futures get std::future_error
 	~ThreadPool();
 
-	void addTask(std::function<void()> task);
+	// Runs fn() on a pool thread; the future gets its result or exception
+	// The future's shared state costs an allocation, so many small tasks are better
+	//  submitted through addTasks().
+	template <typename Fn>
+	auto addTask(Fn&& fn) -> std::future<std::invoke_result_t<std::decay_t<Fn>&>>;
+
+	// Runs fn(i) for i in [0, count) with a single wake-up of the threads
+	// The future is ready once all of them finished, with the first exception thrown, if any.
+	template <typename Fn>
+	std::future<void> addTasks(unsigned count, Fn fn);
+
+	// Blocks until all tasks submitted so far (and any they submit) have finished
+	void waitAll();
+
+	auto getThreadCount() const { return unsigned(threads.size()); }
 
 private:
-	using TaskType = std::function<void()>;
+	// Type-erased move-only callable
+	// Small callables are stored inline, so that submitting them doesn't allocate.
+	class Task
+	{
+	public:
+		Task() = default;
+		template <typename Fn>
+		explicit Task(Fn fn);
+
+		Task(Task&& other) noexcept { moveFrom(other); }
+		Task& operator=(Task&& other) noexcept;
+		~Task() { reset(); }
+
+		void operator()() { ops->run(storage); }
+		void reset();
+
+	private:
+		struct Ops
+		{
+			void (*run)(void* fn);
+			void (*move)(void* to, void* from); // also destroys from
+			void (*destroy)(void* fn);
+		};
+		template <typename Fn>
+		static const Ops inlineOps;
+
+		// Wraps callables too large to be stored inline
+		template <typename Fn>
+		struct HeapFn
+		{
+			std::unique_ptr<Fn> fn;
+			void operator()() { (*fn)(); }
+		};
+
+		static constexpr size_t inlineSize = 48;
+		alignas(std::max_align_t) unsigned char storage[inlineSize];
+		const Ops* ops = nullptr;
 
-	std::queue<TaskType> tasks;
+		void moveFrom(Task& other);
+	};
+
+	struct alignas(64) Queue
+	{
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	std::vector<std::unique_ptr<Queue>> queues; // one per thread
+	std::atomic<unsigned> nextQueue{0}; // round robin for submissions
+
+	// Queued tasks; threads only sleep while it is 0
+	std::atomic<int64_t> queuedCount{0};
+	// Queued and running tasks, for waitAll()
+	std::atomic<int64_t> unfinishedCount{0};
+	std::atomic<unsigned> sleepingCount{0};
+	std::atomic<unsigned> waitingCount{0}; // threads in waitAll()
+
+	std::mutex sleepMutex;
 	std::condition_variable taskReady;
-	std::mutex taskMutex;
+	std::condition_variable allFinished;
 
 	std::vector<std::thread> threads;
-	bool stop;
-	void workerMain();
+	std::atomic<bool> stop{false};
+
+	void workerMain(unsigned index);
+	bool tryPop(unsigned index, Task& task);
+
+	// Queues the tasks spread over the threads' queues, then wakes sleeping threads
+	void push(Task* tasks, size_t taskCount);
+};
+
+// .cpp
+template <typename Fn>
+const ThreadPool::Task::Ops ThreadPool::Task::inlineOps = {
+	[](void* fn) { (*static_cast<Fn*>(fn))(); },
+	[](void* to, void* from) {
+		new (to) Fn{std::move(*static_cast<Fn*>(from))};
+		static_cast<Fn*>(from)->~Fn();
+	},
+	[](void* fn) { static_cast<Fn*>(fn)->~Fn(); }
 };
 
-ThreadPool::ThreadPool(unsigned threadCount) :
-	stop(false)
+template <typename Fn>
+ThreadPool::Task::Task(Fn fn)
+{
+	if constexpr (sizeof(Fn) <= inlineSize && alignof(Fn) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible_v<Fn>)
+	{
+		new (storage) Fn{std::move(fn)};
+		ops = &inlineOps<Fn>;
+	}
+	else
+	{
+		new (storage) HeapFn<Fn>{std::make_unique<Fn>(std::move(fn))};
+		ops = &inlineOps<HeapFn<Fn>>;
+	}
+}
+
+ThreadPool::Task& ThreadPool::Task::operator=(Task&& other) noexcept
+{
+	if (this != &other)
+	{
+		reset();
+		moveFrom(other);
+	}
+	return *this;
+}
+
+void ThreadPool::Task::reset()
+{
+	if (ops)
+		ops->destroy(storage);
+	ops = nullptr;
+}
+
+void ThreadPool::Task::moveFrom(Task& other)
+{
+	if (other.ops)
+		other.ops->move(storage, other.storage);
+	ops = std::exchange(other.ops, nullptr);
+}
+
+ThreadPool::ThreadPool(unsigned threadCount)
 {
 	for (unsigned i = 0; i < threadCount; ++i)
-		threads.emplace_back([this] { workerMain(); });
+		queues.push_back(std::make_unique<Queue>());
+	for (unsigned i = 0; i < threadCount; ++i)
+		threads.emplace_back([this, i] { workerMain(i); });
 }
 
 ThreadPool::~ThreadPool()
 {
-	stop = true;
+	{
+		std::lock_guard lock{sleepMutex};
+		stop = true;
+	}
 	taskReady.notify_all();
 	for (auto& thread : threads)
 		thread.join();
 }
 
-void ThreadPool::workerMain()
+template <typename Fn>
+auto ThreadPool::addTask(Fn&& fn) -> std::future<std::invoke_result_t<std::decay_t<Fn>&>>
 {
-	while (!stop)
+	using ResultType = std::invoke_result_t<std::decay_t<Fn>&>;
+	std::packaged_task<ResultType()> packagedTask{std::forward<Fn>(fn)};
+	auto future = packagedTask.get_future();
+
+	Task task{std::move(packagedTask)};
+	push(&task, 1);
+	return future;
+}
+
+template <typename Fn>
+std::future<void> ThreadPool::addTasks(unsigned count, Fn fn)
+{
+	// Shared by the tasks of the batch; the last one to finish completes the future
+	struct Batch
 	{
-		TaskType task;
+		Batch(Fn fn, unsigned count) : fn(std::move(fn)), remainingCount(count) {}
 
-		{	// Retrieve next task from the queue
-			std::unique_lock lock{taskMutex};
-			taskReady.wait(lock, [this]{ return tasks.size() > 0 || stop; });
-			if (stop)
-				break;
+		Fn fn;
+		std::atomic<unsigned> remainingCount;
+		std::promise<void> finished;
+		std::exception_ptr exception;
+		std::mutex exceptionMutex;
+	};
+	const auto batch = std::make_shared<Batch>(std::move(fn), count);
+	auto future = batch->finished.get_future();
+	if (count == 0)
+	{
+		batch->finished.set_value();
+		return future;
+	}
+
+	std::vector<Task> tasks;
+	tasks.reserve(count);
+	for (unsigned i = 0; i < count; ++i)
+	{
+		tasks.emplace_back([batch, i] {
+			try
+			{
+				batch->fn(i);
+			}
+			catch (...)
+			{
+				std::lock_guard lock{batch->exceptionMutex};
+				if (!batch->exception)
+					batch->exception = std::current_exception();
+			}
+
+			if (--batch->remainingCount == 0)
+			{
+				if (batch->exception)
+					batch->finished.set_exception(batch->exception);
+				else
+					batch->finished.set_value();
+			}
+		});
+	}
+	push(tasks.data(), tasks.size());
+	return future;
+}
+
+void ThreadPool::push(Task* tasks, size_t taskCount)
+{
+	assert(!queues.empty() && "no threads to run the tasks");
+	unfinishedCount += int64_t(taskCount);
+
+	// Consecutive runs of the batch per queue, so that each queue is locked once
+	const auto queueCount = unsigned(queues.size());
+	const unsigned firstQueue = nextQueue.fetch_add(1, std::memory_order_relaxed);
+	const size_t runLength = (taskCount + queueCount - 1) / queueCount;
+	for (size_t begin = 0, run = 0; begin < taskCount; begin += runLength, ++run)
+	{
+		Queue& queue = *queues[(firstQueue + run) % queueCount];
+		const size_t end = std::min(begin + runLength, taskCount);
+		std::lock_guard lock{queue.mutex};
+		for (size_t i = begin; i < end; ++i)
+			queue.tasks.push_back(std::move(tasks[i]));
+	}
+
+	// Pairs with the sleeping thread incrementing sleepingCount before checking queuedCount
+	//  (both sequentially consistent): either the thread sees the tasks or it gets notified
+	queuedCount += int64_t(taskCount);
+	if (sleepingCount > 0)
+	{
+		std::lock_guard lock{sleepMutex};
+		if (taskCount > 1)
+			taskReady.notify_all();
+		else
+			taskReady.notify_one();
+	}
+}
+
+bool ThreadPool::tryPop(unsigned index, Task& task)
+{
+	// Own queue from the front, the others' from the back
+	for (unsigned i = 0; i < queues.size(); ++i)
+	{
+		Queue& queue = *queues[(index + i) % queues.size()];
+		std::lock_guard lock{queue.mutex};
+		if (queue.tasks.empty())
+			continue;
+
+		if (i == 0)
+		{
+			task = std::move(queue.tasks.front());
+			queue.tasks.pop_front();
+		}
+		else
+		{
+			task = std::move(queue.tasks.back());
+			queue.tasks.pop_back();
+		}
+		--queuedCount;
+		return true;
+	}
+	return false;
+}
+
+void ThreadPool::workerMain(unsigned index)
+{
+	Task task;
+	while (!stop)
+	{
+		if (tryPop(index, task))
+		{
+			task();
+			task.reset(); // release what the task holds before reporting it finished
+			if (--unfinishedCount == 0 && waitingCount > 0)
+			{
+				std::lock_guard lock{sleepMutex};
+				allFinished.notify_all();
+			}
+			continue;
+		}
 
-			assert(tasks.size() > 0);
-			task = std::move(tasks.front());
-			tasks.pop();
+		// Tasks often come in bursts; yielding a little first saves sleeping and being woken
+		bool hasTasks = false;
+		for (int i = 0; i < 16 && !hasTasks; ++i)
+		{
+			std::this_thread::yield();
+			hasTasks = queuedCount > 0;
 		}
+		if (hasTasks)
+			continue;
 
-		// Execute the task
-		task();
+		std::unique_lock lock{sleepMutex};
+		++sleepingCount;
+		taskReady.wait(lock, [this] { return queuedCount > 0 || stop; });
+		--sleepingCount;
+		if (stop)
+			break;
 	}
 }
 
-void ThreadPool::addTask(std::function<void()> task)
+void ThreadPool::waitAll()
 {
-	std::unique_lock lock{taskMutex};
-	tasks.push(std::move(task));
-	lock.unlock();
-	taskReady.notify_one();
+	// Pairs with the last task decrementing unfinishedCount before checking waitingCount
+	std::unique_lock lock{sleepMutex};
+	++waitingCount;
+	allFinished.wait(lock, [this] { return unfinishedCount == 0; });
+	--waitingCount;
 }
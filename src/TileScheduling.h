@@ -0,0 +1,121 @@
+#pragma once
+#include "Rendering.h"
+#include <vector>
+#include <atomic>
+#include <optional>
+#include <algorithm>
+#include <cstdint>
+
+// Splits a w x h image into square tiles, ordered along a Morton (Z-order) curve
+// so that consecutive tiles are spatially close.
+std::vector<PixelRect> makeTiles(int w, int h, int tileSize);
+
+// Picks a tile size giving every thread enough tiles to balance uneven work
+int getAutoTileSize(int w, int h, unsigned threadCount);
+
+// Per-worker queues of tile indices with work stealing
+// Each worker starts with a contiguous run of the tile order and takes tiles
+//  from its front; a worker with an empty queue steals from the back of
+//  the others' queues, i.e. the tiles farthest from what their owners work on.
+class TileQueues
+{
+public:
+	TileQueues(uint32_t tileCount, unsigned workerCount);
+
+	// Next tile for the worker, nullopt once all tiles are taken
+	std::optional<uint32_t> pop(unsigned worker);
+
+private:
+	// [begin, end) range packed into one word, so that the owner and thieves
+	//  can both update it with a single compare-and-swap
+	struct alignas(64) Queue
+	{
+		std::atomic<uint64_t> range;
+	};
+
+	std::vector<Queue> queues;
+
+	static uint64_t pack(uint32_t begin, uint32_t end) { return (uint64_t(begin) << 32) | end; }
+	static uint32_t getBegin(uint64_t range) { return uint32_t(range >> 32); }
+	static uint32_t getEnd(uint64_t range) { return uint32_t(range); }
+};
+
+// .cpp
+namespace detail
+{
+	uint32_t spreadBits(uint32_t x)
+	{
+		x &= 0xffff;
+		x = (x | (x << 8)) & 0x00ff00ff;
+		x = (x | (x << 4)) & 0x0f0f0f0f;
+		x = (x | (x << 2)) & 0x33333333;
+		x = (x | (x << 1)) & 0x55555555;
+		return x;
+	}
+
+	uint32_t getMortonCode(uint32_t x, uint32_t y)
+	{
+		return spreadBits(x) | (spreadBits(y) << 1);
+	}
+}
+
+std::vector<PixelRect> makeTiles(int w, int h, int tileSize)
+{
+	std::vector<PixelRect> tiles;
+	for (int y = 0; y < h; y += tileSize)
+		for (int x = 0; x < w; x += tileSize)
+			tiles.push_back(PixelRect{x, y, std::min(tileSize, w - x), std::min(tileSize, h - y)});
+
+	std::sort(begin(tiles), end(tiles), [tileSize](const PixelRect& a, const PixelRect& b) {
+		return detail::getMortonCode(a.x/tileSize, a.y/tileSize) < detail::getMortonCode(b.x/tileSize, b.y/tileSize);
+	});
+	return tiles;
+}
+
+int getAutoTileSize(int w, int h, unsigned threadCount)
+{
+	// Largest power of two in [8, 64] leaving at least 16 tiles per thread
+	const int minTileCount = 16*int(std::max(threadCount, 1u));
+	int tileSize = 64;
+	while (tileSize > 8 && ((w + tileSize-1)/tileSize) * ((h + tileSize-1)/tileSize) < minTileCount)
+		tileSize /= 2;
+	return tileSize;
+}
+
+TileQueues::TileQueues(uint32_t tileCount, unsigned workerCount) :
+	queues(std::max(workerCount, 1u))
+{
+	const auto queueCount = uint32_t(queues.size());
+	for (uint32_t i = 0; i < queueCount; ++i)
+	{
+		const uint32_t begin = uint32_t(uint64_t(tileCount) * i / queueCount);
+		const uint32_t end = uint32_t(uint64_t(tileCount) * (i+1) / queueCount);
+		queues[i].range.store(pack(begin, end), std::memory_order_relaxed);
+	}
+}
+
+std::optional<uint32_t> TileQueues::pop(unsigned worker)
+{
+	// Own queue: take from the front
+	auto& own = queues[worker].range;
+	uint64_t range = own.load(std::memory_order_relaxed);
+	while (getBegin(range) < getEnd(range))
+	{
+		if (own.compare_exchange_weak(range, pack(getBegin(range) + 1, getEnd(range)), std::memory_order_relaxed))
+			return getBegin(range);
+	}
+
+	// Steal from the back of the other queues
+	for (size_t offset = 1; offset < queues.size(); ++offset)
+	{
+		auto& victim = queues[(worker + offset) % queues.size()].range;
+		range = victim.load(std::memory_order_relaxed);
+		while (getBegin(range) < getEnd(range))
+		{
+			if (victim.compare_exchange_weak(range, pack(getBegin(range), getEnd(range) - 1), std::memory_order_relaxed))
+				return getEnd(range) - 1;
+		}
+	}
+
+	return std::nullopt;
+}
@@ -1,5 +1,7 @@
 #pragma once
-#include <algorithm> // clamp
+#include <algorithm> // clamp, min, max
+#include <cassert>
+#include <cmath>
 
 template<typename T>
 struct Vec2
@@ -21,7 +23,7 @@ template<typename T> Vec2<T> operator-(const Vec2<T>& a, const Vec2<T>& b) { ret
 template<typename T> Vec2<T> operator-(const Vec2<T>& v) { return Vec2<T>{-v.x, -v.y}; }
 template<typename T> float length(const Vec2<T>& v) { return sqrt(v.x*v.x+v.y*v.y); }
 template<typename T> float lengthSqr(const Vec2<T>& v) { return v.x*v.x+v.y*v.y; }
-template<typename T> Vec2<T> normalized(const Vec2<T>& v) { assert(length(v) > 0); return v / length(v); }
+template<typename T> Vec2<T> normalized(const Vec2<T>& v) { const float l = length(v); assert(l > 0); return v / l; }
 template<typename T> Vec2<T> clamp(const Vec2<T>& v, const Vec2<T>& low, const Vec2<T>& high) {
 	return Vec2<T>{std::clamp(v.x, low.x, high.x), std::clamp(v.y, low.y, high.y)};
 }
@@ -32,6 +34,9 @@ struct Vec3
 	T x = {};
 	T y = {};
 	T z = {};
+
+	T& operator[](int i) { assert(i >= 0 && i < 3); return i == 0 ? x : (i == 1 ? y : z); }
+	const T& operator[](int i) const { assert(i >= 0 && i < 3); return i == 0 ? x : (i == 1 ? y : z); }
 };
 
 using vec3f = Vec3<float>;
@@ -48,7 +53,10 @@ template<typename T> Vec3<T> operator-(const Vec3<T>& v) { return Vec3<T>{-v.x,
 template<typename T> Vec3<T> operator^(const Vec3<T>& a, const Vec3<T>& b) { return Vec3<T>{a.y*b.z - a.z*b.y, a.z*b.x - a.x*b.z, a.x*b.y - a.y*b.x}; }
 template<typename T> float length(const Vec3<T>& v) { return sqrt(v.x*v.x+v.y*v.y+v.z*v.z); }
 template<typename T> float lengthSqr(const Vec3<T>& v) { return v.x*v.x+v.y*v.y+v.z*v.z; }
-template<typename T> Vec3<T> normalized(const Vec3<T>& v) { assert(length(v) > 0); return v / length(v); }
+template<typename T> Vec3<T> normalized(const Vec3<T>& v) { const float l = length(v); assert(l > 0); return v / l; }
 template<typename T> Vec3<T> clamp(const Vec3<T>& v, const Vec3<T>& low, const Vec3<T>& high) {
 	return Vec3<T>{std::clamp(v.x, low.x, high.x), std::clamp(v.y, low.y, high.y), std::clamp(v.z, low.z, high.z)};
 }
+template<typename T> Vec3<T> mul(const Vec3<T>& a, const Vec3<T>& b) { return Vec3<T>{a.x*b.x, a.y*b.y, a.z*b.z}; } // componentwise
+template<typename T> Vec3<T> min(const Vec3<T>& a, const Vec3<T>& b) { return Vec3<T>{std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z)}; }
+template<typename T> Vec3<T> max(const Vec3<T>& a, const Vec3<T>& b) { return Vec3<T>{std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z)}; }
@@ -0,0 +1,309 @@
+#pragma once
+#include "Object.h"
+#include "Shading.h"
+#include "Sampler.h"
+#include "Stats.h"
+#include <vector>
+#include <algorithm>
+#include <optional>
+#include <type_traits>
+#include <cstdint>
+
+// Iterative, breadth-first ray tracer
+// Instead of following the ray tree of each pixel depth-first, all rays of one bounce
+//  are kept in flat arrays and every stage runs over the whole batch:
+//  intersect (in direction-sorted order) -> shade the hits (sorted by material)
+//  -> trace the shadow rays of the hits towards the lights -> spawn the secondary
+//  rays of the next bounce.
+// Colors are resolved from the deepest bounce upwards once all rays are traced, with
+//  the same arithmetic as traceRay(), so both renderers produce the same image.
+// Scenes with batch queries (see HasBatchQuery) get the rays of a stage all at once.
+class WavefrontTracer
+{
+public:
+	// Traces count primary rays and their secondary rays as configured by path;
+	//  colors[i] receives the color of primaryRays[i]
+	// Memory grows with count*branchFactor^maxDepth, so callers should trace in chunks.
+	template <typename SceneType>
+	void trace(const SceneType& scene, const Ray* primaryRays, const Sampler* samplers, int count,
+		const PathSettings& path, RgbColor* colors);
+
+private:
+	// Rays of one bounce, indexed by ray
+	struct Bounce
+	{
+		std::vector<Ray> rays;
+		std::vector<Sampler> samplers;
+		std::vector<uint8_t> isHit;
+		std::vector<vec3f> positions; // of the hits
+		std::vector<vec3f> normals;
+		std::vector<Material> materials;
+		std::vector<RgbColor> colors;     // direct color of the hit, then the resolved color
+		std::vector<float> throughputs;
+		std::vector<float> weights;       // Russian roulette weights of the rays
+		std::vector<uint32_t> firstChild; // first secondary ray in the next bounce; the children are contiguous
+		std::vector<uint32_t> childCount; // secondary rays that survived Russian roulette
+	};
+
+	std::vector<Bounce> bounces;
+
+	// Scratch buffers of the current bounce
+	std::vector<uint64_t> order; // sort key in the upper, ray index in the lower 32 bits
+	std::vector<Hit> hits;
+	std::vector<uint32_t> hitRays;
+	std::vector<Hit> sortedHits;
+	std::vector<Material> sortedMaterials;
+
+	struct PendingShadowRay
+	{
+		ShadowRay shadowRay;
+		uint32_t rayIndex; // receives the contribution unless occluded
+	};
+	std::vector<PendingShadowRay> shadowRays;
+
+	// Batch query buffers
+	std::vector<Ray> batchRays;
+	std::vector<float> batchTmax;
+	std::vector<std::optional<Hit>> batchHits;
+	std::vector<uint8_t> batchOccluded;
+
+	template <typename SceneType>
+	void intersect(const SceneType& scene, Bounce& bounce, int depth);
+
+	template <typename SceneType>
+	void shade(const SceneType& scene, Bounce& bounce);
+
+	template <typename SceneType>
+	void traceShadowRays(const SceneType& scene, Bounce& bounce, int depth);
+
+	void spawn(Bounce& bounce, Bounce& next, const PathSettings& path);
+	void resolve(Bounce& bounce, const Bounce* next, int branchFactor);
+};
+
+// Sorts rays by octant first, then by coarsely quantized direction
+uint32_t getDirectionKey(vec3f dir);
+
+// Whether the scene implements the batch queries findFirstHitBatch() and isOccludedBatch()
+template <typename SceneType, typename = void>
+struct HasBatchQuery : std::false_type {};
+
+template <typename SceneType>
+struct HasBatchQuery<SceneType, std::void_t<decltype(
+	std::declval<const SceneType&>().findFirstHitBatch(std::declval<const Ray*>(), 0, std::declval<std::optional<Hit>*>()),
+	std::declval<const SceneType&>().isOccludedBatch(std::declval<const Ray*>(), std::declval<const float*>(), 0,
+		std::declval<uint8_t*>()))>> :
+	std::true_type {};
+
+// .cpp
+template <typename SceneType>
+void WavefrontTracer::trace(const SceneType& scene, const Ray* primaryRays, const Sampler* samplers, int count,
+	const PathSettings& path, RgbColor* colors)
+{
+	const int maxDepth = path.maxDepth;
+	if (int(bounces.size()) < maxDepth + 1)
+		bounces.resize(maxDepth + 1);
+
+	bounces[0].rays.assign(primaryRays, primaryRays + count);
+	bounces[0].samplers.assign(samplers, samplers + count);
+	bounces[0].throughputs.assign(count, 1.f);
+	bounces[0].weights.assign(count, 1.f);
+
+	int lastDepth = 0;
+	for (int depth = 0; depth <= maxDepth && !bounces[depth].rays.empty(); ++depth)
+	{
+		lastDepth = depth;
+		intersect(scene, bounces[depth], depth);
+		shade(scene, bounces[depth]);
+		traceShadowRays(scene, bounces[depth], depth);
+
+		if (depth < maxDepth)
+			spawn(bounces[depth], bounces[depth+1], path);
+		else
+			stats::countDepthLimit(hitRays.size());
+	}
+
+	for (int depth = lastDepth; depth >= 0; --depth)
+		resolve(bounces[depth], depth < lastDepth ? &bounces[depth+1] : nullptr, path.branchFactor);
+
+	std::copy_n(bounces[0].colors.data(), count, colors);
+}
+
+template <typename SceneType>
+void WavefrontTracer::intersect(const SceneType& scene, Bounce& bounce, int depth)
+{
+	const auto rayCount = uint32_t(bounce.rays.size());
+
+	// Primary rays arrive in screen order, which is already coherent
+	order.resize(rayCount);
+	for (uint32_t i = 0; i < rayCount; ++i)
+		order[i] = depth == 0 ? i : (uint64_t(getDirectionKey(bounce.rays[i].dir)) << 32) | i;
+	if (depth > 0)
+		std::sort(begin(order), end(order));
+
+	if constexpr (HasBatchQuery<SceneType>::value)
+	{
+		batchRays.resize(rayCount);
+		for (uint32_t k = 0; k < rayCount; ++k)
+			batchRays[k] = bounce.rays[uint32_t(order[k])];
+		batchHits.resize(rayCount);
+		scene.findFirstHitBatch(batchRays.data(), int(rayCount), batchHits.data());
+	}
+
+	bounce.isHit.assign(rayCount, 0);
+	hits.clear();
+	hitRays.clear();
+	for (uint32_t k = 0; k < rayCount; ++k)
+	{
+		const auto i = uint32_t(order[k]);
+		std::optional<Hit> hit;
+		if constexpr (HasBatchQuery<SceneType>::value)
+			hit = batchHits[k];
+		else
+			hit = scene.findFirstHit(bounce.rays[i]);
+		stats::countRay(depth == 0 ? stats::RayType::Primary : stats::RayType::Secondary, depth);
+		stats::countHit(hit.has_value());
+		if (hit)
+		{
+			bounce.isHit[i] = 1;
+			hits.push_back(*hit);
+			hitRays.push_back(i);
+		}
+	}
+}
+
+template <typename SceneType>
+void WavefrontTracer::shade(const SceneType& scene, Bounce& bounce)
+{
+	const MaterialTable& materials = scene.getMaterials();
+	const std::vector<Light>& lights = scene.getLights();
+	const auto rayCount = bounce.rays.size();
+	const auto hitCount = uint32_t(hits.size());
+	bounce.positions.resize(rayCount);
+	bounce.normals.resize(rayCount);
+	bounce.materials.resize(rayCount);
+	bounce.colors.assign(rayCount, RgbColor{0, 0, 0});
+
+	// Group hits by material, so that material evaluation runs over uniform stretches
+	order.resize(hitCount);
+	for (uint32_t h = 0; h < hitCount; ++h)
+		order[h] = (uint64_t(hits[h].obj->material) << 32) | h;
+	std::sort(begin(order), end(order));
+
+	sortedHits.resize(hitCount);
+	for (uint32_t h = 0; h < hitCount; ++h)
+		sortedHits[h] = hits[uint32_t(order[h])];
+	sortedMaterials.resize(hitCount);
+	getMaterials(materials, sortedHits.data(), int(hitCount), sortedMaterials.data());
+
+	for (uint32_t h = 0; h < hitCount; ++h)
+	{
+		const uint32_t i = hitRays[uint32_t(order[h])];
+		const vec3f normal = getNormal(sortedHits[h]);
+		bounce.positions[i] = sortedHits[h].pos;
+		bounce.normals[i] = normal;
+		bounce.materials[i] = sortedMaterials[h];
+		if (lights.empty())
+		{
+			bounce.colors[i] = getDirectColor(bounce.rays[i], normal, sortedMaterials[h]);
+			continue;
+		}
+
+		// Queued in light order, so contributions add up in the same order as in getDirectLighting()
+		for (int l = 0; l < int(lights.size()); ++l)
+		{
+			const auto shadowRay = getShadowRay(lights[l], l, bounce.rays[i], sortedHits[h].pos, normal,
+				sortedMaterials[h], bounce.samplers[i]);
+			if (shadowRay)
+				shadowRays.push_back({*shadowRay, i});
+		}
+	}
+}
+
+template <typename SceneType>
+void WavefrontTracer::traceShadowRays(const SceneType& scene, Bounce& bounce, int depth)
+{
+	if constexpr (HasBatchQuery<SceneType>::value)
+	{
+		batchRays.resize(shadowRays.size());
+		batchTmax.resize(shadowRays.size());
+		for (size_t s = 0; s < shadowRays.size(); ++s)
+		{
+			batchRays[s] = shadowRays[s].shadowRay.ray;
+			batchTmax[s] = shadowRays[s].shadowRay.tmax;
+		}
+		batchOccluded.resize(shadowRays.size());
+		scene.isOccludedBatch(batchRays.data(), batchTmax.data(), int(shadowRays.size()), batchOccluded.data());
+	}
+
+	for (size_t s = 0; s < shadowRays.size(); ++s)
+	{
+		const PendingShadowRay& pending = shadowRays[s];
+		stats::countRay(stats::RayType::Shadow, depth);
+		bool isOccluded;
+		if constexpr (HasBatchQuery<SceneType>::value)
+			isOccluded = batchOccluded[s];
+		else
+			isOccluded = scene.isOccluded(pending.shadowRay.ray, pending.shadowRay.tmax);
+		if (!isOccluded)
+			bounce.colors[pending.rayIndex] = bounce.colors[pending.rayIndex] + pending.shadowRay.contribution;
+	}
+	shadowRays.clear();
+}
+
+void WavefrontTracer::spawn(Bounce& bounce, Bounce& next, const PathSettings& path)
+{
+	// Children are laid out in parent order, which keeps the result independent of the sorting
+	const int branchFactor = path.branchFactor;
+	next.rays.clear();
+	next.samplers.clear();
+	next.throughputs.clear();
+	next.weights.clear();
+	bounce.firstChild.resize(bounce.rays.size());
+	bounce.childCount.assign(bounce.rays.size(), 0);
+	for (size_t i = 0; i < bounce.rays.size(); ++i)
+	{
+		if (!bounce.isHit[i])
+			continue;
+
+		const float secondaryThroughput = getSecondaryThroughput(bounce.throughputs[i], bounce.materials[i], branchFactor);
+		bounce.firstChild[i] = uint32_t(next.rays.size());
+		for (int b = 0; b < branchFactor; ++b)
+		{
+			const Sampler secondarySampler = bounce.samplers[i].getChild(b, branchFactor);
+			const float weight = getContinuationWeight(path, secondaryThroughput, secondarySampler);
+			if (weight == 0.f)
+				continue; // terminated by Russian roulette
+
+			next.rays.push_back(getSecondaryRay(bounce.rays[i], bounce.positions[i], bounce.normals[i],
+				bounce.materials[i], bounce.samplers[i], b, branchFactor));
+			next.samplers.push_back(secondarySampler);
+			next.throughputs.push_back(secondaryThroughput*weight);
+			next.weights.push_back(weight);
+			++bounce.childCount[i];
+		}
+	}
+}
+
+void WavefrontTracer::resolve(Bounce& bounce, const Bounce* next, int branchFactor)
+{
+	for (size_t i = 0; i < bounce.rays.size(); ++i)
+	{
+		if (!bounce.isHit[i])
+			continue;
+
+		RgbColor color = bounce.colors[i];
+		if (next)
+		{
+			for (uint32_t c = bounce.firstChild[i]; c < bounce.firstChild[i] + bounce.childCount[i]; ++c)
+				color = addSecondaryColor(color, bounce.materials[i], next->colors[c], next->weights[c], branchFactor);
+		}
+		bounce.colors[i] = clamp(color, {0, 0, 0}, {1, 1, 1});
+	}
+}
+
+uint32_t getDirectionKey(vec3f dir)
+{
+	auto quantize = [](float c) { return uint32_t(std::clamp((c + 1.f) * 8.f, 0.f, 15.f)); };
+	return (uint32_t(dir.x < 0) << 14) | (uint32_t(dir.y < 0) << 13) | (uint32_t(dir.z < 0) << 12) |
+		(quantize(dir.x) << 8) | (quantize(dir.y) << 4) | quantize(dir.z);
+}
@@ -0,0 +1,477 @@
+#include "SWScreen.h"
+#include "Scenes.h"
+#include "ParallelRendering.h"
+#include "ThreadPool.h"
+#include "Sampler.h"
+#include "SimdIsa.h"
+#include <vector>
+#include <string>
+#include <string_view>
+#include <map>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <stdexcept>
+#include <limits>
+#include <thread>
+
+// Benchmark suite
+// Microbenchmarks time single queries on fixed sets of random rays, macro benchmarks
+//  time whole frames of the canonical scenes at several thread counts.
+// Results can be written as JSON and compared against a JSON baseline written
+//  earlier on the same machine; the run fails when a result got slower than the threshold.
+
+struct Options
+{
+	std::vector<unsigned> threadCounts; // empty: 1, 2, 4, ... up to all cores
+	int width = 320;
+	int height = 195;
+	int frames = 5;        // timed frames per macro benchmark, the median is reported
+	double minSeconds = 0.2; // minimal duration of one microbenchmark run
+	std::string filter;    // only run benchmarks whose name contains it
+	std::string jsonPath;
+	std::string baselinePath;
+	double threshold = 0.1; // allowed relative slowdown against the baseline
+	RenderSettings settings; // of the macro benchmarks
+};
+
+struct BenchmarkResult
+{
+	std::string name;
+	double seconds;       // per query (micro) or per frame (macro)
+	double megaRaysPerSecond; // rays the benchmark starts per second; secondary rays aren't counted
+	unsigned threads = 1;
+	double scalingEfficiency = 1; // speedup over one thread divided by the thread count
+};
+
+// Keeps the compiler from optimizing away a benchmarked computation
+template <typename T>
+void doNotOptimize(const T& value)
+{
+	asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// Best time per call of fn over a few runs of at least minSeconds each
+template <typename F>
+double measure(F&& fn, double minSeconds)
+{
+	using Clock = std::chrono::steady_clock;
+	double best = std::numeric_limits<double>::infinity();
+
+	for (int run = 0; run < 5; ++run)
+	{
+		long long calls = 0;
+		const auto beginTimepoint = Clock::now();
+		double elapsed = 0;
+		do
+		{
+			for (int i = 0; i < 64; ++i)
+				fn();
+			calls += 64;
+			elapsed = std::chrono::duration<double>{Clock::now() - beginTimepoint}.count();
+		} while (elapsed < minSeconds);
+
+		best = std::min(best, elapsed / double(calls));
+	}
+
+	return best;
+}
+
+// Rays from a sphere of radius 5 around the origin towards the [-1, 1]^3 box
+std::vector<Ray> makeRaysTowardsOrigin(int count, unsigned seed)
+{
+	std::mt19937 rng{seed};
+	std::uniform_real_distribution<float> signedUnit{-1.f, 1.f};
+
+	std::vector<Ray> rays;
+	for (int i = 0; i < count; ++i)
+	{
+		vec3f origin;
+		do origin = {signedUnit(rng), signedUnit(rng), signedUnit(rng)};
+		while (lengthSqr(origin) < 0.01f || lengthSqr(origin) > 1.f);
+		origin = 5.f*normalized(origin);
+
+		const vec3f target = {signedUnit(rng), signedUnit(rng), signedUnit(rng)};
+		rays.push_back(Ray{origin, normalized(target - origin)});
+	}
+	return rays;
+}
+
+// Primary rays of random pixels of the default camera
+std::vector<Ray> makeCameraRays(int count, unsigned seed)
+{
+	std::mt19937 rng{seed};
+	std::uniform_real_distribution<float> signedUnit{-1.f, 1.f};
+
+	const Camera camera{{0, 4, 0}, {0, -0.55, -1}, 1};
+	const auto [right, up, back] = getAxes(camera);
+	std::vector<Ray> rays;
+	for (int i = 0; i < count; ++i)
+	{
+		const vec3f dir = -camera.focalLength*back + signedUnit(rng)*right + 0.6f*signedUnit(rng)*up;
+		rays.push_back(Ray{camera.pos, normalized(dir)});
+	}
+	return rays;
+}
+
+// Throws std::runtime_error if the packet query of a scene finds other hits than its
+//  single-ray query, for packets of camera rays with some lanes inactive
+template <int N, typename SceneType>
+void checkPacketQuery(const std::string& name, const SceneType& scene, const std::vector<Ray>& rays)
+{
+	for (size_t first = 0; first + N <= rays.size(); first += N)
+	{
+		RayPacket<N> packet;
+		packet.origin = rays[first].origin;
+		for (int lane = 0; lane < N; ++lane)
+			packet.setDir(lane, rays[first + lane].dir);
+		const LaneMask activeMask = getFullMask<N>() >> (first / N % 4);
+
+		const auto hits = scene.template findFirstHits<N>(packet, activeMask);
+		for (int lane = 0; lane < N; ++lane)
+		{
+			const auto expected = (activeMask >> lane) & 1 ? scene.findFirstHit(packet.getRay(lane)) : std::nullopt;
+			const auto& hit = hits[lane];
+			if (hit.has_value() != expected.has_value() || (hit && (hit->obj != expected->obj
+				|| hit->primIndex != expected->primIndex || hit->pos.x != expected->pos.x
+				|| hit->pos.y != expected->pos.y || hit->pos.z != expected->pos.z)))
+				throw std::runtime_error(name + ": the packet query of " + std::to_string(N)
+					+ " rays differs from the single-ray query");
+		}
+	}
+}
+
+std::vector<BenchmarkResult> runMicroBenchmarks(const Options& options)
+{
+	std::vector<BenchmarkResult> results;
+	auto run = [&](const std::string& name, const std::vector<Ray>& rays, auto&& query) {
+		if (name.find(options.filter) == std::string::npos)
+			return;
+		size_t next = 0;
+		const double seconds = measure([&] {
+			doNotOptimize(query(rays[next]));
+			next = (next + 1) % rays.size();
+		}, options.minSeconds);
+		results.push_back({name, seconds, 1e-6 / seconds});
+		std::cout << std::left << std::setw(32) << name << std::right << std::setw(10) << std::setprecision(4)
+			<< seconds*1e9 << " ns/ray " << std::setw(10) << 1e-6 / seconds << " Mrays/s\n";
+	};
+
+	const auto originRays = makeRaysTowardsOrigin(4096, 1);
+	const auto cameraRays = makeCameraRays(4096, 2);
+
+	const Sphere sphere{{0, 0, 0}, 1};
+	run("micro/intersect_sphere", originRays, [&](const Ray& ray) {
+		return findIntersection(ray, sphere).has_value();
+	});
+
+	const Triangle triangle{{{-1, -1, 0}, {1, -1, 0}, {0, 1, 0}}};
+	run("micro/intersect_triangle", originRays, [&](const Ray& ray) {
+		return findIntersection(ray, triangle).has_value();
+	});
+
+	const PrecomputedTriangle precomputedTriangle = makePrecomputedTriangle(triangle);
+	run("micro/intersect_triangle_pre", originRays, [&](const Ray& ray) {
+		return findIntersection(ray, precomputedTriangle).has_value();
+	});
+
+	const ExampleScene exampleScene;
+
+	// Timings of wrong results are worthless
+	checkPacketQuery<4>("basic scene", exampleScene.getScene(), cameraRays);
+	checkPacketQuery<8>("basic scene", exampleScene.getScene(), cameraRays);
+	checkPacketQuery<16>("basic scene", exampleScene.getScene(), cameraRays);
+
+	run("micro/basic_scene_first_hit", cameraRays, [&](const Ray& ray) {
+		return exampleScene.getScene().findFirstHit(ray).has_value();
+	});
+
+	// Any-hit query of shadow rays, compare with basic_scene_first_hit
+	run("micro/basic_scene_occluded", cameraRays, [&](const Ray& ray) {
+		return exampleScene.getScene().isOccluded(ray, std::numeric_limits<float>::infinity());
+	});
+
+	// Brute-force kernels of every instruction set the CPU supports, on 256 shapes around the origin
+	std::mt19937 rng{3};
+	std::uniform_real_distribution<float> signedUnit{-1.f, 1.f};
+	auto randomPoint = [&] { return vec3f{signedUnit(rng), signedUnit(rng), signedUnit(rng)}; };
+	SphereBuffer sphereBuffer;
+	TriangleBuffer triangleBuffer;
+	for (int i = 0; i < 256; ++i)
+	{
+		sphereBuffer.push(Sphere{randomPoint(), 0.05f});
+		const vec3f v0 = randomPoint();
+		triangleBuffer.push(Triangle{{v0, v0 + 0.1f*randomPoint(), v0 + 0.1f*randomPoint()}});
+	}
+	sphereBuffer.pad();
+	triangleBuffer.pad();
+
+	const simd::Isa defaultIsa = simd::getIsa();
+	for (int isaIndex = 0; isaIndex <= int(simd::getSupportedIsa()); ++isaIndex)
+	{
+		const auto isa = simd::Isa(isaIndex);
+		simd::setIsa(isa);
+		run(std::string{"micro/buffer_spheres/"} + simd::getIsaName(isa), originRays, [&](const Ray& ray) {
+			return findNearestHit(ray, sphereBuffer, std::numeric_limits<float>::infinity()).index;
+		});
+		run(std::string{"micro/buffer_triangles/"} + simd::getIsaName(isa), originRays, [&](const Ray& ray) {
+			return findNearestHit(ray, triangleBuffer, std::numeric_limits<float>::infinity()).index;
+		});
+	}
+	simd::setIsa(defaultIsa);
+
+	// Full path of a primary ray: 3 secondary rays per hit, up to 4 bounces
+	vec2i pixel = {0, 0};
+	run("micro/trace_ray", cameraRays, [&](const Ray& ray) {
+		pixel.x = (pixel.x + 1) & 1023;
+		const Sampler sampler{SamplerKind::Sobol, pixel, 0};
+		return traceRay(ray, exampleScene.getScene(), sampler, PathSettings{}).x;
+	});
+
+	return results;
+}
+
+std::vector<unsigned> getDefaultThreadCounts()
+{
+	const unsigned maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+	std::vector<unsigned> counts;
+	for (unsigned count = 1; count < maxThreads; count *= 2)
+		counts.push_back(count);
+	counts.push_back(maxThreads);
+	return counts;
+}
+
+template <typename SceneType>
+void runMacroBenchmark(const std::string& sceneName, const Options& options, std::vector<BenchmarkResult>& results)
+{
+	if (("macro/" + sceneName).find(options.filter) == std::string::npos)
+		return;
+
+	SceneType scene;
+	const Camera camera{{0, 4, 0}, {0, -0.55, -1}, 1};
+	SWScreen screen{options.width, options.height};
+	const auto threadCounts = options.threadCounts.empty() ? getDefaultThreadCounts() : options.threadCounts;
+
+	double singleThreadSeconds = 0;
+	for (const unsigned threads : threadCounts)
+	{
+		ThreadPool threadPool{threads};
+		parallelRender(scene.getScene(), screen, camera, threadPool, std::nullopt, options.settings); // warm up
+
+		std::vector<double> frameSeconds;
+		for (int frame = 0; frame < options.frames; ++frame)
+		{
+			const auto beginTimepoint = std::chrono::steady_clock::now();
+			parallelRender(scene.getScene(), screen, camera, threadPool, std::nullopt, options.settings);
+			const auto endTimepoint = std::chrono::steady_clock::now();
+			frameSeconds.push_back(std::chrono::duration<double>{endTimepoint - beginTimepoint}.count());
+		}
+		std::nth_element(begin(frameSeconds), begin(frameSeconds) + frameSeconds.size()/2, end(frameSeconds));
+		const double seconds = frameSeconds[frameSeconds.size()/2];
+
+		if (threads == 1)
+			singleThreadSeconds = seconds;
+		const double efficiency = singleThreadSeconds > 0 ? singleThreadSeconds / (seconds * threads) : 0;
+
+		const std::string name = "macro/" + sceneName + "/threads_" + std::to_string(threads);
+		const double megaRaysPerSecond = double(options.width) * options.height / seconds * 1e-6;
+		results.push_back({name, seconds, megaRaysPerSecond, threads, efficiency});
+		std::cout << std::left << std::setw(32) << name << std::right << std::setw(10) << std::setprecision(4)
+			<< seconds*1e3 << " ms/frame " << std::setw(8) << megaRaysPerSecond << " Mrays/s "
+			<< std::setw(6) << efficiency*100 << "% efficiency\n";
+	}
+}
+
+std::vector<BenchmarkResult> runMacroBenchmarks(const Options& options)
+{
+	std::vector<BenchmarkResult> results;
+	runMacroBenchmark<ExampleScene>("example", options, results);
+	runMacroBenchmark<SphereFieldScene>("spheres", options, results);
+	runMacroBenchmark<TriangleSoupScene>("triangles", options, results);
+	return results;
+}
+
+// One result per line, which keeps readBaseline() trivial
+void writeJson(const std::vector<BenchmarkResult>& results, const std::string& path)
+{
+	std::ofstream file{path};
+	if (!file)
+		throw std::runtime_error("Can't open " + path);
+
+	file << "{\n\t\"results\": [\n" << std::setprecision(6);
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const auto& result = results[i];
+		file << "\t\t{\"name\": \"" << result.name << "\", \"seconds\": " << result.seconds
+			<< ", \"mrays_per_s\": " << result.megaRaysPerSecond << ", \"threads\": " << result.threads
+			<< ", \"scaling_efficiency\": " << result.scalingEfficiency << "}"
+			<< (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	file << "\t]\n}\n";
+}
+
+// Reads the Mrays/s of every result in a file written by writeJson()
+std::map<std::string, double> readBaseline(const std::string& path)
+{
+	std::ifstream file{path};
+	if (!file)
+		throw std::runtime_error("Can't open " + path);
+
+	std::map<std::string, double> baseline;
+	std::string line;
+	while (std::getline(file, line))
+	{
+		const auto nameKey = line.find("\"name\": \"");
+		const auto raysKey = line.find("\"mrays_per_s\": ");
+		if (nameKey == std::string::npos || raysKey == std::string::npos)
+			continue;
+
+		const auto nameBegin = nameKey + 9;
+		const auto nameEnd = line.find('"', nameBegin);
+		baseline[line.substr(nameBegin, nameEnd - nameBegin)] = std::stod(line.substr(raysKey + 15));
+	}
+	return baseline;
+}
+
+// Returns the number of results slower than the baseline by more than the threshold
+int compareWithBaseline(const std::vector<BenchmarkResult>& results, const std::map<std::string, double>& baseline, double threshold)
+{
+	int regressions = 0;
+	std::cout << "\nComparison with baseline (threshold " << threshold*100 << "%):\n";
+	for (const auto& result : results)
+	{
+		const auto it = baseline.find(result.name);
+		if (it == baseline.end())
+		{
+			std::cout << std::left << std::setw(32) << result.name << "    (not in baseline)\n";
+			continue;
+		}
+
+		const double change = result.megaRaysPerSecond / it->second - 1;
+		const bool isRegression = change < -threshold;
+		regressions += isRegression;
+		std::cout << std::left << std::setw(32) << result.name << std::right << std::showpos << std::setw(10)
+			<< std::setprecision(3) << change*100 << std::noshowpos << "%" << (isRegression ? "  REGRESSION" : "") << "\n";
+	}
+	return regressions;
+}
+
+void printUsage()
+{
+	std::cout <<
+		"Usage: raytracer_bench [options]\n"
+		"  --filter TEXT          only run benchmarks whose name contains TEXT\n"
+		"  --threads N,N,...      thread counts of the macro benchmarks (default 1, 2, 4, ... all cores)\n"
+		"  --width W, --height H  macro benchmark resolution (default 320x195)\n"
+		"  --frames N             timed frames per macro benchmark (default 5)\n"
+		"  --engine NAME          macro benchmark renderer, recursive or wavefront (default recursive)\n"
+		"  --min-throughput T     macro benchmark Russian roulette threshold, 0 = off (default 0)\n"
+		"  --min-time S           minimal seconds per microbenchmark run (default 0.2)\n"
+		"  --json PATH            write the results as JSON\n"
+		"  --baseline PATH        compare against results written earlier with --json\n"
+		"  --threshold F          allowed relative slowdown against the baseline (default 0.1)\n";
+}
+
+Options parseOptions(int argc, char** argv)
+{
+	Options options;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string_view arg = argv[i];
+		auto value = [&]() -> std::string {
+			if (i + 1 >= argc)
+				throw std::invalid_argument("Missing value for " + std::string{arg});
+			return argv[++i];
+		};
+		auto positive = [&]() {
+			const int n = std::stoi(value());
+			if (n <= 0)
+				throw std::invalid_argument(std::string{arg} + " must be positive");
+			return n;
+		};
+
+		if (arg == "--help" || arg == "-h")
+		{
+			printUsage();
+			std::exit(0);
+		}
+		else if (arg == "--filter")
+			options.filter = value();
+		else if (arg == "--threads")
+		{
+			std::istringstream list{value()};
+			std::string count;
+			while (std::getline(list, count, ','))
+				options.threadCounts.push_back(unsigned(std::max(std::stoi(count), 1)));
+		}
+		else if (arg == "--width")
+			options.width = positive();
+		else if (arg == "--height")
+			options.height = positive();
+		else if (arg == "--frames")
+			options.frames = positive();
+		else if (arg == "--engine")
+		{
+			const auto name = value();
+			if (name != "recursive" && name != "wavefront")
+				throw std::invalid_argument("Unknown engine " + name);
+			options.settings.engine = name == "wavefront" ? RenderEngine::Wavefront : RenderEngine::Recursive;
+		}
+		else if (arg == "--min-throughput")
+			options.settings.path.minThroughput = std::max(std::stof(value()), 0.f);
+		else if (arg == "--min-time")
+			options.minSeconds = std::stod(value());
+		else if (arg == "--json")
+			options.jsonPath = value();
+		else if (arg == "--baseline")
+			options.baselinePath = value();
+		else if (arg == "--threshold")
+			options.threshold = std::stod(value());
+		else
+			throw std::invalid_argument("Unknown option " + std::string{arg});
+	}
+
+	return options;
+}
+
+int main(int argc, char** argv)
+{
+	try
+	{
+		const Options options = parseOptions(argc, argv);
+		std::cout << "SIMD kernels: " << simd::getIsaName(simd::getIsa()) << "\n";
+
+		auto results = runMicroBenchmarks(options);
+		const auto macroResults = runMacroBenchmarks(options);
+		results.insert(end(results), begin(macroResults), end(macroResults));
+
+		if (!options.jsonPath.empty())
+			writeJson(results, options.jsonPath);
+
+		if (!options.baselinePath.empty())
+		{
+			const int regressions = compareWithBaseline(results, readBaseline(options.baselinePath), options.threshold);
+			if (regressions > 0)
+			{
+				std::cout << regressions << " benchmark(s) regressed\n";
+				return 1;
+			}
+		}
+	}
+	catch (const std::invalid_argument& e)
+	{
+		std::cerr << e.what() << "\n\n";
+		printUsage();
+		return 2;
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << e.what() << "\n";
+		return 1;
+	}
+}
@@ -0,0 +1,555 @@
+#include "SWScreen.h"
+#include "Scenes.h"
+#include "ParallelRendering.h"
+#include "ThreadPool.h"
+#include "ImageIO.h"
+#include "Progressive.h"
+#include "Distributed.h"
+#include "Temporal.h"
+#include "FrameGovernor.h"
+#include "SimdIsa.h"
+#include <vector>
+#include <string>
+#include <string_view>
+#include <chrono>
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <optional>
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
+#include <stdexcept>
+
+// Batch renderer without any windowing dependency
+// Renders frames of a canonical scene from one or more cameras into PPM/PFM files,
+//  reusing a single thread pool for all of them.
+
+struct Options
+{
+	std::string sceneName = "example";
+	std::vector<Camera> cameras;
+	vec3f cameraMove = {0, 0, 0}; // per frame
+	float cameraTurn = 0;         // per frame, degrees about the y axis
+	int width = 1280;
+	int height = 780;
+	int samples = 1;   // passes with successive sample indices, averaged
+	float errorThreshold = 0; // > 0: progressive rendering, samples is the maximum per pixel
+	bool temporal = false; // reuse the previous frame of each camera where possible
+	double governorSeconds = 0; // > 0: FrameGovernor picks the quality of each frame for this target
+	int frames = 1;    // scene.update() is called between frames
+	unsigned threads = std::thread::hardware_concurrency();
+	std::optional<simd::Isa> simdIsa; // nullopt: the best the CPU supports
+	std::string output = "frame%d.ppm"; // printf pattern, gets the image index
+	std::string cachePath; // scene cache file of static scenes, empty = none
+	size_t outOfCoreBudget = 0; // > 0: mesh files are paged in from the cache within this many bytes
+	bool printStats = false; // also writes a tile cost heatmap next to each image
+	std::vector<std::string> workers; // addresses of worker processes to render the tiles, empty = local
+	std::string workerAddress; // not empty: serve coordinators on this address instead of rendering
+	RenderSettings settings;
+};
+
+void printUsage()
+{
+	std::cout <<
+		"Usage: raytracer_headless [options]\n"
+		"  --scene NAME                  example, example-lit, spheres, triangles,\n"
+		"                                or an .obj or .ply file (default example)\n"
+		"  --camera x,y,z:dx,dy,dz[:f]   camera position, direction and focal length;\n"
+		"                                repeat to render several views of every frame\n"
+		"  --camera-move dx,dy,dz[:deg]  move every camera by dx,dy,dz and turn it by deg\n"
+		"                                degrees about the y axis from frame to frame\n"
+		"  --width W, --height H         resolution (default 1280x780)\n"
+		"  --samples N                   passes averaged per image (default 1)\n"
+		"  --spp N                       samples per pixel in each pass (default 1)\n"
+		"  --depth N                     bounces after the primary ray (default 4)\n"
+		"  --branching N                 secondary rays per hit (default 3)\n"
+		"  --min-throughput T            Russian roulette for rays contributing less than T\n"
+		"                                to their pixel, 0 = off (default 0)\n"
+		"  --error E                     render progressively until every tile's standard error\n"
+		"                                is at most E, with --samples passes at most\n"
+		"  --temporal                    reproject the previous frame of each camera and trace\n"
+		"                                only the pixels it doesn't cover well (static scenes)\n"
+		"  --governor MS                 lower samples, bounces and resolution of the frames of\n"
+		"                                each camera as needed to render them within MS ms\n"
+		"  --cache PATH                  read the built scene from the scene cache file PATH,\n"
+		"                                or build it and write the cache (static scenes only)\n"
+		"  --out-of-core MB              page the chunks of a mesh file scene in from the\n"
+		"                                --cache file, keeping at most MB megabytes resident\n"
+		"  --frames N                    animation frames to render (default 1)\n"
+		"  --threads N                   render threads (default: all cores)\n"
+		"  --packet N                    primary ray packet width 1, 4, 8 or 16 (default 8)\n"
+		"  --tile N                      tile edge length, 0 = automatic (default 0)\n"
+		"  --engine NAME                 recursive or wavefront (default recursive)\n"
+		"  --simd NAME                   SIMD kernels: scalar, sse4.2, avx2 or avx512\n"
+		"                                (default: the best the CPU supports)\n"
+		"  --output PATTERN              output path, %d is replaced by the image index;\n"
+		"                                .pfm writes float images, otherwise PPM (default frame%d.ppm)\n"
+		"  --stats                       print ray statistics and write a tile cost heatmap\n"
+		"                                next to each image (needs a build with ENABLE_STATS)\n"
+		"  --workers ADDR[,ADDR...]      render the tiles on worker processes, each address\n"
+		"                                being unix:PATH or HOST:PORT\n"
+		"  --worker ADDR                 run as a worker: serve coordinators on ADDR until killed\n";
+}
+
+vec3f parseVec3(std::string_view text)
+{
+	vec3f v;
+	if (std::sscanf(std::string{text}.c_str(), "%f,%f,%f", &v.x, &v.y, &v.z) != 3)
+		throw std::invalid_argument("Expected x,y,z but got '" + std::string{text} + "'");
+	return v;
+}
+
+Camera parseCamera(std::string_view text)
+{
+	const auto posEnd = text.find(':');
+	if (posEnd == std::string_view::npos)
+		throw std::invalid_argument("Expected x,y,z:dx,dy,dz[:f] but got '" + std::string{text} + "'");
+
+	const auto dirEnd = text.find(':', posEnd + 1);
+	const vec3f pos = parseVec3(text.substr(0, posEnd));
+	const vec3f dir = parseVec3(text.substr(posEnd + 1, dirEnd - (posEnd + 1)));
+	const float focalLength = dirEnd == std::string_view::npos ? 1.f : std::stof(std::string{text.substr(dirEnd + 1)});
+	if (lengthSqr(dir) == 0)
+		throw std::invalid_argument("Camera direction must not be zero");
+	return Camera{pos, dir, focalLength};
+}
+
+RenderEngine parseEngine(const std::string& name)
+{
+	if (name == "recursive")
+		return RenderEngine::Recursive;
+	if (name == "wavefront")
+		return RenderEngine::Wavefront;
+	throw std::invalid_argument("Unknown engine " + name);
+}
+
+simd::Isa parseSimdIsa(const std::string& name)
+{
+	const auto isa = simd::parseIsa(name);
+	if (!isa)
+		throw std::invalid_argument("Unknown SIMD instruction set " + name);
+	return *isa;
+}
+
+std::vector<std::string> parseList(const std::string& text)
+{
+	std::vector<std::string> items;
+	size_t begin = 0;
+	while (begin <= text.size())
+	{
+		const auto end = std::min(text.find(',', begin), text.size());
+		if (end > begin)
+			items.push_back(text.substr(begin, end - begin));
+		begin = end + 1;
+	}
+	return items;
+}
+
+Options parseOptions(int argc, char** argv)
+{
+	Options options;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string_view arg = argv[i];
+		auto value = [&]() -> std::string {
+			if (i + 1 >= argc)
+				throw std::invalid_argument("Missing value for " + std::string{arg});
+			return argv[++i];
+		};
+		auto positive = [&]() {
+			const int n = std::stoi(value());
+			if (n <= 0)
+				throw std::invalid_argument(std::string{arg} + " must be positive");
+			return n;
+		};
+
+		if (arg == "--help" || arg == "-h")
+		{
+			printUsage();
+			std::exit(0);
+		}
+		else if (arg == "--scene")
+			options.sceneName = value();
+		else if (arg == "--camera")
+			options.cameras.push_back(parseCamera(value()));
+		else if (arg == "--camera-move")
+		{
+			const std::string text = value();
+			const auto colon = text.find(':');
+			options.cameraMove = parseVec3(text.substr(0, colon));
+			options.cameraTurn = colon == std::string::npos ? 0.f : std::stof(text.substr(colon + 1));
+		}
+		else if (arg == "--width")
+			options.width = positive();
+		else if (arg == "--height")
+			options.height = positive();
+		else if (arg == "--samples")
+			options.samples = positive();
+		else if (arg == "--spp")
+			options.settings.samplesPerPixel = positive();
+		else if (arg == "--depth")
+			options.settings.path.maxDepth = std::stoi(value());
+		else if (arg == "--branching")
+			options.settings.path.branchFactor = positive();
+		else if (arg == "--min-throughput")
+			options.settings.path.minThroughput = std::stof(value());
+		else if (arg == "--error")
+			options.errorThreshold = std::stof(value());
+		else if (arg == "--temporal")
+			options.temporal = true;
+		else if (arg == "--governor")
+			options.governorSeconds = positive() / 1000.0;
+		else if (arg == "--cache")
+			options.cachePath = value();
+		else if (arg == "--out-of-core")
+			options.outOfCoreBudget = size_t(positive()) << 20;
+		else if (arg == "--frames")
+			options.frames = positive();
+		else if (arg == "--threads")
+			options.threads = unsigned(positive());
+		else if (arg == "--packet")
+			options.settings.packetWidth = positive();
+		else if (arg == "--tile")
+			options.settings.tileSize = std::stoi(value());
+		else if (arg == "--engine")
+			options.settings.engine = parseEngine(value());
+		else if (arg == "--simd")
+			options.simdIsa = parseSimdIsa(value());
+		else if (arg == "--output")
+			options.output = value();
+		else if (arg == "--stats")
+			options.printStats = true;
+		else if (arg == "--workers")
+			options.workers = parseList(value());
+		else if (arg == "--worker")
+			options.workerAddress = value();
+		else
+			throw std::invalid_argument("Unknown option " + std::string{arg});
+	}
+
+	if (options.settings.path.maxDepth < 0 || options.settings.path.minThroughput < 0.f)
+		throw std::invalid_argument("--depth and --min-throughput must not be negative");
+
+	const int packetWidth = options.settings.packetWidth;
+	if (packetWidth != 1 && packetWidth != 4 && packetWidth != 8 && packetWidth != 16)
+		throw std::invalid_argument("--packet must be 1, 4, 8 or 16");
+
+	if (!options.cachePath.empty() && (options.sceneName == "example" || options.sceneName == "example-lit"))
+		throw std::invalid_argument("--cache only applies to static scenes");
+
+	if (options.outOfCoreBudget > 0 && (options.cachePath.empty() || !isMeshFile(options.sceneName)))
+		throw std::invalid_argument("--out-of-core needs a mesh file scene and --cache");
+
+	if (!options.workers.empty() && (options.errorThreshold > 0 || options.printStats || options.outOfCoreBudget > 0))
+		throw std::invalid_argument("--workers doesn't combine with --error, --stats or --out-of-core");
+
+	if (options.temporal && (options.samples > 1 || options.errorThreshold > 0 || options.printStats || !options.workers.empty()))
+		throw std::invalid_argument("--temporal doesn't combine with --samples, --error, --stats or --workers");
+
+	if (options.governorSeconds > 0 && (options.samples > 1 || options.errorThreshold > 0 || options.temporal
+		|| options.printStats || !options.workers.empty()))
+		throw std::invalid_argument("--governor doesn't combine with --samples, --error, --temporal, --stats or --workers");
+
+	if (options.cameras.empty())
+		options.cameras.push_back(Camera{{0, 4, 0}, {0, -0.55, -1}, 1});
+
+	return options;
+}
+
+std::string formatPath(const std::string& pattern, int index)
+{
+	std::vector<char> buffer(pattern.size() + 32);
+	std::snprintf(buffer.data(), buffer.size(), pattern.c_str(), index);
+	return buffer.data();
+}
+
+// "dir/frame0.ppm" -> "dir/frame0_heatmap.ppm"
+std::string getHeatmapPath(const std::string& imagePath)
+{
+	const auto dot = imagePath.find_last_of('.');
+	const auto slash = imagePath.find_last_of('/');
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		return imagePath + "_heatmap";
+	return imagePath.substr(0, dot) + "_heatmap" + imagePath.substr(dot);
+}
+
+void printSetupTime(std::chrono::steady_clock::time_point beginTimepoint)
+{
+	const auto endTimepoint = std::chrono::steady_clock::now();
+	std::cout << "scene setup [seconds]: " << std::chrono::duration<double>{endTimepoint - beginTimepoint}.count() << "\n";
+}
+
+// Scenes are sent to workers as AcceleratedScenes
+AcceleratedScene toAcceleratedScene(const AcceleratedScene& scene) { return scene; }
+AcceleratedScene toAcceleratedScene(const BasicScene& scene)
+{
+	return AcceleratedScene{scene.getObjects(), scene.getMaterials(), scene.getLights()};
+}
+AcceleratedScene toAcceleratedScene(const OutOfCoreScene&)
+{
+	throw std::invalid_argument("Out-of-core scenes can't be sent to workers");
+}
+
+// Serves one coordinator after the other
+[[noreturn]] void runWorker(const std::string& address, ThreadPool& threadPool)
+{
+	const Socket listener = listenSocket(address);
+	std::cout << "worker listening on " << address << std::endl;
+	while (true)
+	{
+		Socket connection = acceptSocket(listener);
+		std::cout << "coordinator connected" << std::endl;
+		try
+		{
+			serveCoordinator(connection, threadPool);
+			std::cout << "coordinator disconnected" << std::endl;
+		}
+		catch (const std::exception& e)
+		{
+			std::cout << "coordinator lost: " << e.what() << std::endl;
+		}
+	}
+}
+
+void printWorkerStats(const DistributedRenderer& distributed)
+{
+	for (const auto& worker : distributed.getWorkerStats())
+		std::cout << "worker " << worker.address << ": " << worker.tilesRendered << " tiles, "
+			<< worker.pixelsPerSecond / 1e6 << " Mpixels/s" << (worker.isConnected ? "" : ", lost") << "\n";
+	std::cout << "coordinator: " << distributed.getLocalTileCount() << " tiles\n";
+}
+
+// Camera moved and turned for the given frame
+Camera getFrameCamera(const Camera& camera, int frame, const Options& options)
+{
+	const float angle = float(frame) * options.cameraTurn * 3.14159265f / 180;
+	const vec3f dir = camera.getDir();
+	const vec3f turnedDir = {
+		std::cos(angle)*dir.x + std::sin(angle)*dir.z,
+		dir.y,
+		-std::sin(angle)*dir.x + std::cos(angle)*dir.z
+	};
+	return Camera{camera.pos + float(frame)*options.cameraMove, turnedDir, camera.focalLength};
+}
+
+struct RenderTotals
+{
+	double seconds = 0;
+	double pixelSamples = 0; // primary rays
+};
+
+// Renders all frames and cameras, on the workers if distributed isn't null
+template <typename SceneType>
+RenderTotals renderAll(SceneType& scene, const Options& options, ThreadPool& threadPool,
+	DistributedRenderer* distributed = nullptr)
+{
+	SWScreen screen{options.width, options.height};
+	SWScreen accumulated{options.width, options.height};
+	RenderTotals totals;
+	int imageIndex = 0;
+
+	// One history per camera
+	std::vector<TemporalRenderer> temporalRenderers;
+	for (size_t i = 0; options.temporal && i < options.cameras.size(); ++i)
+		temporalRenderers.emplace_back(options.width, options.height);
+
+	// One governor per camera, each starting at the given settings
+	std::vector<FrameGovernor> governors;
+	GovernorSettings governorSettings;
+	governorSettings.targetSeconds = options.governorSeconds;
+	for (size_t i = 0; options.governorSeconds > 0 && i < options.cameras.size(); ++i)
+		governors.emplace_back(options.settings, governorSettings);
+
+	for (int frame = 0; frame < options.frames; ++frame)
+	{
+		// The static scenes are AcceleratedScenes; a BasicScene may have moved since the last frame
+		using SceneT = std::decay_t<decltype(scene.getScene())>;
+		if (distributed && (frame == 0 || std::is_same_v<SceneT, BasicScene>))
+			distributed->setScene(toAcceleratedScene(scene.getScene()));
+
+		for (size_t cameraIndex = 0; cameraIndex < options.cameras.size(); ++cameraIndex)
+		{
+			const Camera camera = getFrameCamera(options.cameras[cameraIndex], frame, options);
+			const auto beginTimepoint = std::chrono::steady_clock::now();
+
+			accumulated.clear();
+			stats::Counters counters;
+			FrameStats frameStats;
+			if (options.temporal)
+			{
+				// Moving objects would leave stale colors behind
+				if (std::is_same_v<SceneT, BasicScene>)
+					temporalRenderers[cameraIndex].reset();
+
+				const int tracedCount = temporalRenderers[cameraIndex].renderFrame(scene.getScene(), accumulated, camera,
+					threadPool, options.settings);
+				totals.pixelSamples += double(tracedCount) * options.settings.samplesPerPixel;
+				std::cout << "temporal: " << tracedCount << " of " << temporalRenderers[cameraIndex].getPixelCount() << " pixels traced\n";
+			}
+			else if (!governors.empty())
+			{
+				// Rendered at the governor's resolution and upscaled, as the window does
+				FrameGovernor& governor = governors[cameraIndex];
+				const int level = governor.getLevel();
+				const RenderSettings settings = governor.getRenderSettings();
+				const vec2i renderSize = governor.getRenderSize(options.width, options.height);
+				SWScreen governed{renderSize.x, renderSize.y};
+				const auto renderBeginTimepoint = std::chrono::steady_clock::now();
+				parallelRender(scene.getScene(), governed, camera, threadPool, std::nullopt, settings);
+				const auto renderEndTimepoint = std::chrono::steady_clock::now();
+				copyScaled(governed, accumulated);
+
+				const double renderSeconds = std::chrono::duration<double>{renderEndTimepoint - renderBeginTimepoint}.count();
+				governor.addFrameTime(renderSeconds, level);
+				totals.pixelSamples += double(renderSize.x) * renderSize.y * settings.samplesPerPixel;
+				std::cout << "governor: level " << level << " of " << governor.getLevelCount() << " (" << settings.samplesPerPixel
+					<< " spp, depth " << settings.path.maxDepth << ", " << renderSize.x << "x" << renderSize.y
+					<< ") rendered in " << renderSeconds << " s, next level " << governor.getLevel() << "\n";
+			}
+			else if (options.errorThreshold > 0)
+			{
+				ProgressiveSettings progressiveSettings;
+				progressiveSettings.errorThreshold = options.errorThreshold;
+				progressiveSettings.maxPasses = options.samples;
+				progressiveSettings.minPasses = std::min(progressiveSettings.minPasses, options.samples);
+
+				ProgressiveRenderer progressive{options.width, options.height, progressiveSettings};
+				while (!progressive.isConverged())
+					progressive.renderPass(scene.getScene(), camera, threadPool, options.settings);
+				progressive.resolve(accumulated);
+				totals.pixelSamples += double(progressive.getSampleCount());
+
+				const double pixelCount = double(options.width) * options.height;
+				std::cout << "progressive: " << progressive.getPassCount() << " passes, "
+					<< double(progressive.getSampleCount()) / pixelCount << " samples per pixel on average\n";
+			}
+			else
+			{
+				for (int sample = 0; sample < options.samples; ++sample)
+				{
+					RenderSettings settings = options.settings;
+					settings.sampleIndex = uint32_t(sample);
+					FrameStats passStats;
+					if (distributed)
+						distributed->render(screen, camera, settings);
+					else
+						parallelRender(scene.getScene(), screen, camera, threadPool, std::nullopt, settings,
+							options.printStats ? &passStats : nullptr);
+					counters.merge(passStats.counters);
+
+					// Every pass renders the same tiles; the heatmap shows their time over all passes
+					if (frameStats.tileSeconds.empty())
+						frameStats = std::move(passStats);
+					else
+						for (size_t i = 0; i < passStats.tileSeconds.size(); ++i)
+							frameStats.tileSeconds[i] += passStats.tileSeconds[i];
+
+					for (int y = 0; y < options.height; ++y)
+						for (int x = 0; x < options.width; ++x)
+							accumulated.putPixel({x, y}, accumulated.getPixel({x, y}) + screen.getPixel({x, y}) / float(options.samples));
+				}
+				totals.pixelSamples += double(options.width) * options.height * options.samples * options.settings.samplesPerPixel;
+			}
+
+			const auto endTimepoint = std::chrono::steady_clock::now();
+			const double seconds = std::chrono::duration<double>{endTimepoint - beginTimepoint}.count();
+			totals.seconds += seconds;
+
+			const auto path = formatPath(options.output, imageIndex);
+			writeImage(accumulated, path);
+			std::cout << "frame " << frame << " image " << imageIndex << " [seconds]: " << seconds << " -> " << path << "\n";
+			if (options.printStats)
+			{
+				stats::print(std::cout, counters);
+				if (stats::enabled)
+					writeImage(makeTileHeatmap(frameStats, options.width, options.height), getHeatmapPath(path));
+			}
+			++imageIndex;
+		}
+
+		scene.update();
+	}
+
+	return totals;
+}
+
+int main(int argc, char** argv)
+{
+	try
+	{
+		const Options options = parseOptions(argc, argv);
+		if (options.simdIsa)
+			simd::setIsa(*options.simdIsa);
+		ThreadPool threadPool{options.threads};
+		if (!options.workerAddress.empty())
+			runWorker(options.workerAddress, threadPool);
+
+		std::optional<DistributedRenderer> distributed;
+		if (!options.workers.empty())
+			distributed.emplace(options.workers, threadPool);
+		DistributedRenderer* distributedPtr = distributed ? &*distributed : nullptr;
+
+		RenderTotals totals;
+		const auto setupTimepoint = std::chrono::steady_clock::now();
+		if (options.sceneName == "example")
+		{
+			ExampleScene scene;
+			printSetupTime(setupTimepoint);
+			totals = renderAll(scene, options, threadPool, distributedPtr);
+		}
+		else if (options.sceneName == "example-lit")
+		{
+			ExampleScene scene{true};
+			printSetupTime(setupTimepoint);
+			totals = renderAll(scene, options, threadPool, distributedPtr);
+		}
+		else if (options.sceneName == "spheres")
+		{
+			SphereFieldScene scene{10000, 1, options.cachePath};
+			printSetupTime(setupTimepoint);
+			totals = renderAll(scene, options, threadPool, distributedPtr);
+		}
+		else if (options.sceneName == "triangles")
+		{
+			TriangleSoupScene scene{100000, 1, options.cachePath};
+			printSetupTime(setupTimepoint);
+			totals = renderAll(scene, options, threadPool, distributedPtr);
+		}
+		else if (isMeshFile(options.sceneName) && options.outOfCoreBudget > 0)
+		{
+			OutOfCoreMeshScene scene{options.sceneName, threadPool, options.cachePath, options.outOfCoreBudget};
+			printSetupTime(setupTimepoint);
+			totals = renderAll(scene, options, threadPool, distributedPtr);
+
+			const auto paging = scene.getScene().getPagingStats();
+			std::cout << "paging: " << paging.pageIns << " chunks paged in, " << paging.evictions << " dropped, peak resident [MB]: "
+				<< double(paging.peakResidentBytes) / double(1 << 20) << "\n";
+		}
+		else if (isMeshFile(options.sceneName))
+		{
+			MeshFileScene scene{options.sceneName, threadPool, options.cachePath};
+			printSetupTime(setupTimepoint);
+			totals = renderAll(scene, options, threadPool, distributedPtr);
+		}
+		else
+			throw std::invalid_argument("Unknown scene " + options.sceneName);
+
+		if (distributed)
+			printWorkerStats(*distributed);
+		std::cout << "total render [seconds]: " << totals.seconds
+			<< ", primary Mrays/s: " << totals.pixelSamples / 1e6 / totals.seconds << "\n";
+	}
+	catch (const std::invalid_argument& e)
+	{
+		std::cerr << e.what() << "\n\n";
+		printUsage();
+		return 2;
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << e.what() << "\n";
+		return 1;
+	}
+}
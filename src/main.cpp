@@ -1,25 +1,17 @@
 #include "SDLWindow.h"
 #include "SDLScreen.h"
-#include "BasicScene.h"
+#include "Scenes.h"
 #include "ParallelRendering.h"
+#include "Progressive.h"
+#include "FramePipeline.h"
+#include "FrameGovernor.h"
 #include "ThreadPool.h"
 #include <vector>
+#include <optional>
 #include <chrono>
 #include <ratio>
 #include <iostream>
 
-class ExampleScene {
-public:
-	ExampleScene();
-	void update(); // simple animations
-
-	const BasicScene& getScene() const { return basicScene; }
-
-private:
-	BasicScene basicScene;
-	float time = 0.f; // used in animation
-};
-
 void waitForEvents();
 void pollEvents();
 
@@ -45,28 +37,43 @@ int main()
 	ThreadPool threadPool;
 
 	bool isStatic = true;
-	// Static image
+	// Static image, refined pass by pass until it converges
 	if (isStatic)
 	{
-		//parallelRender(scene, sdlScreen, camera, threadPool, 8);
-		timedCall<std::ratio<1>>("parallel render [seconds]: ",
-			&parallelRender<decltype(scene.getScene()), decltype(sdlScreen)>,
-			scene.getScene(), sdlScreen, camera, threadPool, 8, std::nullopt);
-		sdlWindow.swapBuffers();
+		ProgressiveRenderer progressive{sdlScreen.getW(), sdlScreen.getH()};
+		timedCall<std::ratio<1>>("progressive render [seconds]: ", [&] {
+			while (!progressive.isConverged())
+			{
+				pollEvents();
+				progressive.renderPass(scene.getScene(), camera, threadPool);
+				progressive.resolve(sdlScreen);
+				sdlScreen.present();
+			}
+		});
 		waitForEvents();
 	}
-	// Animated scene
+	// Animated scene, presenting each frame while the next one renders
+	// The governor lowers quality and resolution as needed to keep frames within its target time.
 	else
 	{
+		FrameGovernor governor;
+		FramePipeline pipeline{scene, threadPool, sdlScreen.getW(), sdlScreen.getH()};
+		std::optional<int> renderingLevel; // of the frame in flight
 		while (true)
 		{
 			pollEvents();
-			sdlScreen.clear();
 
-			parallelRender(scene.getScene(), sdlScreen, camera, threadPool, 8);
-			scene.update();
+			const int level = governor.getLevel();
+			const vec2i renderSize = governor.getRenderSize(sdlScreen.getW(), sdlScreen.getH());
+			pipeline.setFrameSettings(governor.getRenderSettings(), renderSize.x, renderSize.y);
+			pipeline.advance(camera, [&](const SWScreen& image) {
+				copyScaled(image, sdlScreen);
+				sdlScreen.present();
+			});
 
-			sdlWindow.swapBuffers();
+			if (renderingLevel)
+				governor.addFrameTime(*pipeline.getLastRenderSeconds(), *renderingLevel);
+			renderingLevel = level;
 		}
 	}
 }
@@ -94,76 +101,3 @@ void waitForEvents()
 			exit(0);
 	}
 }
-
-ExampleScene::ExampleScene() :
-	basicScene{{
-	Object{
-		Sphere{-5, 2.0, -10, 2.5},
-		[] (const Object& obj, vec3f p) {
-			return Material{{0.8,0.8,0.8}, 0.8, 0};
-		}
-	},
-	Object{
-		Sphere{5, 2.0, -10, 2.5},
-		[] (const Object& obj, vec3f p) {
-			const Sphere& sphere = std::get<Sphere>(obj.shape);
-			//float xt = (p.x-sphere.pos.x) / sphere.radius;
-			float yt = (p.y-sphere.pos.y) / sphere.radius;
-			RgbColor color = {
-				0.5f+0.5f*sin(yt*3.14159f*20),
-				0.2f,
-				0.2f
-			};
-			return Material{color, 0.8};
-		}
-	},
-	Object{
-		Sphere{0, 0.8, -7, 1.5},
-		[] (const Object& obj, vec3f p) {
-			return Material{{0.8,0.0,0.0}, 0.8, 0};
-		}
-	},
-	Object{
-		Sphere{2, 0.5, -5, 0.8},
-		[] (const Object& obj, vec3f p) {
-			return Material{{0.8,0.8,0.0}, 0.8};
-		}
-	},
-	Object{
-		Sphere{-2, 0.5, -5, 0.8},
-		[] (const Object& obj, vec3f p) {
-			return Material{{0.0,0.8,0.0}, 0.8};
-		}
-	},
-	// Floor triangle 1
-	Object{
-		Triangle{{
-				{-16, -0.7,  16},
-				{ 16, -0.7,  16},
-				{-16, -0.7, -16}
-		}},
-		[] (const Object& obj, vec3f p) {
-			return Material{{0.6f, 0.6f, 0.6f}, 0.8f};
-		}
-	},
-	// Floor triangle 2
-	Object{
-		Triangle{{
-				{-16, -0.7, -16},
-				{ 16, -0.7,  16},
-				{ 16, -0.7, -16}
-		}},
-		[] (const Object& obj, vec3f p) {
-			return Material{{0.6f, 0.6f, 0.6f}, 0.8f};
-		}
-	}
-}}
-{}
-
-void ExampleScene::update()
-{
-	std::get<Sphere>(basicScene.objects[0].shape).pos.y += cos(time)*0.2f;
-	std::get<Sphere>(basicScene.objects[1].shape).pos.y += cos(time+4.8f)*0.1f;
-	std::get<Sphere>(basicScene.objects[2].shape).pos.y += cos(time+4.8f)*0.1f;
-	time += 0.1f;
-}